@@ -3,15 +3,71 @@
 
 #include <vector>
 #include <fstream>
+#include <functional>
 #include <cstdint>
 #include <string>
 #include <initializer_list>
+#include <limits>
+#include <map>
 #include <array>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstddef>
+#include <cctype>
+#include <cmath>
+#include <complex>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+// SIMD kernels are compiled per instruction set and selected at runtime,
+// so the header itself still builds without any -m flags.
+// Define IMGPROC_NO_SIMD to force the portable scalar code paths.
+#if !defined(IMGPROC_NO_SIMD) && (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#define IMGPROC_X86_SIMD 1
+#include <immintrin.h>
+#define IMGPROC_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+// MappedBMP maps files with mmap where available and reads them into memory elsewhere
+#if defined(__unix__) || defined(__APPLE__)
+#define IMGPROC_HAS_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Define IMGPROC_PROFILE to count and time the public operations, see Profiler.
+// Without it the instrumentation compiles to nothing.
+#ifdef IMGPROC_PROFILE
+#define IMGPROC_PROFILE_SCOPE(name, bytes) \
+    static detail::ProfileSite imgprocProfileSite(name); \
+    detail::ProfileScope imgprocProfileScope(imgprocProfileSite, (bytes))
+// For operations that learn their size as they go, like fromFile
+#define IMGPROC_PROFILE_BYTES(count) (imgprocProfileScope.bytes = (count))
+namespace detail { inline void profileAllocation() noexcept; }
+#else
+#define IMGPROC_PROFILE_SCOPE(name, bytes) ((void)0)
+#define IMGPROC_PROFILE_BYTES(count) ((void)0)
+#endif
 
 constexpr std::size_t COLOR_TABLE_SIZE = 256;
 
+// Pixel buffers start on a cache line boundary
+constexpr std::size_t BUFFER_ALIGNMENT = 64;
+
 // Follow the naming convention of wingdi.h
 #pragma pack(push, 1)
 struct RGBTRIPLE {
@@ -64,498 +120,6459 @@ enum class Channel {
     RED,
 };
 
-struct Matrix : std::vector<std::vector<double>>
+// How neighborhood operations treat pixels outside the image
+enum class BorderMode {
+    REPLICATE,  // aaa|abcd|ddd
+    REFLECT,    // cb|abcd|cb, the edge pixel is not repeated
+    CONSTANT,   // vvv|abcd|vvv for a given value v
+    WRAP,       // bcd|abcd|abc
+};
+
+// How doubles are brought back into the 0-255 range of a byte
+enum class Narrowing {
+    TRUNCATE,   // Drop the fraction and keep the low 8 bits, like static_cast<uint8_t>
+    SATURATE,   // Drop the fraction and clamp to 0-255
+};
+
+// Tag for constructors that skip zero-filling, for buffers that are about
+// to be overwritten in full
+struct Uninitialized {};
+constexpr Uninitialized UNINITIALIZED {};
+
+// Where the pixel and element buffers of grids, images and matrices come
+// from. A buffer is taken from the allocator installed on the current thread
+// by an AllocatorScope, else from the default set with setDefault, else from
+// operator new, and is given back to the same allocator when it is freed.
+// allocate returns BUFFER_ALIGNMENT aligned memory or throws std::bad_alloc.
+class BufferAllocator
+{
+public:
+    virtual ~BufferAllocator() = default;
+    virtual void* allocate(std::size_t bytes) = 0;
+    virtual void deallocate(void* p, std::size_t bytes) noexcept = 0;
+
+    // Used by every thread, so it must be thread-safe; nullptr restores operator new
+    static void setDefault(BufferAllocator* allocator) noexcept;
+    static BufferAllocator* current() noexcept;
+};
+
+// Routes the buffer allocations of this thread to `allocator` until it goes
+// out of scope. Scopes nest; pool workers keep using the default.
+class AllocatorScope
+{
+public:
+    explicit AllocatorScope(BufferAllocator& allocator) noexcept;
+    AllocatorScope(const AllocatorScope&) = delete;
+    AllocatorScope& operator=(const AllocatorScope&) = delete;
+    ~AllocatorScope();
+
+private:
+    BufferAllocator* previous;
+};
+
+// Owning, cache-line aligned storage for trivially copyable elements
+template <typename T>
+class AlignedBuffer {
+private:
+    void* raw;
+    T* ptr;
+    std::size_t count;
+    BufferAllocator* source;    // nullptr for operator new
+
+    // Only for a buffer that holds nothing; the members are set once the
+    // allocation has succeeded
+    void allocate(std::size_t n) {
+        raw = nullptr;
+        ptr = nullptr;
+        count = 0;
+        source = nullptr;
+        if (n == 0) return;
+
+        BufferAllocator* from = BufferAllocator::current();
+        if (from) {
+            raw = from->allocate(n * sizeof(T));
+            ptr = static_cast<T*>(raw);
+        } else {
+            raw = ::operator new(n * sizeof(T) + BUFFER_ALIGNMENT - 1);
+            std::uintptr_t address = reinterpret_cast<std::uintptr_t>(raw);
+            ptr = reinterpret_cast<T*>((address + BUFFER_ALIGNMENT - 1) & ~(BUFFER_ALIGNMENT - 1));
+        }
+        count = n;
+        source = from;
+#ifdef IMGPROC_PROFILE
+        detail::profileAllocation();
+#endif
+    }
+
+    void release() noexcept {
+        if (source) source->deallocate(raw, count * sizeof(T));
+        else ::operator delete(raw);
+    }
+
+public:
+    AlignedBuffer() noexcept : raw(nullptr), ptr(nullptr), count(0), source(nullptr) {}
+    explicit AlignedBuffer(std::size_t n) { allocate(n); }     // Uninitialized
+    AlignedBuffer(const AlignedBuffer& other) {
+        allocate(other.count);
+        if (count) std::memcpy(ptr, other.ptr, count * sizeof(T));
+    }
+    AlignedBuffer(AlignedBuffer&& other) noexcept : raw(other.raw), ptr(other.ptr), count(other.count), source(other.source) {
+        other.raw = nullptr;
+        other.ptr = nullptr;
+        other.count = 0;
+        other.source = nullptr;
+    }
+    ~AlignedBuffer() { release(); }
+
+    AlignedBuffer& operator=(const AlignedBuffer& other) {
+        if (this == &other) return *this;
+        // Copy and swap, so a failed allocation leaves this buffer as it was
+        if (count != other.count) return *this = AlignedBuffer(other);
+        if (count) std::memcpy(ptr, other.ptr, count * sizeof(T));
+        return *this;
+    }
+    AlignedBuffer& operator=(AlignedBuffer&& other) noexcept {
+        std::swap(raw, other.raw);
+        std::swap(ptr, other.ptr);
+        std::swap(count, other.count);
+        std::swap(source, other.source);
+        return *this;
+    }
+
+    T* data() noexcept { return ptr; }
+    const T* data() const noexcept { return ptr; }
+    std::size_t size() const noexcept { return count; }
+};
+
+// Lightweight handle to one row, so that img[y][x] keeps working
+template <typename T>
+struct Row {
+    T* ptr;
+    int width;
+
+    Row(T* ptr, int width) noexcept : ptr(ptr), width(width) {}
+    T& operator[](int x) const noexcept { return ptr[x]; }
+    T& at(int x) const {
+        if (x < 0 || x >= width) throw std::out_of_range("Column " + std::to_string(x) + " out of range! Row width is " + std::to_string(width));
+        return ptr[x];
+    }
+    T* data() const noexcept { return ptr; }
+    T* begin() const noexcept { return ptr; }
+    T* end() const noexcept { return ptr + width; }
+    std::size_t size() const noexcept { return width; }
+};
+
+namespace detail {
+
+inline void checkRegion(const std::string& what, const char* owner, int width, int height, int y, int x, int h, int w) {
+    std::string lower = what;
+    lower[0] = static_cast<char>(std::tolower(lower[0]));
+
+    if (y + h > height || x + w > width)
+        throw std::runtime_error(what + " out of bounds! " + owner + " size is " + std::to_string(width) + "x" + std::to_string(height) + ", requested " + lower + " size is " + std::to_string(w) + "x" + std::to_string(h) + " at position " + std::to_string(x) + "," + std::to_string(y));
+
+    if (y < 0 || x < 0 || h < 0 || w < 0)
+        throw std::runtime_error(what + " size and position must be positive! Got " + std::to_string(w) + "x" + std::to_string(h) + " at position " + std::to_string(x) + "," + std::to_string(y));
+}
+
+} // namespace detail
+
+// Non-owning window into a grid: an origin, a size and the parent's stride.
+// Views never allocate; they are only valid while the parent is alive.
+template <typename T>
+struct GridView
+{
+    int width, height;
+
+    GridView() noexcept : width(0), height(0), origin(nullptr), rowStride(0) {}
+    GridView(T* origin, int height, int width, std::ptrdiff_t stride) noexcept : width(width), height(height), origin(origin), rowStride(stride) {}
+
+    // A mutable view converts to a read-only one
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    GridView(const GridView<U>& other) noexcept : width(other.width), height(other.height), origin(other.data()), rowStride(other.stride()) {}
+
+    Row<T> operator[](int y) const noexcept { return Row<T>(origin + y * rowStride, width); }
+    Row<T> at(int y) const {
+        if (y < 0 || y >= height) throw std::out_of_range("Row " + std::to_string(y) + " out of range! Height is " + std::to_string(height));
+        return (*this)[y];
+    }
+    GridView subview(int y, int x, int h, int w) const {
+        detail::checkRegion("Region", "Image", width, height, y, x, h, w);
+        return GridView(origin + y * rowStride + x, h, w, rowStride);
+    }
+
+    T* data() const noexcept { return origin; }
+    std::ptrdiff_t stride() const noexcept { return rowStride; }
+    std::size_t size() const noexcept { return height; }    // Number of rows
+    bool empty() const noexcept { return width == 0 || height == 0; }
+
+protected:
+    T* origin;
+    std::ptrdiff_t rowStride;
+};
+
+// Two-dimensional array stored as a single contiguous buffer.
+// Rows are `stride()` elements apart; owning grids are tightly packed,
+// so `data()` can also be treated as a flat span of height * width elements.
+template <typename T>
+struct Grid
+{
+    int width, height;
+
+    Grid() noexcept : width(0), height(0), rowStride(0) {}
+    Grid(int height, int width);            // Zero-filled
+    Grid(int height, int width, Uninitialized);
+    Grid(int height, int width, const T& value);
+    Grid(const Grid&) = default;
+    Grid(Grid&&) = default;
+    Grid& operator=(const Grid& other);     // Unchanged if the copy cannot allocate
+    Grid& operator=(Grid&&) = default;
+
+    Row<T> operator[](int y) noexcept { return Row<T>(buffer.data() + y * rowStride, width); }
+    Row<const T> operator[](int y) const noexcept { return Row<const T>(buffer.data() + y * rowStride, width); }
+    Row<T> at(int y);
+    Row<const T> at(int y) const;
+
+    T* data() noexcept { return buffer.data(); }
+    const T* data() const noexcept { return buffer.data(); }
+    std::ptrdiff_t stride() const noexcept { return rowStride; }
+    std::size_t size() const noexcept { return height; }    // Number of rows
+    bool empty() const noexcept { return width == 0 || height == 0; }
+
+    GridView<T> view() noexcept { return GridView<T>(buffer.data(), height, width, rowStride); }
+    GridView<const T> view() const noexcept { return GridView<const T>(buffer.data(), height, width, rowStride); }
+
+protected:
+    std::ptrdiff_t rowStride;
+    AlignedBuffer<T> buffer;
+};
+
+// Region of interest of a GrayImage or RGBImage, writable with toFile
+template <typename T>
+struct ImageView : GridView<T>
+{
+    ImageView() noexcept {}
+    ImageView(const GridView<T>& view) noexcept : GridView<T>(view) {}
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    ImageView(const ImageView<U>& other) noexcept : GridView<T>(other) {}
+
+    ImageView roi(int y, int x, int h, int w) const { return this->subview(y, x, h, w); }
+    const ImageView& toFile(const std::string& filename) const;
+};
+
+// Element types are uint8_t, uint16_t, int16_t, int32_t, float or double;
+// Matrix is the double version, which also has the matrix product, the
+// convolutions and the FFT. Converting between element types is always
+// explicit, with convertTo.
+template <typename T> struct MatrixT;
+template <typename T> struct MatrixViewT;
+typedef MatrixT<double> Matrix;
+typedef MatrixViewT<double> MatrixView;
+
+template <typename L, typename R, typename Op> struct MatrixBinaryExpr;
+template <typename E, typename Op, bool ScalarLeft> struct MatrixScalarExpr;
+template <typename E> struct MatrixNegateExpr;
+template <int H, int W, typename Scalar = double> struct FixedMatrix;
+
+namespace detail {
+
+// Element type of a matrix expression, known before the node is complete
+template <typename E> struct ExprValue;
+template <typename T> struct ExprValue<MatrixT<T>> { typedef T type; };
+template <typename T> struct ExprValue<MatrixViewT<T>> { typedef T type; };
+template <typename L, typename R, typename Op> struct ExprValue<MatrixBinaryExpr<L, R, Op>> { typedef typename ExprValue<L>::type type; };
+template <typename E, typename Op, bool ScalarLeft> struct ExprValue<MatrixScalarExpr<E, Op, ScalarLeft>> { typedef typename ExprValue<E>::type type; };
+template <typename E> struct ExprValue<MatrixNegateExpr<E>> { typedef typename ExprValue<E>::type type; };
+
+} // namespace detail
+
+// Element-wise Matrix arithmetic builds lazy expression nodes instead of
+// temporaries; the whole chain runs as one fused loop when it is assigned.
+// Nodes hold their Matrix operands by reference, so `auto e = a + b;` must not
+// outlive `a` and `b`. Assign to a Matrix (or call eval()) to materialize.
+// Arithmetic stays in the element type, so integer matrices wrap around.
+template <typename E>
+struct MatrixExpr {
+    typedef typename detail::ExprValue<E>::type value_type;
+
+    const E& self() const noexcept { return static_cast<const E&>(*this); }
+    MatrixT<value_type> eval() const;
+    MatrixT<value_type> transpose() const;
+    MatrixT<value_type> T() const;
+    template <typename F> double dot(const MatrixExpr<F>& other) const;    // Frobenius inner product
+    template <int H, int W, typename K> double dot(const FixedMatrix<H, W, K>& kernel) const;
+};
+
+namespace detail {
+
+// Nested expressions are cheap to copy; Matrix leaves are referenced
+template <typename E> struct ExprOperand { typedef E type; };
+template <typename T> struct ExprOperand<MatrixT<T>> { typedef const MatrixT<T>& type; };
+
+template <typename E>
+using ExprRow = decltype(std::declval<const E&>().evalRow(0));
+
+struct AssignOp {
+    template <typename T> static T apply(T, T b) noexcept { return b; }
+};
+
+struct AddOp {
+    static const char* name() noexcept { return "add"; }
+    template <typename T> static constexpr T apply(T a, T b) noexcept { return static_cast<T>(a + b); }
+};
+
+struct SubOp {
+    static const char* name() noexcept { return "subtract"; }
+    template <typename T> static constexpr T apply(T a, T b) noexcept { return static_cast<T>(a - b); }
+};
+
+struct MulOp {
+    template <typename T> static constexpr T apply(T a, T b) noexcept { return static_cast<T>(a * b); }
+};
+
+inline std::string shapeMismatch(const char* action, int w1, int h1, int w2, int h2) {
+    return std::string("Cannot ") + action + " matrices with different shapes! Got " + std::to_string(w1) + "x" + std::to_string(h1) + " and " + std::to_string(w2) + "x" + std::to_string(h2);
+}
+
+} // namespace detail
+
+// Element-wise `lhs op rhs` for two matrices of the same shape
+template <typename L, typename R, typename Op>
+struct MatrixBinaryExpr : MatrixExpr<MatrixBinaryExpr<L, R, Op>>
+{
+    typedef typename detail::ExprValue<L>::type value_type;
+    static_assert(std::is_same<value_type, typename detail::ExprValue<R>::type>::value, "Matrix operands must have the same element type; convert one with convertTo");
+
+    typename detail::ExprOperand<L>::type lhs;
+    typename detail::ExprOperand<R>::type rhs;
+    int width, height;
+
+    struct RowEval {
+        detail::ExprRow<L> l;
+        detail::ExprRow<R> r;
+        value_type operator[](int x) const noexcept { return Op::template apply<value_type>(l[x], r[x]); }
+    };
+
+    MatrixBinaryExpr(const L& lhs, const R& rhs) : lhs(lhs), rhs(rhs), width(lhs.width), height(lhs.height) {
+        if (lhs.width != rhs.width || lhs.height != rhs.height)
+            throw std::runtime_error(detail::shapeMismatch(Op::name(), lhs.width, lhs.height, rhs.width, rhs.height));
+    }
+    RowEval evalRow(int y) const noexcept { return { lhs.evalRow(y), rhs.evalRow(y) }; }
+    RowEval operator[](int y) const noexcept { return evalRow(y); }
+};
+
+// Element-wise `matrix op scalar`, or `scalar op matrix` when ScalarLeft is set
+template <typename E, typename Op, bool ScalarLeft>
+struct MatrixScalarExpr : MatrixExpr<MatrixScalarExpr<E, Op, ScalarLeft>>
 {
+    typedef typename detail::ExprValue<E>::type value_type;
+
+    typename detail::ExprOperand<E>::type operand;
+    value_type scalar;
     int width, height;
-    Matrix(int height, int width) noexcept;
-    Matrix(int height, int width, double value) noexcept;
-    Matrix(std::initializer_list<std::initializer_list<double>> list);
-    Matrix operator-() const noexcept;          // Component-wise negation
-    Matrix operator+(const Matrix& other) const;
-    Matrix operator-(const Matrix& other) const;
-    Matrix operator*(const Matrix& other) const;
-    Matrix operator+(double scalar) const noexcept;
-    Matrix operator-(double scalar) const noexcept;
-    Matrix operator*(double scalar) const noexcept;
-    friend Matrix operator+(double scalar, const Matrix& matrix) noexcept;
-    friend Matrix operator-(double scalar, const Matrix& matrix) noexcept;
-    friend Matrix operator*(double scalar, const Matrix& matrix) noexcept;
-    Matrix& operator+= (const Matrix& other);
-    Matrix& operator-= (const Matrix& other);
-    Matrix& operator*= (const Matrix& other);
-    Matrix& operator+= (double scalar) noexcept;
-    Matrix& operator-= (double scalar) noexcept;
-    Matrix& operator*= (double scalar) noexcept;
-    bool operator==(const Matrix& other) const noexcept;
-    bool operator!=(const Matrix& other) const noexcept;
-    Matrix transpose() const noexcept;
-    Matrix T() const noexcept;
-    double dot(const Matrix& other) const;
-    Matrix submatrix(int y, int x, int h, int w) const;
-};
-
-struct GrayImage : std::vector<std::vector<uint8_t>>
+
+    struct RowEval {
+        detail::ExprRow<E> m;
+        value_type scalar;
+        value_type operator[](int x) const noexcept { return ScalarLeft ? Op::template apply<value_type>(scalar, m[x]) : Op::template apply<value_type>(m[x], scalar); }
+    };
+
+    MatrixScalarExpr(const E& operand, value_type scalar) noexcept : operand(operand), scalar(scalar), width(operand.width), height(operand.height) {}
+    RowEval evalRow(int y) const noexcept { return { operand.evalRow(y), scalar }; }
+    RowEval operator[](int y) const noexcept { return evalRow(y); }
+};
+
+// Component-wise negation
+template <typename E>
+struct MatrixNegateExpr : MatrixExpr<MatrixNegateExpr<E>>
 {
+    typedef typename detail::ExprValue<E>::type value_type;
+
+    typename detail::ExprOperand<E>::type operand;
     int width, height;
+
+    struct RowEval {
+        detail::ExprRow<E> m;
+        value_type operator[](int x) const noexcept { return static_cast<value_type>(-m[x]); }
+    };
+
+    explicit MatrixNegateExpr(const E& operand) noexcept : operand(operand), width(operand.width), height(operand.height) {}
+    RowEval evalRow(int y) const noexcept { return { operand.evalRow(y) }; }
+    RowEval operator[](int y) const noexcept { return evalRow(y); }
+};
+
+template <typename Scalar>
+struct MatrixT : Grid<Scalar>, MatrixExpr<MatrixT<Scalar>>
+{
+    using Grid<Scalar>::width;
+    using Grid<Scalar>::height;
+    using Grid<Scalar>::data;
+    using Grid<Scalar>::stride;
+
+    MatrixT(int height, int width);
+    MatrixT(int height, int width, Uninitialized);
+    MatrixT(int height, int width, Scalar value);
+    MatrixT(std::initializer_list<std::initializer_list<Scalar>> list);
+    template <typename E> MatrixT(const MatrixExpr<E>& expr);     // Evaluates the expression in a single pass
+    template <typename E> MatrixT& operator=(const MatrixExpr<E>& expr);
+    template <typename E> MatrixT& operator+= (const MatrixExpr<E>& other);
+    template <typename E> MatrixT& operator-= (const MatrixExpr<E>& other);
+    MatrixT& operator*= (const MatrixT& other);  // Matrix product
+    MatrixT& operator+= (Scalar scalar);
+    MatrixT& operator-= (Scalar scalar);
+    MatrixT& operator*= (Scalar scalar);
+    MatrixT transpose() const;
+    MatrixT T() const;
+    MatrixViewT<Scalar> submatrix(int y, int x, int h, int w) const;
+    // Saturates by default: integer targets clamp, and NaN becomes 0
+    template <typename U> MatrixT<U> convertTo(Narrowing narrowing = Narrowing::SATURATE) const;
+    const Scalar* evalRow(int y) const noexcept { return data() + y * stride(); }
+
+    // Double matrices only
+    Matrix convolve(const Matrix& kernel, BorderMode border = BorderMode::REPLICATE, double value = 0) const;
+    template <int H, int W, typename K> Matrix convolve(const FixedMatrix<H, W, K>& kernel, BorderMode border = BorderMode::REPLICATE, double value = 0) const;
+    Matrix fftConvolve(const Matrix& kernel, BorderMode border = BorderMode::REPLICATE, double value = 0) const;
+    Matrix filterFrequencies(const std::function<double(double u, double v)>& transfer) const;    // See Spectrum::applyFilter
+
+private:
+    template <typename E, typename Op> void assign(const MatrixExpr<E>& expr);
+};
+
+// Read-only window into a Matrix, usable anywhere a matrix expression is
+template <typename Scalar>
+struct MatrixViewT : GridView<const Scalar>, MatrixExpr<MatrixViewT<Scalar>>
+{
+    MatrixViewT(const MatrixT<Scalar>& matrix) noexcept : GridView<const Scalar>(matrix.view()) {}
+    MatrixViewT(const GridView<const Scalar>& view) noexcept : GridView<const Scalar>(view) {}
+    MatrixViewT submatrix(int y, int x, int h, int w) const;
+    const Scalar* evalRow(int y) const noexcept { return this->origin + y * this->rowStride; }
+};
+
+template <typename E> MatrixNegateExpr<E> operator-(const MatrixExpr<E>& matrix) noexcept;
+template <typename L, typename R> MatrixBinaryExpr<L, R, detail::AddOp> operator+(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs);
+template <typename L, typename R> MatrixBinaryExpr<L, R, detail::SubOp> operator-(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs);
+template <typename L, typename R> MatrixT<typename MatrixExpr<L>::value_type> operator*(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs);     // Matrix product
+template <typename E> MatrixScalarExpr<E, detail::AddOp, false> operator+(const MatrixExpr<E>& matrix, typename MatrixExpr<E>::value_type scalar) noexcept;
+template <typename E> MatrixScalarExpr<E, detail::SubOp, false> operator-(const MatrixExpr<E>& matrix, typename MatrixExpr<E>::value_type scalar) noexcept;
+template <typename E> MatrixScalarExpr<E, detail::MulOp, false> operator*(const MatrixExpr<E>& matrix, typename MatrixExpr<E>::value_type scalar) noexcept;
+template <typename E> MatrixScalarExpr<E, detail::AddOp, true> operator+(typename MatrixExpr<E>::value_type scalar, const MatrixExpr<E>& matrix) noexcept;
+template <typename E> MatrixScalarExpr<E, detail::SubOp, true> operator-(typename MatrixExpr<E>::value_type scalar, const MatrixExpr<E>& matrix) noexcept;
+template <typename E> MatrixScalarExpr<E, detail::MulOp, true> operator*(typename MatrixExpr<E>::value_type scalar, const MatrixExpr<E>& matrix) noexcept;
+Matrix operator*(const Matrix& lhs, const Matrix& rhs);
+template <typename T> MatrixT<T> operator*(const MatrixT<T>& lhs, const MatrixT<T>& rhs);   // Other element types, without blocking
+template <typename L, typename R> bool operator==(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs) noexcept;
+template <typename L, typename R> bool operator!=(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs) noexcept;
+
+// Matrix whose size is part of its type, for convolution kernels and other
+// small operands. It is an aggregate of its row-major values, so it can be
+// built and combined at compile time:
+//     constexpr FixedMatrix<3, 3, int> smooth = {{ 1, 2, 1, 2, 4, 2, 1, 2, 1 }};
+//     constexpr FixedMatrix<3, 3, double> box = FixedMatrix<3, 3>{{ 1, 1, 1, 1, 1, 1, 1, 1, 1 }} * (1.0 / 9);
+// Loops over a FixedMatrix have constant bounds, so the convolve and dot
+// overloads that take one are fully unrolled, with the taps in registers.
+template <int H, int W, typename Scalar>
+struct FixedMatrix
+{
+    static_assert(H > 0 && W > 0, "FixedMatrix must not be empty");
+    typedef Scalar value_type;
+    static constexpr int height = H;
+    static constexpr int width = W;
+
+    Scalar values[H * W];
+
+    constexpr Scalar operator()(int y, int x) const { return values[y * W + x]; }
+    const Scalar* operator[](int y) const noexcept { return values + y * W; }
+    Scalar* operator[](int y) noexcept { return values + y * W; }
+    constexpr Scalar sum() const;
+    constexpr Scalar dot(const FixedMatrix& other) const;    // Frobenius inner product
+    constexpr FixedMatrix<W, H, Scalar> transpose() const;
+    constexpr FixedMatrix<W, H, Scalar> T() const;
+    template <typename U> constexpr FixedMatrix<H, W, U> convertTo() const;     // static_cast of every value
+    Matrix toMatrix() const;
+};
+
+template <int H, int W, typename S> constexpr FixedMatrix<H, W, S> operator-(const FixedMatrix<H, W, S>& matrix);
+template <int H, int W, typename S> constexpr FixedMatrix<H, W, S> operator+(const FixedMatrix<H, W, S>& lhs, const FixedMatrix<H, W, S>& rhs);
+template <int H, int W, typename S> constexpr FixedMatrix<H, W, S> operator-(const FixedMatrix<H, W, S>& lhs, const FixedMatrix<H, W, S>& rhs);
+template <int H, int K, int W, typename S> constexpr FixedMatrix<H, W, S> operator*(const FixedMatrix<H, K, S>& lhs, const FixedMatrix<K, W, S>& rhs);  // Matrix product
+template <int H, int W, typename S> constexpr FixedMatrix<H, W, S> operator*(const FixedMatrix<H, W, S>& matrix, typename FixedMatrix<H, W, S>::value_type scalar);
+template <int H, int W, typename S> constexpr FixedMatrix<H, W, S> operator*(typename FixedMatrix<H, W, S>::value_type scalar, const FixedMatrix<H, W, S>& matrix);
+template <int H, int W, typename S> constexpr bool operator==(const FixedMatrix<H, W, S>& lhs, const FixedMatrix<H, W, S>& rhs);
+template <int H, int W, typename S> constexpr bool operator!=(const FixedMatrix<H, W, S>& lhs, const FixedMatrix<H, W, S>& rhs);
+
+// Compile-time kernels for convolve. Like every kernel here they are
+// correlated with the image, so the x and y derivatives are positive where
+// values increase to the right and downwards.
+struct FixedKernel
+{
+    static constexpr FixedMatrix<3, 3, int> sobelX();
+    static constexpr FixedMatrix<3, 3, int> sobelY();
+    static constexpr FixedMatrix<3, 3, int> scharrX();
+    static constexpr FixedMatrix<3, 3, int> scharrY();
+    static constexpr FixedMatrix<3, 3, int> prewittX();
+    static constexpr FixedMatrix<3, 3, int> prewittY();
+    static constexpr FixedMatrix<3, 3, int> laplacian();
+    // Row N - 1 of Pascal's triangle, e.g. 1 4 6 4 1 for N = 5
+    template <int N> static constexpr FixedMatrix<1, N, int> binomialRow();
+    // Outer product of two binomial rows; the taps sum to 4^(N - 1)
+    template <int N> static constexpr FixedMatrix<N, N, int> binomial();
+    // binomial<N>() normalized to sum 1: a Gaussian with sigma close to sqrt(N - 1) / 2
+    template <int N> static constexpr FixedMatrix<N, N, double> gaussian();
+};
+
+// Two-dimensional discrete Fourier transform of a real matrix. Real input
+// has a conjugate-symmetric spectrum, so only columns 0 to realWidth / 2
+// are stored; row u holds frequency u for u <= height / 2 and u - height
+// above that. The transforms are mixed-radix FFTs for any size, fastest
+// when the sizes only have factors 2, 3 and 5.
+struct Spectrum : Grid<std::complex<double>>
+{
+    int realWidth;      // Width of the matrix the spectrum belongs to
+
+    Spectrum() noexcept : realWidth(0) {}
+    Spectrum(int height, int realWidth);
+
+    static Spectrum fromMatrix(const Matrix& matrix);   // Forward transform
+    Matrix toMatrix() const;                            // Inverse transform, normalized
+    Spectrum& operator*=(const Spectrum& other);        // Circular convolution of the matrices
+    // Multiplies bin (u, v) by transfer(u, v); u and v are signed frequencies
+    // in cycles per image, so sqrt(u * u + v * v) is the distance from DC
+    Spectrum& applyFilter(const std::function<double(double u, double v)>& transfer);
+};
+
+// Transfer functions for Spectrum::applyFilter; cutoffs are in cycles per image
+struct FrequencyFilter
+{
+    static std::function<double(double, double)> idealLowpass(double cutoff);
+    static std::function<double(double, double)> idealHighpass(double cutoff);
+    static std::function<double(double, double)> butterworthLowpass(double cutoff, int order);
+    static std::function<double(double, double)> butterworthHighpass(double cutoff, int order);
+    static std::function<double(double, double)> gaussianLowpass(double cutoff);
+    static std::function<double(double, double)> gaussianHighpass(double cutoff);
+};
+
+// 256-entry table mapping every byte value to a new one. Gamma, contrast
+// stretches, thresholds and inversions of 8-bit images are all just tables.
+struct LookupTable
+{
+    std::array<uint8_t, COLOR_TABLE_SIZE> table;
+
+    uint8_t operator[](uint8_t value) const noexcept { return table[value]; }
+    uint8_t& operator[](uint8_t value) noexcept { return table[value]; }
+
+    static LookupTable identity() noexcept;
+    // fn(value) may return any arithmetic type; the result is narrowed like fromMatrix
+    template <typename F>
+    static LookupTable fromFunction(F fn, Narrowing narrowing = Narrowing::TRUNCATE);
+    static LookupTable fromMatrix(const Matrix& matrix, int row = 0, Narrowing narrowing = Narrowing::TRUNCATE);
+    // Applying the result equals applying `first` and then `second`
+    static LookupTable compose(const LookupTable& first, const LookupTable& second) noexcept;
+};
+
+template <typename T, int Channels> struct Image;
+typedef Image<uint8_t, 1> GrayImage;
+typedef Image<uint8_t, 3> RGBImage;
+
+namespace detail {
+
+// Pixel of an Image<T, Channels>: the value itself for one channel, channels
+// in blue, green, red order otherwise. 8-bit colour pixels are RGBTRIPLEs.
+template <typename T, int Channels> struct PixelType { typedef std::array<T, Channels> type; };
+template <typename T> struct PixelType<T, 1> { typedef T type; };
+template <> struct PixelType<uint8_t, 3> { typedef RGBTRIPLE type; };
+
+} // namespace detail
+
+// Image with `Channels` interleaved values of type T per pixel, for the
+// uint16_t, int16_t, int32_t and float stages of a pipeline. GrayImage and
+// RGBImage are the 8-bit versions, which also read and write BMP files.
+template <typename T, int Channels>
+struct Image : Grid<typename detail::PixelType<T, Channels>::type>
+{
+    typedef typename detail::PixelType<T, Channels>::type Pixel;
+
+    Image() noexcept {}
+    Image(int height, int width) : Grid<Pixel>(height, width) {}
+    Image(int height, int width, Uninitialized) : Grid<Pixel>(height, width, UNINITIALIZED) {}
+    ImageView<Pixel> roi(int y, int x, int h, int w) { return this->view().subview(y, x, h, w); }
+    ImageView<const Pixel> roi(int y, int x, int h, int w) const { return this->view().subview(y, x, h, w); }
+    // Saturates by default: integer targets clamp, and NaN becomes 0
+    template <typename U> Image<U, Channels> convertTo(Narrowing narrowing = Narrowing::SATURATE) const;
+    // Single-channel images only
+    template <typename U> MatrixT<U> toMatrix(Narrowing narrowing = Narrowing::SATURATE) const;
+    template <typename U> static Image fromMatrix(const MatrixT<U>& matrix, Narrowing narrowing = Narrowing::SATURATE);
+};
+
+template <>
+struct Image<uint8_t, 1> : Grid<uint8_t>
+{
     BITMAPFILEHEADER fileHeader;
     BITMAPINFOHEADER infoHeader;
-    GrayImage() noexcept : width(0), height(0) {}
-    GrayImage(int height, int width) noexcept;
-    GrayImage& toFile(const std::string& filename);
-    Matrix toMatrix() const noexcept;
-    static GrayImage fromMatrix(const Matrix& matrix) noexcept;
+    Image() noexcept {}
+    Image(int height, int width);
+    Image(int height, int width, Uninitialized);
+    ImageView<uint8_t> roi(int y, int x, int h, int w);
+    ImageView<const uint8_t> roi(int y, int x, int h, int w) const;
+    static GrayImage fromFile(const std::string& filename);
+    GrayImage& toFile(const std::string& filename, Compression compression = BI_RGB);    // BI_RGB or BI_RLE8
+    Matrix toMatrix() const;
+    // fromMatrix(const Matrix&) keeps its original truncating default; the
+    // templates saturate by default, like those of every other Image
+    static GrayImage fromMatrix(const Matrix& matrix, Narrowing narrowing = Narrowing::TRUNCATE);
+    template <typename U> MatrixT<U> toMatrix(Narrowing narrowing = Narrowing::SATURATE) const;
+    template <typename U> static GrayImage fromMatrix(const MatrixT<U>& matrix, Narrowing narrowing = Narrowing::SATURATE);
+    template <typename U> Image<U, 1> convertTo(Narrowing narrowing = Narrowing::SATURATE) const;
+    GrayImage& applyLUT(const LookupTable& lut);                // In place
+    GrayImage& equalize();                                      // Histogram equalization, in place
+    GrayImage& threshold(uint8_t threshold, uint8_t maxValue = 255);  // value > threshold ? maxValue : 0, in place
+    GrayImage convolve(const Matrix& kernel, BorderMode border = BorderMode::REPLICATE, uint8_t value = 0, Narrowing narrowing = Narrowing::TRUNCATE) const;
+    template <int H, int W, typename K> GrayImage convolve(const FixedMatrix<H, W, K>& kernel, BorderMode border = BorderMode::REPLICATE, uint8_t value = 0, Narrowing narrowing = Narrowing::TRUNCATE) const;
 };
 
-struct RGBImage : std::vector<std::vector<RGBTRIPLE>>
+template <>
+struct Image<uint8_t, 3> : Grid<RGBTRIPLE>
 {
-    int width, height;
     BITMAPFILEHEADER fileHeader;
     BITMAPINFOHEADER infoHeader;
-    RGBImage() noexcept : width(0), height(0) {}
-    RGBImage(int height, int width) noexcept;
+    Image() noexcept {}
+    Image(int height, int width);
+    Image(int height, int width, Uninitialized);
+    ImageView<RGBTRIPLE> roi(int y, int x, int h, int w);
+    ImageView<const RGBTRIPLE> roi(int y, int x, int h, int w) const;
     GrayImage getChannel(const Channel& channel) const;
     static RGBImage fromFile(const std::string& filename);
     RGBImage& toFile(const std::string& filename);
-    GrayImage toGray(const ColorSpace& method);
-    static RGBImage fromGrays(const GrayImage& bChannel, const GrayImage& gChannel, const GrayImage& rChannel) noexcept;
+    GrayImage toGray(const ColorSpace& method = ColorSpace::HSI);
+    static RGBImage fromGrays(const GrayImage& bChannel, const GrayImage& gChannel, const GrayImage& rChannel);
+    RGBImage& applyLUT(const LookupTable& lut);     // Same table for every channel, in place
+    RGBImage& applyLUT(const LookupTable& bLut, const LookupTable& gLut, const LookupTable& rLut);
+    template <typename U> Image<U, 3> convertTo(Narrowing narrowing = Narrowing::SATURATE) const;
 };
 
-///////////////////////////////////////
-//      Matrix implementation        //
-///////////////////////////////////////
+// RGB image stored as three separate planes (blue, green, red), each a
+// tightly packed, cache-line aligned block of height * width bytes.
+// getChannel returns a view into a plane instead of copying it.
+struct PlanarRGBImage
+{
+    int width, height;
 
-Matrix::Matrix(int height, int width) noexcept : std::vector<std::vector<double>>(height, std::vector<double>(width)), height(height), width(width) {}
-Matrix::Matrix(std::initializer_list<std::initializer_list<double>> list) : std::vector<std::vector<double>>(list.size(), std::vector<double>(list.begin()->size())), width(list.begin()->size()), height(list.size()) {
-    std::copy(list.begin(), list.end(), begin());
-}
-Matrix::Matrix(int height, int width, double value) noexcept : std::vector<std::vector<double>>(height, std::vector<double>(width, value)), height(height), width(width) {}
+    PlanarRGBImage() noexcept : width(0), height(0), planeStride(0) {}
+    PlanarRGBImage(int height, int width);                  // Black
+    PlanarRGBImage(int height, int width, Uninitialized);   // For callers that write every pixel
+    PlanarRGBImage(const PlanarRGBImage&) = default;
+    PlanarRGBImage(PlanarRGBImage&&) = default;
+    PlanarRGBImage& operator=(const PlanarRGBImage& other);   // Unchanged if the copy cannot allocate
+    PlanarRGBImage& operator=(PlanarRGBImage&&) = default;
 
-Matrix Matrix::operator*(const Matrix& other) const {
-    if (width != other.height)
-        throw std::runtime_error("Cannot multiply matrices with incompatible shapes! Got " + std::to_string(width) + "x" + std::to_string(height) + " and " + std::to_string(other.width) + "x" + std::to_string(other.height));
+    ImageView<uint8_t> getChannel(const Channel& channel);
+    ImageView<const uint8_t> getChannel(const Channel& channel) const;
+    uint8_t* plane(int index) noexcept { return buffer.data() + index * planeStride; }     // 0 blue, 1 green, 2 red
+    const uint8_t* plane(int index) const noexcept { return buffer.data() + index * planeStride; }
+    bool empty() const noexcept { return width == 0 || height == 0; }
 
-    Matrix result(height, other.width);
+    static PlanarRGBImage fromRGB(GridView<const RGBTRIPLE> image);
+    static PlanarRGBImage fromRGB(const RGBImage& image) { return fromRGB(image.view()); }
+    RGBImage toRGB() const;
+    static PlanarRGBImage fromFile(const std::string& filename);
+    const PlanarRGBImage& toFile(const std::string& filename) const;
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < other.width; x++) {
-            double sum = 0;
-            for (int i = 0; i < width; i++) {
-                sum += (*this)[y][i] * other[i][x];
-            }
-            result[y][x] = sum;
-        }
-    }
+private:
+    std::ptrdiff_t planeStride;     // Elements between the starts of two planes
+    AlignedBuffer<uint8_t> buffer;
+};
 
-    return result;
-}
+// Summed-area table of a gray image or matrix: the sum or mean of any box
+// is four lookups, whatever its size. Byte images are summed exactly in
+// integers (32-bit up to about 16.8 million pixels, 64-bit beyond);
+// matrices are summed in doubles.
+// Boxes are given like submatrix (y, x, height, width) and are clipped to
+// the image.
+class IntegralImage
+{
+public:
+    int width, height;
 
-Matrix Matrix::operator*(double scalar) const noexcept {
-    Matrix result(height, width);
+    IntegralImage() noexcept : width(0), height(0) {}
+    explicit IntegralImage(GridView<const uint8_t> image);
+    explicit IntegralImage(const GrayImage& image) : IntegralImage(image.view()) {}
+    explicit IntegralImage(const Matrix& matrix);
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            result[y][x] = (*this)[y][x] * scalar;
-        }
-    }
+    double boxSum(int y, int x, int boxHeight, int boxWidth) const noexcept;
+    double boxMean(int y, int x, int boxHeight, int boxWidth) const noexcept;     // 0 for boxes outside the image
+    // Mean of the (2 * radiusY + 1) x (2 * radiusX + 1) window around each
+    // pixel, over the part of the window inside the image
+    Matrix boxFilter(int radiusY, int radiusX) const;
+    Matrix boxFilter(int radius) const { return boxFilter(radius, radius); }
 
-    return result;
-}
+protected:
+    // Tables are (height + 1) x (width + 1); exactly one is filled
+    Grid<uint32_t> byteSums;    // Byte images
+    Grid<uint64_t> wideSums;    // Byte images too large for byteSums
+    Grid<double> sums;          // Matrices
 
-Matrix operator*(double scalar, const Matrix& matrix) noexcept {
-    return matrix * scalar;
-}
+    bool clip(int& y0, int& x0, int& y1, int& x1) const noexcept;    // False if nothing is left
+    double sum(int y0, int x0, int y1, int x1) const noexcept;        // Over rows [y0, y1), columns [x0, x1)
+    void windowSums(int y0, int y1, int radius, double* out) const noexcept;   // One row of boxFilter
+};
 
-Matrix Matrix::operator+(const Matrix& other) const {
-    if (width != other.width || height != other.height)
-        throw std::runtime_error("Cannot add matrices with different shapes! Got " + std::to_string(width) + "x" + std::to_string(height) + " and " + std::to_string(other.width) + "x" + std::to_string(other.height));
+// Integral image that also sums squares (64-bit for byte images), for the
+// local variance used by adaptive thresholding and normalized correlation
+class SquaredIntegralImage : public IntegralImage
+{
+public:
+    SquaredIntegralImage() noexcept {}
+    explicit SquaredIntegralImage(GridView<const uint8_t> image);
+    explicit SquaredIntegralImage(const GrayImage& image) : SquaredIntegralImage(image.view()) {}
+    explicit SquaredIntegralImage(const Matrix& matrix);
 
-    Matrix result(height, width);
+    double boxSquaredSum(int y, int x, int boxHeight, int boxWidth) const noexcept;
+    double boxVariance(int y, int x, int boxHeight, int boxWidth) const noexcept;     // Population variance
+    Matrix varianceFilter(int radiusY, int radiusX) const;      // Windows as in boxFilter
+    Matrix varianceFilter(int radius) const { return varianceFilter(radius, radius); }
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            result[y][x] = (*this)[y][x] + other[y][x];
-        }
-    }
+protected:
+    Grid<uint64_t> byteSquares;
+    Grid<double> squares;
 
-    return result;
-}
+    double squaredSum(int y0, int x0, int y1, int x1) const noexcept;
+};
 
-Matrix Matrix::operator+(double scalar) const noexcept {
-    Matrix result(height, width);
+// Number of pixels with each byte value, in a gray image or one channel of
+// an RGB image. Counting runs in parallel with per-thread bins.
+struct Histogram
+{
+    std::array<uint64_t, 256> bins;
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            result[y][x] = (*this)[y][x] + scalar;
-        }
-    }
+    Histogram() noexcept { bins.fill(0); }
+    explicit Histogram(GridView<const uint8_t> image);
+    explicit Histogram(const GrayImage& image) : Histogram(image.view()) {}
+    Histogram(GridView<const RGBTRIPLE> image, const Channel& channel);
+    Histogram(const RGBImage& image, const Channel& channel) : Histogram(image.view(), channel) {}
 
-    return result;
-}
+    uint64_t operator[](uint8_t value) const noexcept { return bins[value]; }
+    Histogram& operator+=(const Histogram& other) noexcept;
+    uint64_t total() const noexcept;
+    std::array<uint64_t, 256> cumulative() const noexcept;     // Element v counts the pixels <= v
+    LookupTable equalization() const noexcept;      // Spreads the values so the cumulative histogram is a ramp
+    uint8_t otsuThreshold() const noexcept;         // Maximizes the between-class variance of <= t and > t
+};
 
-Matrix operator+(double scalar, const Matrix& matrix) noexcept {
-    return matrix + scalar;
-}
+// Lazily recorded chain of point operations, run as one fused pass.
+// Pixels are widened to double once, pass through every stage while the
+// tile is still in cache, and are narrowed once into the destination, so
+// no intermediate image is ever allocated. Results equal the eager chain
+// toGray -> toMatrix -> Matrix arithmetic -> fromMatrix -> byte operations.
+//
+//     GrayImage out = PointPipeline(rgb).gray(ColorSpace::YCC).scale(1.2).offset(-10).threshold(128).run();
+class PointPipeline
+{
+public:
+    PointPipeline(ImageView<const uint8_t> source);
+    PointPipeline(ImageView<const RGBTRIPLE> source);
+    PointPipeline(const GrayImage& source) : PointPipeline(ImageView<const uint8_t>(source.view())) {}
+    PointPipeline(const RGBImage& source) : PointPipeline(ImageView<const RGBTRIPLE>(source.view())) {}
 
-Matrix Matrix::operator-(const Matrix& other) const {
-    if (width != other.width || height != other.height)
-        throw std::runtime_error("Cannot subtract matrices with different shapes! Got " + std::to_string(width) + "x" + std::to_string(height) + " and " + std::to_string(other.width) + "x" + std::to_string(other.height));
+    // RGB sources must first be reduced to one channel
+    PointPipeline& gray(const ColorSpace& method);
+    PointPipeline& channel(const Channel& channel);
 
-    Matrix result(height, width);
+    // Arithmetic on the widened values, as Matrix operators would do it
+    PointPipeline& scale(double factor);
+    PointPipeline& offset(double value);
+    PointPipeline& clamp(double low, double high);
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            result[y][x] = (*this)[y][x] - other[y][x];
-        }
-    }
+    // Byte operations; the value is narrowed first, as fromMatrix would
+    PointPipeline& threshold(uint8_t threshold, uint8_t maxValue = 255);    // value > threshold ? maxValue : 0
+    PointPipeline& lut(const LookupTable& table);
 
-    return result;
-}
+    PointPipeline& narrowing(Narrowing mode) noexcept;  // TRUNCATE by default
+    GrayImage run() const;
+    void run(ImageView<uint8_t> destination) const;
 
-Matrix Matrix::operator-() const noexcept {
-    Matrix result(height, width);
+private:
+    enum class Op {
+        SCALE,
+        OFFSET,
+        CLAMP,
+        THRESHOLD,
+        LUT,
+    };
 
-    for(int y = 0; y < height; y++) {
-        for(int x = 0; x < width; x++) {
-            result[y][x] = -(*this)[y][x];
-        }
-    }
+    struct Stage {
+        Op op;
+        double a, b;
+        LookupTable table;
+    };
 
-    return result;
-}
+    void runRow(int y, uint8_t* dst, double* values, uint8_t* bytes) const;
 
-Matrix Matrix::operator-(double scalar) const noexcept {
-    return *this + (-scalar);
-}
+    ImageView<const uint8_t> graySource;
+    ImageView<const RGBTRIPLE> rgbSource;
+    bool isRGB;
+    ColorSpace method;
+    int selected;       // Channel byte offset, or -1 for a gray conversion
+    Narrowing mode;
+    std::vector<Stage> stages;
+};
 
-Matrix operator-(double scalar, const Matrix& matrix) noexcept {
-    return scalar + (-matrix);
-}
+// Reads a 24-bit BMP as horizontal strips of rows, top to bottom.
+// Each strip holds up to `stripRows` core rows plus up to `overlap` context
+// rows on either side, so memory use depends only on the strip size.
+struct BMPStripReader
+{
+    int width, height;
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER infoHeader;
 
-Matrix& Matrix::operator*=(const Matrix& other) {
-    return *this = *this * other;
-}
+    BMPStripReader(const std::string& filename, int stripRows, int overlap = 0);
+    bool next();                                        // Load the next strip; false once the image is exhausted
+    ImageView<const RGBTRIPLE> strip() const noexcept { return buffer.view().subview(0, 0, count, width); }
+    int stripY() const noexcept { return first; }       // Image row of strip()[0]
+    int coreY() const noexcept { return core; }         // Image row of the first core row
+    int coreRows() const noexcept { return coreCount; }
+    int coreOffset() const noexcept { return core - first; }
 
-Matrix& Matrix::operator*=(double scalar) noexcept {
-    return *this = *this * scalar;
-}
+private:
+    std::ifstream file;
+    int stripRows, overlap;
+    int first, core, coreCount, count;
+    bool topDown;
+    std::size_t pitch;
+    RGBImage buffer;
+};
 
-Matrix& Matrix::operator+=(const Matrix& other) {
-    return *this = *this + other;
-}
+// Writes a 24-bit BMP from strips of rows supplied top to bottom.
+// Rows are seeked into their bottom-up position, and the size fields of
+// the headers are filled in by close().
+struct BMPStripWriter
+{
+    int width, height;
 
-Matrix& Matrix::operator+=(double scalar) noexcept {
-    return *this = *this + scalar;
-}
+    BMPStripWriter(const std::string& filename, int height, int width);
+    ~BMPStripWriter();
+    BMPStripWriter& write(GridView<const RGBTRIPLE> rows);
+    BMPStripWriter& write(const RGBImage& rows) { return write(rows.view()); }
+    int rowsWritten() const noexcept { return written; }
+    void close();
 
-Matrix& Matrix::operator-=(const Matrix& other) {
-    return *this = *this - other;
-}
+private:
+    std::ofstream file;
+    std::string filename;
+    int written;
+    std::size_t pitch;
+};
 
-Matrix& Matrix::operator-=(double scalar) noexcept {
-    return *this = *this - scalar;
-}
+// Stream `input` to `output` strip by strip. `process` receives the strip
+// with its context rows, the index of its first core row, and the output
+// rows to fill (one per core row). Peak memory is a few strips.
+void processBMPStrips(const std::string& input, const std::string& output, int stripRows, int overlap,
+                      const std::function<void(ImageView<const RGBTRIPLE> strip, int coreOffset, ImageView<RGBTRIPLE> out)>& process);
 
-bool Matrix::operator==(const Matrix& other) const noexcept {
-    if (width != other.width || height != other.height) return false;
+// Read-only 24-bit BMP backed by a memory mapping of the file.
+// Rows resolve straight into the mapped pixel array, so pages are only
+// faulted in once the rows on them are touched.
+struct MappedBMP
+{
+    int width, height;
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER infoHeader;
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            if ((*this)[y][x] != other[y][x]) return false;
+    explicit MappedBMP(const std::string& filename);
+    MappedBMP(MappedBMP&& other) noexcept;
+    MappedBMP(const MappedBMP&) = delete;
+    MappedBMP& operator=(const MappedBMP&) = delete;
+    ~MappedBMP();
+
+    Row<const RGBTRIPLE> operator[](int y) const noexcept {
+        // BMP files are stored bottom-up unless the height is negative
+        int stored = topDown ? y : height - 1 - y;
+        return Row<const RGBTRIPLE>(reinterpret_cast<const RGBTRIPLE*>(pixels + stored * pitch), width);
+    }
+    Row<const RGBTRIPLE> at(int y) const;
+    RGBImage crop(int y, int x, int h, int w) const;    // Copies just the region
+    RGBImage toImage() const;                           // Copies the whole image
+
+private:
+    const uint8_t* mapping;
+    std::size_t mappingSize;
+    const uint8_t* pixels;
+    std::ptrdiff_t pitch;
+    bool topDown;
+    std::vector<uint8_t> fallback;
+};
+
+// Outcome of one input of BatchProcessor::run
+struct BatchResult {
+    std::string input, output;
+    bool ok;
+    std::string error;      // what() of the exception that failed the file
+};
+
+struct BatchOptions {
+    int readers = 2;
+    int workers = 0;        // 0 picks the hardware concurrency
+    int writers = 2;
+    int maxInFlight = 0;    // 0 allows two images per thread
+};
+
+// Converts many BMP files as a three-stage pipeline: reader threads decode
+// with RGBImage::fromFile, workers run the processing callable and writer
+// threads encode with toFile, so disk and CPU are busy at the same time.
+// The stages hand images over through lock-free bounded queues. At most
+// maxInFlight images are between the start of their decode and the end of
+// their encode; readers wait for one to finish before decoding another,
+// which caps memory. A file that fails to read, process or write records
+// the error in its result and the batch carries on.
+//
+//     BatchProcessor batch;
+//     auto results = batch.run(paths, BatchProcessor::inDirectory("out"), [](RGBImage image, const std::string&) {
+//         return image.toGray(ColorSpace::YCC);
+//     });
+class BatchProcessor
+{
+public:
+    explicit BatchProcessor(const BatchOptions& options = BatchOptions()) : options(options) {}
+
+    // process(RGBImage image, const std::string& input) returns the image to
+    // write, an RGBImage or a GrayImage, and output(input) the path to write
+    // it to. Several workers call process at once. Results come in the order
+    // of `inputs`.
+    template <typename Process>
+    std::vector<BatchResult> run(const std::vector<std::string>& inputs, const std::function<std::string(const std::string& input)>& output, Process process) const;
+
+    // Output paths with the input's file name in `directory`
+    static std::function<std::string(const std::string& input)> inDirectory(const std::string& directory);
+
+private:
+    BatchOptions options;
+};
+
+// Persistent pool of worker threads shared by every row loop in this header.
+// parallelFor splits [0, rows) into chunks of `grain` rows; each participant
+// drains its own run of chunks from the front and then steals from the back
+// of the others. The calling thread always takes part.
+//
+// The thread count defaults to IMGPROC_THREADS, or the hardware concurrency
+// when that is unset. A count of 1 runs every loop on the calling thread in
+// row order, which makes results fully deterministic.
+class ThreadPool
+{
+public:
+    explicit ThreadPool(int threads = 0);   // 0 picks the hardware concurrency
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+    ~ThreadPool();
+
+    static ThreadPool& instance();
+    void setThreadCount(int threads);       // Not from inside a parallelFor body
+    int threadCount() const noexcept { return threads; }
+
+    // Calls fn(begin, end) over disjoint row ranges covering [0, rows) and
+    // returns once all have run. The first exception thrown is rethrown here.
+    // Nested calls run serially on the thread that makes them.
+    void parallelFor(int rows, int grain, const std::function<void(int begin, int end)>& fn);
+
+private:
+    struct Job;
+
+    void start(int count);
+    void stop();
+    void workerLoop(int index);
+    static void runChunks(Job& job, int self);
+
+    std::vector<std::thread> workers;
+    std::mutex submitMutex;                 // One parallelFor at a time
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    Job* job;
+    int participants;
+    unsigned generation;
+    bool stopping;
+    std::atomic<int> threads;
+};
+
+inline void parallelFor(int rows, int grain, const std::function<void(int begin, int end)>& fn) {
+    ThreadPool::instance().parallelFor(rows, grain, fn);
+}
+
+// Totals of one operation, such as "RGBImage::toGray", since the last reset
+struct OperationStats {
+    std::string name;
+    uint64_t calls;
+    uint64_t bytes;         // Image and matrix data read plus written
+    uint64_t allocations;   // Pixel and element buffers, including those of nested operations
+    double totalSeconds;
+    double maxSeconds;
+};
+
+namespace detail { struct ProfileSite; struct ProfileScope; }
+
+// Call counts, sizes and latencies of the public operations, and an optional
+// trace of every call in the Chrome trace_event format, which chrome://tracing
+// and ui.perfetto.dev open. Only builds with IMGPROC_PROFILE record anything;
+// elsewhere stats() is empty and traces have no events.
+//
+// Operations nest: Matrix::operator* of two expressions also shows up as
+// two Matrix::evaluate calls. Allocations are counted on the calling thread.
+class Profiler
+{
+public:
+    // Use it as a value only: a C++11 header cannot define it out of class
+    // without every translation unit defining it again
+#ifdef IMGPROC_PROFILE
+    static constexpr bool enabled = true;
+#else
+    static constexpr bool enabled = false;
+#endif
+
+    Profiler(const Profiler&) = delete;
+    Profiler& operator=(const Profiler&) = delete;
+
+    static Profiler& instance();
+    std::vector<OperationStats> stats() const;              // Longest total time first
+    OperationStats stats(const std::string& name) const;    // Zeros for operations that never ran
+    void reset();                                           // Also drops the trace
+
+    // Tracing keeps one event per call, up to maxEvents, until stopTrace
+    void startTrace(std::size_t maxEvents = 1 << 20);
+    void stopTrace();
+    void writeTrace(const std::string& filename) const;
+
+private:
+    Profiler() = default;
+
+#ifdef IMGPROC_PROFILE
+    friend struct detail::ProfileSite;
+    friend struct detail::ProfileScope;
+
+    struct TraceEvent {
+        const char* name;
+        int thread;
+        uint64_t start, duration;   // Nanoseconds since startTrace
+        uint64_t bytes, allocations;
+    };
+
+    // Fills in event.start from `start` under the lock, as startTrace may move traceStart
+    void record(TraceEvent event, std::chrono::steady_clock::time_point start);
+
+    mutable std::mutex mutex;
+    std::atomic<detail::ProfileSite*> sites{ nullptr };    // Newest first, linked through next
+    std::atomic<bool> tracing{ false };
+    std::chrono::steady_clock::time_point traceStart;      // Guarded by mutex
+    std::vector<TraceEvent> events;
+    std::size_t maxEvents = 0;
+    uint64_t droppedEvents = 0;
+#endif
+};
+
+#ifdef IMGPROC_PROFILE
+namespace detail {
+
+// Counters of one instrumented function, registered on its first call.
+// Sites live in static storage and link themselves into the profiler's list,
+// so registering never allocates inside the noexcept functions they time.
+struct ProfileSite {
+    const char* name;
+    std::atomic<uint64_t> calls{ 0 }, bytes{ 0 }, allocations{ 0 }, totalNs{ 0 }, maxNs{ 0 };
+    ProfileSite* next;
+
+    explicit ProfileSite(const char* name) noexcept;
+};
+
+// Times one call; the innermost scope of each thread collects its allocations
+struct ProfileScope {
+    ProfileSite& site;
+    uint64_t bytes;
+    uint64_t allocations;
+    ProfileScope* parent;
+    std::chrono::steady_clock::time_point start;
+
+    ProfileScope(ProfileSite& site, uint64_t bytes) noexcept;
+    ProfileScope(const ProfileScope&) = delete;
+    ProfileScope& operator=(const ProfileScope&) = delete;
+    ~ProfileScope();
+};
+
+inline ProfileScope*& currentProfileScope() noexcept {
+    static thread_local ProfileScope* scope = nullptr;
+    return scope;
+}
+
+inline void profileAllocation() noexcept {
+    if (ProfileScope* scope = currentProfileScope()) scope->allocations++;
+}
+
+} // namespace detail
+#endif // IMGPROC_PROFILE
+
+namespace detail { struct PoolThreadCache; }
+
+// Counters of BufferPool::instance(), for sizing it
+struct BufferPoolStats {
+    uint64_t hits;              // Allocations served from cached blocks
+    uint64_t misses;            // Allocations that went to operator new
+    std::size_t bytesInUse;     // Handed out and not yet returned
+    std::size_t bytesCached;    // Free blocks kept for reuse
+    std::size_t peakBytes;      // Most ever held, in use plus cached
+
+    double hitRate() const noexcept { return hits + misses ? static_cast<double>(hits) / (hits + misses) : 0; }
+};
+
+// Recycles freed buffers for the next allocation of the same size class, so
+// pipelines that create the same temporaries every frame stop going to the
+// system allocator. Sizes are rounded up to a quarter power of two, wasting
+// at most a fifth of a block. Small blocks are cached per thread first, the
+// rest in lists shared under a lock. Once cached memory would exceed the
+// capacity, freed blocks go back to the system.
+//
+// Install it for the whole process with BufferAllocator::setDefault(&BufferPool::instance()),
+// or for one thread with an AllocatorScope.
+class BufferPool : public BufferAllocator
+{
+public:
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    // Never destroyed, so buffers freed during static destruction still have a home
+    static BufferPool& instance();
+
+    void* allocate(std::size_t bytes) override;
+    void deallocate(void* p, std::size_t bytes) noexcept override;
+
+    BufferPoolStats stats() const noexcept;
+    void resetStats() noexcept;                 // Peak restarts from what is held now
+    void setCapacity(std::size_t bytes);        // Cached bytes kept at most, 512 MiB by default
+    void trim();                                // Frees the shared and this thread's cached blocks
+
+private:
+    BufferPool();
+
+    friend struct detail::PoolThreadCache;
+    void* take(int sizeClass);
+    void give(void* block, int sizeClass) noexcept;
+    void discard(void* block, std::size_t bytes) noexcept;
+
+    mutable std::mutex mutex;
+    std::vector<std::vector<void*>> lists;      // Per size class
+    std::atomic<std::size_t> capacity{ std::size_t(512) << 20 };
+    std::atomic<uint64_t> hits{ 0 }, misses{ 0 };
+    std::atomic<std::size_t> held{ 0 }, cached{ 0 }, peak{ 0 };
+};
+
+// Bump allocator for the temporaries of one frame: allocate moves a pointer,
+// deallocate does nothing and reset() makes all of the memory available
+// again in O(1). Blocks are kept across frames, so a steady pipeline stops
+// allocating after its first frame.
+//
+// Not thread-safe: install it with an AllocatorScope on one thread. Every
+// buffer allocated in the scope dies with reset(), so copy results that must
+// outlive the frame after the scope has ended.
+class FrameArena : public BufferAllocator
+{
+public:
+    explicit FrameArena(std::size_t blockBytes = std::size_t(16) << 20);
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator=(const FrameArena&) = delete;
+    ~FrameArena();
+
+    void* allocate(std::size_t bytes) override;
+    void deallocate(void*, std::size_t) noexcept override {}
+
+    void reset() noexcept;
+    void release() noexcept;                    // reset() and free the blocks
+    std::size_t bytesUsed() const noexcept { return used; }     // In this frame
+    std::size_t peakBytes() const noexcept { return peak; }     // In any frame since release()
+    std::size_t capacity() const noexcept;                      // Held from the system
+
+private:
+    struct Block {
+        void* memory;
+        std::size_t size;
+    };
+
+    std::vector<Block> blocks;
+    std::size_t blockBytes;
+    std::size_t current, offset;                // Bump position: block index and bytes into it
+    std::size_t used, peak;
+};
+
+///////////////////////////////////////
+//       Grid implementation         //
+///////////////////////////////////////
+
+template <typename T>
+Grid<T>::Grid(int height, int width) : width(width), height(height), rowStride(width), buffer(static_cast<std::size_t>(height) * width)
+{
+    if (buffer.size()) std::memset(static_cast<void*>(buffer.data()), 0, buffer.size() * sizeof(T));
+}
+
+template <typename T>
+Grid<T>::Grid(int height, int width, Uninitialized) : width(width), height(height), rowStride(width), buffer(static_cast<std::size_t>(height) * width) {}
+
+template <typename T>
+Grid<T>::Grid(int height, int width, const T& value) : width(width), height(height), rowStride(width), buffer(static_cast<std::size_t>(height) * width)
+{
+    std::fill(buffer.data(), buffer.data() + buffer.size(), value);
+}
+
+// The buffer goes first: if it cannot allocate, nothing else has changed
+template <typename T>
+Grid<T>& Grid<T>::operator=(const Grid& other) {
+    buffer = other.buffer;
+    width = other.width;
+    height = other.height;
+    rowStride = other.rowStride;
+    return *this;
+}
+
+template <typename T>
+Row<T> Grid<T>::at(int y) {
+    if (y < 0 || y >= height) throw std::out_of_range("Row " + std::to_string(y) + " out of range! Height is " + std::to_string(height));
+    return (*this)[y];
+}
+
+template <typename T>
+Row<const T> Grid<T>::at(int y) const {
+    if (y < 0 || y >= height) throw std::out_of_range("Row " + std::to_string(y) + " out of range! Height is " + std::to_string(height));
+    return (*this)[y];
+}
+
+///////////////////////////////////////
+//       CPU feature detection       //
+///////////////////////////////////////
+
+namespace detail {
+
+struct CpuFeatures {
+    bool sse2;
+    bool ssse3;
+    bool sse41;
+    bool avx;
+    bool avx2;
+    bool fma;
+    bool avx512bw;
+    bool avx512vbmi;
+};
+
+// Queried once; everything reads false when SIMD is disabled or unavailable
+inline const CpuFeatures& cpuFeatures() noexcept {
+    static const CpuFeatures features = [] {
+        CpuFeatures f = { false, false, false, false, false, false, false, false };
+#ifdef IMGPROC_X86_SIMD
+        __builtin_cpu_init();
+        f.sse2 = __builtin_cpu_supports("sse2");
+        f.ssse3 = __builtin_cpu_supports("ssse3");
+        f.sse41 = __builtin_cpu_supports("sse4.1");
+        f.avx = __builtin_cpu_supports("avx");
+        f.avx2 = __builtin_cpu_supports("avx2");
+        f.fma = __builtin_cpu_supports("fma");
+        f.avx512bw = __builtin_cpu_supports("avx512bw");
+        f.avx512vbmi = __builtin_cpu_supports("avx512vbmi");
+#endif
+        return f;
+    }();
+    return features;
+}
+
+} // namespace detail
+
+///////////////////////////////////////
+//    Thread pool implementation     //
+///////////////////////////////////////
+
+namespace detail {
+
+// Loops over fewer elements stay on the calling thread; bigger ones are
+// scheduled in chunks of roughly PARALLEL_GRAIN_ELEMENTS
+constexpr std::size_t PARALLEL_MIN_ELEMENTS = 1 << 16;
+constexpr std::size_t PARALLEL_GRAIN_ELEMENTS = 1 << 14;
+
+// Set on pool workers and on a caller while it runs a parallelFor
+inline bool& insideParallelFor() noexcept {
+    static thread_local bool inside = false;
+    return inside;
+}
+
+// A run of chunks [begin, end), packed so that both ends move with one CAS
+inline uint64_t packRange(uint32_t begin, uint32_t end) noexcept {
+    return static_cast<uint64_t>(begin) << 32 | end;
+}
+
+// Row loop over a height x width grid, parallel once it is big enough
+template <typename F>
+void parallelRows(int height, int width, F fn) {
+    std::size_t elements = static_cast<std::size_t>(height) * width;
+    if (elements < PARALLEL_MIN_ELEMENTS) {
+        if (height > 0) fn(0, height);
+        return;
+    }
+
+    int grain = static_cast<int>(std::max<std::size_t>(1, PARALLEL_GRAIN_ELEMENTS / std::max(width, 1)));
+    parallelFor(height, grain, fn);
+}
+
+} // namespace detail
+
+struct ThreadPool::Job {
+    const std::function<void(int, int)>* fn;
+    int rows, grain, participants;
+    std::unique_ptr<std::atomic<uint64_t>[]> ranges;    // Per participant
+    std::atomic<int> active;                            // Workers still running
+    std::atomic<bool> failed;
+    std::mutex errorMutex;
+    std::exception_ptr error;
+};
+
+inline ThreadPool::ThreadPool(int threads) : job(nullptr), participants(0), generation(0), stopping(false), threads(1) {
+    start(threads);
+}
+
+inline ThreadPool::~ThreadPool() {
+    stop();
+}
+
+inline ThreadPool& ThreadPool::instance() {
+    static ThreadPool pool([] {
+        const char* env = std::getenv("IMGPROC_THREADS");
+        return env ? std::atoi(env) : 0;
+    }());
+    return pool;
+}
+
+inline void ThreadPool::setThreadCount(int count) {
+    std::lock_guard<std::mutex> lock(submitMutex);
+    stop();
+    start(count);
+}
+
+inline void ThreadPool::start(int count) {
+    if (count <= 0) count = static_cast<int>(std::thread::hardware_concurrency());
+    count = std::max(count, 1);
+
+    stopping = false;
+    for (int i = 0; i + 1 < count; i++) {
+        try {
+            workers.emplace_back(&ThreadPool::workerLoop, this, static_cast<int>(workers.size()));
+        } catch (const std::system_error&) {
+            break;      // Make do with the threads we got
+        }
+    }
+    threads = static_cast<int>(workers.size()) + 1;
+}
+
+inline void ThreadPool::stop() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& worker : workers) worker.join();
+    workers.clear();
+    threads = 1;
+}
+
+inline void ThreadPool::workerLoop(int index) {
+    detail::insideParallelFor() = true;
+    unsigned seen = 0;
+
+    for (;;) {
+        Job* current;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen; });
+            if (stopping) return;
+            seen = generation;
+            // Workers outside the job must not touch it; it may already be gone
+            if (index + 1 >= participants) continue;
+            current = job;
+        }
+
+        runChunks(*current, index + 1);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--current->active == 0) done.notify_all();
+    }
+}
+
+inline void ThreadPool::runChunks(Job& job, int self) {
+    auto run = [&job](uint32_t chunk) {
+        if (job.failed.load(std::memory_order_relaxed)) return;
+        try {
+            int begin = static_cast<int>(chunk) * job.grain;
+            (*job.fn)(begin, std::min(job.rows, begin + job.grain));
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(job.errorMutex);
+            if (!job.error) job.error = std::current_exception();
+            job.failed = true;
+        }
+    };
+
+    // Own chunks from the front
+    std::atomic<uint64_t>& own = job.ranges[self];
+    for (;;) {
+        uint64_t range = own.load();
+        uint32_t begin = static_cast<uint32_t>(range >> 32), end = static_cast<uint32_t>(range);
+        if (begin >= end) break;
+        if (own.compare_exchange_weak(range, detail::packRange(begin + 1, end))) run(begin);
+    }
+
+    // Then everyone else's from the back
+    for (int i = 1; i < job.participants; i++) {
+        std::atomic<uint64_t>& victim = job.ranges[(self + i) % job.participants];
+        for (;;) {
+            uint64_t range = victim.load();
+            uint32_t begin = static_cast<uint32_t>(range >> 32), end = static_cast<uint32_t>(range);
+            if (begin >= end) break;
+            if (victim.compare_exchange_weak(range, detail::packRange(begin, end - 1))) run(end - 1);
+        }
+    }
+}
+
+inline void ThreadPool::parallelFor(int rows, int grain, const std::function<void(int begin, int end)>& fn) {
+    if (rows <= 0) return;
+    grain = std::max(grain, 1);
+    int chunks = (rows - 1) / grain + 1;
+
+    if (chunks == 1 || threads == 1 || detail::insideParallelFor()) {
+        fn(0, rows);
+        return;
+    }
+
+    // If another thread is using the pool, run here rather than queue behind it
+    std::unique_lock<std::mutex> submit(submitMutex, std::try_to_lock);
+    if (!submit.owns_lock() || threads == 1) {
+        fn(0, rows);
+        return;
+    }
+
+    Job current;
+    current.fn = &fn;
+    current.rows = rows;
+    current.grain = grain;
+    current.participants = std::min(threads.load(), chunks);
+    current.ranges.reset(new std::atomic<uint64_t>[current.participants]);
+    current.active = current.participants - 1;
+    current.failed = false;
+
+    // Contiguous runs of chunks keep neighbouring rows on one thread
+    for (int i = 0; i < current.participants; i++) {
+        uint32_t begin = static_cast<uint32_t>(static_cast<long long>(chunks) * i / current.participants);
+        uint32_t end = static_cast<uint32_t>(static_cast<long long>(chunks) * (i + 1) / current.participants);
+        current.ranges[i] = detail::packRange(begin, end);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &current;
+        participants = current.participants;
+        generation++;
+    }
+    wake.notify_all();
+
+    detail::insideParallelFor() = true;
+    runChunks(current, 0);
+    detail::insideParallelFor() = false;
+
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        done.wait(lock, [&] { return current.active == 0; });
+        job = nullptr;
+        participants = 0;
+    }
+
+    if (current.error) std::rethrow_exception(current.error);
+}
+
+////////////////////////////////////////
+//      Profiler implementation       //
+////////////////////////////////////////
+
+inline Profiler& Profiler::instance() {
+    static Profiler profiler;
+    return profiler;
+}
+
+#ifdef IMGPROC_PROFILE
+
+namespace detail {
+
+// Small stable numbers for the tid field of trace events
+inline int profileThreadId() noexcept {
+    static std::atomic<int> next{ 1 };
+    static thread_local int id = next++;
+    return id;
+}
+
+inline uint64_t elapsedNs(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to) noexcept {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(to - from).count());
+}
+
+} // namespace detail
+
+inline detail::ProfileSite::ProfileSite(const char* name) noexcept : name(name) {
+    std::atomic<ProfileSite*>& head = Profiler::instance().sites;
+    next = head.load(std::memory_order_relaxed);
+    while (!head.compare_exchange_weak(next, this, std::memory_order_release, std::memory_order_relaxed)) {}
+}
+
+inline detail::ProfileScope::ProfileScope(ProfileSite& site, uint64_t bytes) noexcept
+    : site(site), bytes(bytes), allocations(0), parent(currentProfileScope()) {
+    currentProfileScope() = this;
+    start = std::chrono::steady_clock::now();
+}
+
+inline detail::ProfileScope::~ProfileScope() {
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    uint64_t ns = elapsedNs(start, end);
+
+    site.calls.fetch_add(1, std::memory_order_relaxed);
+    site.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    site.allocations.fetch_add(allocations, std::memory_order_relaxed);
+    site.totalNs.fetch_add(ns, std::memory_order_relaxed);
+    uint64_t max = site.maxNs.load(std::memory_order_relaxed);
+    while (ns > max && !site.maxNs.compare_exchange_weak(max, ns, std::memory_order_relaxed)) {}
+
+    currentProfileScope() = parent;
+    if (parent) parent->allocations += allocations;
+
+    Profiler& profiler = Profiler::instance();
+    if (profiler.tracing.load(std::memory_order_relaxed)) {
+        profiler.record({ site.name, profileThreadId(), 0, ns, bytes, allocations }, start);
+    }
+}
+
+inline void Profiler::record(TraceEvent event, std::chrono::steady_clock::time_point start) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!tracing) return;
+    event.start = start > traceStart ? detail::elapsedNs(traceStart, start) : 0;
+    if (events.size() >= maxEvents) {
+        droppedEvents++;
+        return;
+    }
+    // Called from scope destructors, so a failed grow drops the event instead
+    try {
+        events.push_back(event);
+    } catch (...) {
+        droppedEvents++;
+    }
+}
+
+inline std::vector<OperationStats> Profiler::stats() const {
+    std::map<std::string, OperationStats> byName;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        // Template instances and overloads share a name and are added up
+        for (const detail::ProfileSite* site = sites.load(std::memory_order_acquire); site; site = site->next) {
+            OperationStats& s = byName.emplace(site->name, OperationStats{ site->name, 0, 0, 0, 0, 0 }).first->second;
+            s.calls += site->calls.load(std::memory_order_relaxed);
+            s.bytes += site->bytes.load(std::memory_order_relaxed);
+            s.allocations += site->allocations.load(std::memory_order_relaxed);
+            s.totalSeconds += site->totalNs.load(std::memory_order_relaxed) * 1e-9;
+            s.maxSeconds = std::max(s.maxSeconds, site->maxNs.load(std::memory_order_relaxed) * 1e-9);
+        }
+    }
+
+    std::vector<OperationStats> result;
+    for (const auto& entry : byName)
+        if (entry.second.calls) result.push_back(entry.second);
+    std::stable_sort(result.begin(), result.end(), [](const OperationStats& a, const OperationStats& b) { return a.totalSeconds > b.totalSeconds; });
+    return result;
+}
+
+inline OperationStats Profiler::stats(const std::string& name) const {
+    for (const OperationStats& s : stats())
+        if (s.name == name) return s;
+    return OperationStats{ name, 0, 0, 0, 0, 0 };
+}
+
+inline void Profiler::reset() {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (detail::ProfileSite* site = sites.load(std::memory_order_acquire); site; site = site->next) {
+        site->calls = 0;
+        site->bytes = 0;
+        site->allocations = 0;
+        site->totalNs = 0;
+        site->maxNs = 0;
+    }
+    events.clear();
+    droppedEvents = 0;
+}
+
+inline void Profiler::startTrace(std::size_t maxEvents) {
+    std::lock_guard<std::mutex> lock(mutex);
+    events.clear();
+    events.reserve(std::min<std::size_t>(maxEvents, 1 << 16));
+    this->maxEvents = maxEvents;
+    droppedEvents = 0;
+    traceStart = std::chrono::steady_clock::now();
+    tracing = true;
+}
+
+inline void Profiler::stopTrace() {
+    std::lock_guard<std::mutex> lock(mutex);
+    tracing = false;
+}
+
+// Complete ("X") events with microsecond timestamps; names are identifiers
+// from this header and need no escaping
+inline void Profiler::writeTrace(const std::string& filename) const {
+    std::ofstream file(filename);
+    if (!file) throw std::runtime_error("Failed to open the file: " + filename);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    char line[512];
+    file << "{\"traceEvents\":[";
+    for (std::size_t i = 0; i < events.size(); i++) {
+        const TraceEvent& e = events[i];
+        std::snprintf(line, sizeof(line),
+            "%s\n{\"name\":\"%s\",\"cat\":\"imgproc\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,"
+            "\"args\":{\"bytes\":%llu,\"allocations\":%llu}}",
+            i ? "," : "", e.name, e.thread, e.start * 1e-3, e.duration * 1e-3,
+            static_cast<unsigned long long>(e.bytes), static_cast<unsigned long long>(e.allocations));
+        file << line;
+    }
+    file << "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"droppedEvents\":" << droppedEvents << "}}\n";
+
+    if (!file) throw std::runtime_error("Failed to write the file: " + filename);
+}
+
+#else
+
+inline std::vector<OperationStats> Profiler::stats() const {
+    return std::vector<OperationStats>();
+}
+
+inline OperationStats Profiler::stats(const std::string& name) const {
+    return OperationStats{ name, 0, 0, 0, 0, 0 };
+}
+
+inline void Profiler::reset() {}
+inline void Profiler::startTrace(std::size_t) {}
+inline void Profiler::stopTrace() {}
+
+// An empty but valid trace, so that tooling works the same either way
+inline void Profiler::writeTrace(const std::string& filename) const {
+    std::ofstream file(filename);
+    if (!file) throw std::runtime_error("Failed to open the file: " + filename);
+    file << "{\"traceEvents\":[],\"displayTimeUnit\":\"ms\"}\n";
+    if (!file) throw std::runtime_error("Failed to write the file: " + filename);
+}
+
+#endif // IMGPROC_PROFILE
+
+////////////////////////////////////////
+//     Buffer pool implementation     //
+////////////////////////////////////////
+
+namespace detail {
+
+inline std::atomic<BufferAllocator*>& defaultAllocator() noexcept {
+    static std::atomic<BufferAllocator*> allocator{ nullptr };
+    return allocator;
+}
+
+inline BufferAllocator*& scopedAllocator() noexcept {
+    static thread_local BufferAllocator* allocator = nullptr;
+    return allocator;
+}
+
+// Memory from operator new aligned to BUFFER_ALIGNMENT, with the pointer to
+// delete stored just in front of it
+inline void* alignedAllocate(std::size_t bytes) {
+    void* raw = ::operator new(bytes + sizeof(void*) + BUFFER_ALIGNMENT - 1);
+    std::uintptr_t address = (reinterpret_cast<std::uintptr_t>(raw) + sizeof(void*) + BUFFER_ALIGNMENT - 1) & ~(BUFFER_ALIGNMENT - 1);
+    reinterpret_cast<void**>(address)[-1] = raw;
+    return reinterpret_cast<void*>(address);
+}
+
+inline void alignedFree(void* p) noexcept {
+    if (p) ::operator delete(static_cast<void**>(p)[-1]);
+}
+
+// Size classes: class 0 holds everything up to POOL_MIN_BLOCK, then each
+// power of two is split in four, so 1 MiB is followed by 1.25, 1.5, 1.75 and 2 MiB
+constexpr int POOL_MIN_LOG = 8;
+constexpr std::size_t POOL_MIN_BLOCK = std::size_t(1) << POOL_MIN_LOG;
+constexpr int POOL_CLASSES = (64 - POOL_MIN_LOG) * 4 + 1;
+
+// Blocks of up to 256 KiB are cached per thread, a few of each size; bigger
+// ones take long enough to fill that the shared lock does not matter
+constexpr int POOL_THREAD_CLASSES = (18 - POOL_MIN_LOG) * 4 + 1;
+constexpr std::size_t POOL_THREAD_BLOCKS = 4;
+
+inline int floorLog2(std::size_t n) noexcept {
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - __builtin_clzll(static_cast<unsigned long long>(n));
+#else
+    int log = 0;
+    while (n >>= 1) log++;
+    return log;
+#endif
+}
+
+inline int poolClass(std::size_t bytes) noexcept {
+    if (bytes <= POOL_MIN_BLOCK) return 0;
+    int log = floorLog2(bytes - 1);
+    int quarter = static_cast<int>((bytes - 1 - (std::size_t(1) << log)) >> (log - 2));
+    return (log - POOL_MIN_LOG) * 4 + quarter + 1;
+}
+
+inline std::size_t poolClassBytes(int sizeClass) noexcept {
+    if (sizeClass == 0) return POOL_MIN_BLOCK;
+    int log = (sizeClass - 1) / 4 + POOL_MIN_LOG;
+    return (std::size_t(1) << log) + (static_cast<std::size_t>((sizeClass - 1) % 4 + 1) << (log - 2));
+}
+
+// A fixed stack, so building or filling the cache never allocates
+struct PoolThreadList {
+    void* blocks[POOL_THREAD_BLOCKS];
+    std::size_t count = 0;
+
+    void* const* begin() const noexcept { return blocks; }
+    void* const* end() const noexcept { return blocks + count; }
+};
+
+struct PoolThreadCache {
+    PoolThreadList lists[POOL_THREAD_CLASSES];
+
+    PoolThreadCache() noexcept;
+    ~PoolThreadCache();
+};
+
+// 0 until this thread's cache is constructed, 1 while it lives, 2 once it is
+// destroyed; buffers freed by later thread_local destructors skip the cache
+inline int& poolThreadState() noexcept {
+    static thread_local int state = 0;
+    return state;
+}
+
+inline PoolThreadCache* poolThreadCache() noexcept {
+    if (poolThreadState() == 2) return nullptr;
+    static thread_local PoolThreadCache cache;
+    return &cache;
+}
+
+inline PoolThreadCache::PoolThreadCache() noexcept {
+    poolThreadState() = 1;
+}
+
+inline PoolThreadCache::~PoolThreadCache() {
+    poolThreadState() = 2;
+    BufferPool& pool = BufferPool::instance();
+    for (int c = 0; c < POOL_THREAD_CLASSES; c++)
+        for (void* block : lists[c]) pool.give(block, c);
+}
+
+} // namespace detail
+
+inline void BufferAllocator::setDefault(BufferAllocator* allocator) noexcept {
+    detail::defaultAllocator().store(allocator);
+}
+
+inline BufferAllocator* BufferAllocator::current() noexcept {
+    BufferAllocator* scoped = detail::scopedAllocator();
+    return scoped ? scoped : detail::defaultAllocator().load(std::memory_order_acquire);
+}
+
+inline AllocatorScope::AllocatorScope(BufferAllocator& allocator) noexcept : previous(detail::scopedAllocator()) {
+    detail::scopedAllocator() = &allocator;
+}
+
+inline AllocatorScope::~AllocatorScope() {
+    detail::scopedAllocator() = previous;
+}
+
+inline BufferPool::BufferPool() : lists(detail::POOL_CLASSES) {}
+
+inline BufferPool& BufferPool::instance() {
+    static BufferPool* pool = new BufferPool();
+    return *pool;
+}
+
+inline void* BufferPool::allocate(std::size_t bytes) {
+    int sizeClass = detail::poolClass(bytes);
+    std::size_t size = detail::poolClassBytes(sizeClass);
+
+    void* block = nullptr;
+    detail::PoolThreadCache* cache = sizeClass < detail::POOL_THREAD_CLASSES ? detail::poolThreadCache() : nullptr;
+    if (cache && cache->lists[sizeClass].count) {
+        detail::PoolThreadList& list = cache->lists[sizeClass];
+        block = list.blocks[--list.count];
+    } else {
+        block = take(sizeClass);
+    }
+
+    if (block) {
+        hits.fetch_add(1, std::memory_order_relaxed);
+        cached.fetch_sub(size, std::memory_order_relaxed);
+        return block;
+    }
+
+    misses.fetch_add(1, std::memory_order_relaxed);
+    block = detail::alignedAllocate(size);
+    std::size_t now = held.fetch_add(size, std::memory_order_relaxed) + size;
+    std::size_t max = peak.load(std::memory_order_relaxed);
+    while (now > max && !peak.compare_exchange_weak(max, now, std::memory_order_relaxed)) {}
+    return block;
+}
+
+inline void BufferPool::deallocate(void* p, std::size_t bytes) noexcept {
+    if (!p) return;
+    int sizeClass = detail::poolClass(bytes);
+    std::size_t size = detail::poolClassBytes(sizeClass);
+
+    if (cached.load(std::memory_order_relaxed) + size > capacity.load(std::memory_order_relaxed)) {
+        discard(p, size);
+        return;
+    }
+
+    cached.fetch_add(size, std::memory_order_relaxed);
+    detail::PoolThreadCache* cache = sizeClass < detail::POOL_THREAD_CLASSES ? detail::poolThreadCache() : nullptr;
+    if (cache && cache->lists[sizeClass].count < detail::POOL_THREAD_BLOCKS) {
+        detail::PoolThreadList& list = cache->lists[sizeClass];
+        list.blocks[list.count++] = p;
+        return;
+    }
+    give(p, sizeClass);
+}
+
+inline void* BufferPool::take(int sizeClass) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<void*>& list = lists[sizeClass];
+    if (list.empty()) return nullptr;
+    void* block = list.back();
+    list.pop_back();
+    return block;
+}
+
+// For blocks already counted as cached
+inline void BufferPool::give(void* block, int sizeClass) noexcept {
+    try {
+        std::lock_guard<std::mutex> lock(mutex);
+        lists[sizeClass].push_back(block);
+    } catch (...) {
+        cached.fetch_sub(detail::poolClassBytes(sizeClass), std::memory_order_relaxed);
+        discard(block, detail::poolClassBytes(sizeClass));
+    }
+}
+
+inline void BufferPool::discard(void* block, std::size_t bytes) noexcept {
+    detail::alignedFree(block);
+    held.fetch_sub(bytes, std::memory_order_relaxed);
+}
+
+inline BufferPoolStats BufferPool::stats() const noexcept {
+    std::size_t total = held.load(std::memory_order_relaxed), spare = cached.load(std::memory_order_relaxed);
+    return { hits.load(std::memory_order_relaxed), misses.load(std::memory_order_relaxed), total - std::min(spare, total), spare, peak.load(std::memory_order_relaxed) };
+}
+
+inline void BufferPool::resetStats() noexcept {
+    hits = 0;
+    misses = 0;
+    peak = held.load();
+}
+
+// Lowering the capacity below what is cached trims right away
+inline void BufferPool::setCapacity(std::size_t bytes) {
+    capacity = bytes;
+    if (cached.load() > bytes) trim();
+}
+
+inline void BufferPool::trim() {
+    std::vector<std::pair<void*, int>> blocks;
+    if (detail::poolThreadState() == 1) {
+        detail::PoolThreadCache* cache = detail::poolThreadCache();
+        for (int c = 0; c < detail::POOL_THREAD_CLASSES; c++) {
+            for (void* block : cache->lists[c]) blocks.emplace_back(block, c);
+            cache->lists[c].count = 0;
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (int c = 0; c < detail::POOL_CLASSES; c++) {
+            for (void* block : lists[c]) blocks.emplace_back(block, c);
+            lists[c].clear();
+        }
+    }
+
+    for (const auto& block : blocks) {
+        std::size_t size = detail::poolClassBytes(block.second);
+        cached.fetch_sub(size, std::memory_order_relaxed);
+        discard(block.first, size);
+    }
+}
+
+inline FrameArena::FrameArena(std::size_t blockBytes) : blockBytes(std::max(blockBytes, BUFFER_ALIGNMENT)), current(0), offset(0), used(0), peak(0) {}
+
+inline FrameArena::~FrameArena() {
+    release();
+}
+
+// Requests that do not fit the rest of a block move on to the next one that
+// fits; a block is only added when none is left
+inline void* FrameArena::allocate(std::size_t bytes) {
+    bytes = (bytes + BUFFER_ALIGNMENT - 1) & ~(BUFFER_ALIGNMENT - 1);
+    while (current < blocks.size() && offset + bytes > blocks[current].size) {
+        current++;
+        offset = 0;
+    }
+
+    if (current == blocks.size()) {
+        std::size_t size = std::max(bytes, blockBytes);
+        blocks.reserve(blocks.size() + 1);
+        blocks.push_back({ detail::alignedAllocate(size), size });
+    }
+
+    void* p = static_cast<char*>(blocks[current].memory) + offset;
+    offset += bytes;
+    used += bytes;
+    peak = std::max(peak, used);
+    return p;
+}
+
+inline void FrameArena::reset() noexcept {
+    current = 0;
+    offset = 0;
+    used = 0;
+}
+
+inline void FrameArena::release() noexcept {
+    for (const Block& block : blocks) detail::alignedFree(block.memory);
+    blocks.clear();
+    reset();
+    peak = 0;
+}
+
+inline std::size_t FrameArena::capacity() const noexcept {
+    std::size_t total = 0;
+    for (const Block& block : blocks) total += block.size;
+    return total;
+}
+
+///////////////////////////////////////
+//        GEMM implementation        //
+///////////////////////////////////////
+
+// C += A * B for row-major operands, following the usual Goto/BLIS layout:
+// B is packed into KC x NC panels of NR-wide slivers, A into MC x KC blocks
+// of MR-tall slivers, and an MR x NR register-blocked micro-kernel walks both.
+//
+// Accuracy: every element is still accumulated in ascending k order, but in
+// chunks of GEMM_KC that are then added to C, and the FMA kernel skips the
+// intermediate rounding of each product. Results therefore agree with the
+// naive triple loop to within the usual dot product bound of
+// K * 2^-53 * sum_k |A[y][k] * B[k][x]|, and are bit-identical whenever
+// K <= GEMM_KC and the FMA kernel is not selected.
+
+namespace detail {
+
+constexpr int GEMM_MR = 4;
+constexpr int GEMM_NR = 8;
+constexpr int GEMM_MC = 64;
+constexpr int GEMM_KC = 256;
+constexpr int GEMM_NC = 2048;
+
+// Products below this many multiply-adds skip packing entirely
+constexpr long long GEMM_SMALL_WORK = 32 * 32 * 32;
+
+// Products above this many multiply-adds are split into row bands across cores
+constexpr long long GEMM_PARALLEL_WORK = 128 * 128 * 128;
+
+typedef void (*GemmKernel)(int kc, const double* a, const double* b, double* c, std::ptrdiff_t ldc);
+
+inline void gemmKernelScalar(int kc, const double* a, const double* b, double* c, std::ptrdiff_t ldc) {
+    double acc[GEMM_MR][GEMM_NR] = {};
+
+    for (int k = 0; k < kc; k++) {
+        for (int i = 0; i < GEMM_MR; i++) {
+            double ai = a[i];
+            for (int j = 0; j < GEMM_NR; j++) {
+                acc[i][j] += ai * b[j];
+            }
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    for (int i = 0; i < GEMM_MR; i++) {
+        for (int j = 0; j < GEMM_NR; j++) {
+            c[i * ldc + j] += acc[i][j];
+        }
+    }
+}
+
+#ifdef IMGPROC_X86_SIMD
+
+IMGPROC_TARGET("sse2")
+inline void gemmKernelSse2(int kc, const double* a, const double* b, double* c, std::ptrdiff_t ldc) {
+    __m128d acc[GEMM_MR][4];
+    for (int i = 0; i < GEMM_MR; i++)
+        for (int j = 0; j < 4; j++)
+            acc[i][j] = _mm_setzero_pd();
+
+    for (int k = 0; k < kc; k++) {
+        __m128d b0 = _mm_load_pd(b);
+        __m128d b1 = _mm_load_pd(b + 2);
+        __m128d b2 = _mm_load_pd(b + 4);
+        __m128d b3 = _mm_load_pd(b + 6);
+        for (int i = 0; i < GEMM_MR; i++) {
+            __m128d ai = _mm_set1_pd(a[i]);
+            acc[i][0] = _mm_add_pd(acc[i][0], _mm_mul_pd(ai, b0));
+            acc[i][1] = _mm_add_pd(acc[i][1], _mm_mul_pd(ai, b1));
+            acc[i][2] = _mm_add_pd(acc[i][2], _mm_mul_pd(ai, b2));
+            acc[i][3] = _mm_add_pd(acc[i][3], _mm_mul_pd(ai, b3));
+        }
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    for (int i = 0; i < GEMM_MR; i++) {
+        double* row = c + i * ldc;
+        for (int j = 0; j < 4; j++) {
+            _mm_storeu_pd(row + 2 * j, _mm_add_pd(_mm_loadu_pd(row + 2 * j), acc[i][j]));
+        }
+    }
+}
+
+IMGPROC_TARGET("avx")
+inline void gemmKernelAvx(int kc, const double* a, const double* b, double* c, std::ptrdiff_t ldc) {
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+
+    for (int k = 0; k < kc; k++) {
+        __m256d b0 = _mm256_load_pd(b);
+        __m256d b1 = _mm256_load_pd(b + 4);
+        __m256d ai;
+        ai = _mm256_broadcast_sd(a + 0);
+        c00 = _mm256_add_pd(c00, _mm256_mul_pd(ai, b0));
+        c01 = _mm256_add_pd(c01, _mm256_mul_pd(ai, b1));
+        ai = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_add_pd(c10, _mm256_mul_pd(ai, b0));
+        c11 = _mm256_add_pd(c11, _mm256_mul_pd(ai, b1));
+        ai = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_add_pd(c20, _mm256_mul_pd(ai, b0));
+        c21 = _mm256_add_pd(c21, _mm256_mul_pd(ai, b1));
+        ai = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_add_pd(c30, _mm256_mul_pd(ai, b0));
+        c31 = _mm256_add_pd(c31, _mm256_mul_pd(ai, b1));
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c00));
+    _mm256_storeu_pd(c + 4, _mm256_add_pd(_mm256_loadu_pd(c + 4), c01));
+    c += ldc;
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c10));
+    _mm256_storeu_pd(c + 4, _mm256_add_pd(_mm256_loadu_pd(c + 4), c11));
+    c += ldc;
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c20));
+    _mm256_storeu_pd(c + 4, _mm256_add_pd(_mm256_loadu_pd(c + 4), c21));
+    c += ldc;
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c30));
+    _mm256_storeu_pd(c + 4, _mm256_add_pd(_mm256_loadu_pd(c + 4), c31));
+}
+
+IMGPROC_TARGET("avx2,fma")
+inline void gemmKernelFma(int kc, const double* a, const double* b, double* c, std::ptrdiff_t ldc) {
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+
+    for (int k = 0; k < kc; k++) {
+        __m256d b0 = _mm256_load_pd(b);
+        __m256d b1 = _mm256_load_pd(b + 4);
+        __m256d ai;
+        ai = _mm256_broadcast_sd(a + 0);
+        c00 = _mm256_fmadd_pd(ai, b0, c00);
+        c01 = _mm256_fmadd_pd(ai, b1, c01);
+        ai = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(ai, b0, c10);
+        c11 = _mm256_fmadd_pd(ai, b1, c11);
+        ai = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(ai, b0, c20);
+        c21 = _mm256_fmadd_pd(ai, b1, c21);
+        ai = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(ai, b0, c30);
+        c31 = _mm256_fmadd_pd(ai, b1, c31);
+        a += GEMM_MR;
+        b += GEMM_NR;
+    }
+
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c00));
+    _mm256_storeu_pd(c + 4, _mm256_add_pd(_mm256_loadu_pd(c + 4), c01));
+    c += ldc;
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c10));
+    _mm256_storeu_pd(c + 4, _mm256_add_pd(_mm256_loadu_pd(c + 4), c11));
+    c += ldc;
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c20));
+    _mm256_storeu_pd(c + 4, _mm256_add_pd(_mm256_loadu_pd(c + 4), c21));
+    c += ldc;
+    _mm256_storeu_pd(c, _mm256_add_pd(_mm256_loadu_pd(c), c30));
+    _mm256_storeu_pd(c + 4, _mm256_add_pd(_mm256_loadu_pd(c + 4), c31));
+}
+
+#endif // IMGPROC_X86_SIMD
+
+inline GemmKernel gemmKernel() noexcept {
+#ifdef IMGPROC_X86_SIMD
+    const CpuFeatures& cpu = cpuFeatures();
+    if (cpu.avx2 && cpu.fma) return gemmKernelFma;
+    if (cpu.avx) return gemmKernelAvx;
+    if (cpu.sse2) return gemmKernelSse2;
+#endif
+    return gemmKernelScalar;
+}
+
+// Copy a kc x nc block of B into NR-wide slivers, zero-padding the last one
+inline void gemmPackB(int kc, int nc, const double* b, std::ptrdiff_t ldb, double* packed) noexcept {
+    for (int j = 0; j < nc; j += GEMM_NR) {
+        int nr = std::min(GEMM_NR, nc - j);
+        for (int k = 0; k < kc; k++) {
+            const double* src = b + k * ldb + j;
+            int x = 0;
+            for (; x < nr; x++) packed[x] = src[x];
+            for (; x < GEMM_NR; x++) packed[x] = 0;
+            packed += GEMM_NR;
+        }
+    }
+}
+
+// Copy an mc x kc block of A into MR-tall slivers, zero-padding the last one
+inline void gemmPackA(int mc, int kc, const double* a, std::ptrdiff_t lda, double* packed) noexcept {
+    for (int i = 0; i < mc; i += GEMM_MR) {
+        int mr = std::min(GEMM_MR, mc - i);
+        for (int k = 0; k < kc; k++) {
+            int y = 0;
+            for (; y < mr; y++) packed[y] = a[(i + y) * lda + k];
+            for (; y < GEMM_MR; y++) packed[y] = 0;
+            packed += GEMM_MR;
+        }
+    }
+}
+
+// Single-threaded blocked product of an m x k by k x n operand pair
+inline void gemmSerial(int m, int n, int k, const double* a, std::ptrdiff_t lda, const double* b, std::ptrdiff_t ldb, double* c, std::ptrdiff_t ldc) {
+    GemmKernel kernel = gemmKernel();
+    int ncMax = std::min(GEMM_NC, (n + GEMM_NR - 1) / GEMM_NR * GEMM_NR);
+    int kcMax = std::min(GEMM_KC, k);
+    int mcMax = std::min(GEMM_MC, (m + GEMM_MR - 1) / GEMM_MR * GEMM_MR);
+    AlignedBuffer<double> packedB(static_cast<std::size_t>(kcMax) * ncMax);
+    AlignedBuffer<double> packedA(static_cast<std::size_t>(mcMax) * kcMax);
+
+    for (int jc = 0; jc < n; jc += GEMM_NC) {
+        int nc = std::min(GEMM_NC, n - jc);
+        for (int pc = 0; pc < k; pc += GEMM_KC) {
+            int kc = std::min(GEMM_KC, k - pc);
+            gemmPackB(kc, nc, b + pc * ldb + jc, ldb, packedB.data());
+
+            for (int ic = 0; ic < m; ic += GEMM_MC) {
+                int mc = std::min(GEMM_MC, m - ic);
+                gemmPackA(mc, kc, a + ic * lda + pc, lda, packedA.data());
+
+                for (int jr = 0; jr < nc; jr += GEMM_NR) {
+                    int nr = std::min(GEMM_NR, nc - jr);
+                    const double* bSliver = packedB.data() + jr * kc;
+
+                    for (int ir = 0; ir < mc; ir += GEMM_MR) {
+                        int mr = std::min(GEMM_MR, mc - ir);
+                        const double* aSliver = packedA.data() + ir * kc;
+                        double* tile = c + (ic + ir) * ldc + jc + jr;
+
+                        if (mr == GEMM_MR && nr == GEMM_NR) {
+                            kernel(kc, aSliver, bSliver, tile, ldc);
+                        } else {
+                            // Edge tile: compute in full, keep only the valid part
+                            double edge[GEMM_MR * GEMM_NR] = {};
+                            kernel(kc, aSliver, bSliver, edge, GEMM_NR);
+                            for (int y = 0; y < mr; y++)
+                                for (int x = 0; x < nr; x++)
+                                    tile[y * ldc + x] += edge[y * GEMM_NR + x];
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// The original triple loop, kept for products too small to amortize packing
+inline void gemmNaive(int m, int n, int k, const double* a, std::ptrdiff_t lda, const double* b, std::ptrdiff_t ldb, double* c, std::ptrdiff_t ldc) noexcept {
+    for (int y = 0; y < m; y++) {
+        for (int x = 0; x < n; x++) {
+            double sum = 0;
+            for (int i = 0; i < k; i++) {
+                sum += a[y * lda + i] * b[i * ldb + x];
+            }
+            c[y * ldc + x] += sum;
+        }
+    }
+}
+
+// C += A * B, where C is m x n, A is m x k and B is k x n
+inline void gemm(int m, int n, int k, const double* a, std::ptrdiff_t lda, const double* b, std::ptrdiff_t ldb, double* c, std::ptrdiff_t ldc) {
+    long long work = static_cast<long long>(m) * n * k;
+    if (work < GEMM_SMALL_WORK) {
+        gemmNaive(m, n, k, a, lda, b, ldb, c, ldc);
+        return;
+    }
+
+    // Row-panel parallelism: each band of rows of C is independent
+    int threads = ThreadPool::instance().threadCount();
+    if (work < GEMM_PARALLEL_WORK || threads <= 1) {
+        gemmSerial(m, n, k, a, lda, b, ldb, c, ldc);
+        return;
+    }
+
+    // A few bands per thread so stealing can even out the load, but never
+    // thinner than one MC block, since every band packs B again
+    int band = (m + 4 * threads - 1) / (4 * threads);
+    band = std::max(GEMM_MC, (band + GEMM_MR - 1) / GEMM_MR * GEMM_MR);
+    parallelFor(m, band, [=](int begin, int end) {
+        gemmSerial(end - begin, n, k, a + begin * lda, lda, b, ldb, c + begin * ldc, ldc);
+    });
+}
+
+} // namespace detail
+
+////////////////////////////////////////
+//   Type conversion implementation   //
+////////////////////////////////////////
+
+namespace detail {
+
+// One value of convertTo. Floating-point targets take a plain cast. Integer
+// targets either saturate (the fraction is dropped, the value clamped and
+// NaN becomes 0) or truncate like static_cast.
+template <typename U, typename T, bool FloatTarget = std::is_floating_point<U>::value, bool FloatSource = std::is_floating_point<T>::value>
+struct Convert {
+    static U saturate(T value) noexcept { return static_cast<U>(value); }
+    static U truncate(T value) noexcept { return static_cast<U>(value); }
+};
+
+template <typename U, typename T>
+struct Convert<U, T, false, true> {
+    static U saturate(T value) noexcept {
+        const U lowest = std::numeric_limits<U>::lowest(), highest = std::numeric_limits<U>::max();
+        if (value > static_cast<T>(lowest)) return value < static_cast<T>(highest) ? static_cast<U>(value) : highest;
+        return value < 0 ? lowest : 0;
+    }
+    static U truncate(T value) noexcept { return static_cast<U>(static_cast<long long>(value)); }
+};
+
+template <typename U, typename T>
+struct Convert<U, T, false, false> {
+    static U saturate(T value) noexcept {
+        long long wide = std::max<long long>(value, std::numeric_limits<U>::lowest());
+        return static_cast<U>(std::min<long long>(wide, std::numeric_limits<U>::max()));
+    }
+    static U truncate(T value) noexcept { return static_cast<U>(value); }
+};
+
+template <typename T, typename U>
+void convertRowScalar(const T* src, U* dst, int n, Narrowing narrowing) noexcept {
+    if (narrowing == Narrowing::SATURATE) {
+        for (int x = 0; x < n; x++) dst[x] = Convert<U, T>::saturate(src[x]);
+    } else {
+        for (int x = 0; x < n; x++) dst[x] = Convert<U, T>::truncate(src[x]);
+    }
+}
+
+template <typename T, typename U>
+void saturateRowScalar(const T* src, U* dst, int n) noexcept {
+    convertRowScalar(src, dst, n, Narrowing::SATURATE);
+}
+
+#ifdef IMGPROC_X86_SIMD
+
+IMGPROC_TARGET("avx2")
+inline void u8ToF32Avx2(const uint8_t* src, float* dst, int n) noexcept {
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i v = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + x));
+        _mm256_storeu_ps(dst + x, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(v)));
+    }
+    saturateRowScalar(src + x, dst + x, n - x);
+}
+
+IMGPROC_TARGET("avx2")
+inline void u16ToF32Avx2(const uint16_t* src, float* dst, int n) noexcept {
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        _mm256_storeu_ps(dst + x, _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(v)));
+    }
+    saturateRowScalar(src + x, dst + x, n - x);
+}
+
+IMGPROC_TARGET("avx2")
+inline void i16ToF32Avx2(const int16_t* src, float* dst, int n) noexcept {
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        _mm256_storeu_ps(dst + x, _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v)));
+    }
+    saturateRowScalar(src + x, dst + x, n - x);
+}
+
+IMGPROC_TARGET("avx2")
+inline void i32ToF32Avx2(const int32_t* src, float* dst, int n) noexcept {
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+        _mm256_storeu_ps(dst + x, _mm256_cvtepi32_ps(v));
+    }
+    saturateRowScalar(src + x, dst + x, n - x);
+}
+
+// Zeroes NaN and clamps to [lowest, highest] before truncating, so the
+// integer packs that follow never see an out-of-range value
+IMGPROC_TARGET("avx2")
+inline __m256i truncateClampedAvx2(const float* src, __m256 lowest, __m256 highest) noexcept {
+    __m256 v = _mm256_loadu_ps(src);
+    v = _mm256_and_ps(v, _mm256_cmp_ps(v, v, _CMP_ORD_Q));
+    return _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(v, lowest), highest));
+}
+
+IMGPROC_TARGET("avx2")
+inline void f32ToU8Avx2(const float* src, uint8_t* dst, int n) noexcept {
+    const __m256 lowest = _mm256_setzero_ps(), highest = _mm256_set1_ps(255);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    int x = 0;
+    for (; x + 32 <= n; x += 32) {
+        __m256i a = truncateClampedAvx2(src + x, lowest, highest);
+        __m256i b = truncateClampedAvx2(src + x + 8, lowest, highest);
+        __m256i c = truncateClampedAvx2(src + x + 16, lowest, highest);
+        __m256i d = truncateClampedAvx2(src + x + 24, lowest, highest);
+        // The packs interleave 128-bit lanes; the permute restores the order
+        __m256i bytes = _mm256_packus_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), _mm256_permutevar8x32_epi32(bytes, order));
+    }
+    saturateRowScalar(src + x, dst + x, n - x);
+}
+
+IMGPROC_TARGET("avx2")
+inline void f32ToU16Avx2(const float* src, uint16_t* dst, int n) noexcept {
+    const __m256 lowest = _mm256_setzero_ps(), highest = _mm256_set1_ps(65535);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m256i a = truncateClampedAvx2(src + x, lowest, highest);
+        __m256i b = truncateClampedAvx2(src + x + 8, lowest, highest);
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), words);
+    }
+    saturateRowScalar(src + x, dst + x, n - x);
+}
+
+IMGPROC_TARGET("avx2")
+inline void f32ToI16Avx2(const float* src, int16_t* dst, int n) noexcept {
+    const __m256 lowest = _mm256_set1_ps(-32768), highest = _mm256_set1_ps(32767);
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m256i a = truncateClampedAvx2(src + x, lowest, highest);
+        __m256i b = truncateClampedAvx2(src + x + 8, lowest, highest);
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), words);
+    }
+    saturateRowScalar(src + x, dst + x, n - x);
+}
+
+IMGPROC_TARGET("avx2")
+inline void f32ToF64Avx2(const float* src, double* dst, int n) noexcept {
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        _mm256_storeu_pd(dst + x, _mm256_cvtps_pd(_mm_loadu_ps(src + x)));
+        _mm256_storeu_pd(dst + x + 4, _mm256_cvtps_pd(_mm_loadu_ps(src + x + 4)));
+    }
+    saturateRowScalar(src + x, dst + x, n - x);
+}
+
+IMGPROC_TARGET("avx2")
+inline void f64ToF32Avx2(const double* src, float* dst, int n) noexcept {
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m128 low = _mm256_cvtpd_ps(_mm256_loadu_pd(src + x));
+        __m128 high = _mm256_cvtpd_ps(_mm256_loadu_pd(src + x + 4));
+        _mm256_storeu_ps(dst + x, _mm256_insertf128_ps(_mm256_castps128_ps256(low), high, 1));
+    }
+    saturateRowScalar(src + x, dst + x, n - x);
+}
+
+#endif // IMGPROC_X86_SIMD
+
+// Conversions to integers are the saturating ones
+struct ConvertKernels {
+    void (*u8ToF32)(const uint8_t* src, float* dst, int n);
+    void (*u16ToF32)(const uint16_t* src, float* dst, int n);
+    void (*i16ToF32)(const int16_t* src, float* dst, int n);
+    void (*i32ToF32)(const int32_t* src, float* dst, int n);
+    void (*f32ToU8)(const float* src, uint8_t* dst, int n);
+    void (*f32ToU16)(const float* src, uint16_t* dst, int n);
+    void (*f32ToI16)(const float* src, int16_t* dst, int n);
+    void (*f32ToF64)(const float* src, double* dst, int n);
+    void (*f64ToF32)(const double* src, float* dst, int n);
+};
+
+inline const ConvertKernels& convertKernels() noexcept {
+    static const ConvertKernels kernels = [] {
+        ConvertKernels k = { saturateRowScalar<uint8_t, float>, saturateRowScalar<uint16_t, float>, saturateRowScalar<int16_t, float>,
+                             saturateRowScalar<int32_t, float>, saturateRowScalar<float, uint8_t>, saturateRowScalar<float, uint16_t>,
+                             saturateRowScalar<float, int16_t>, saturateRowScalar<float, double>, saturateRowScalar<double, float> };
+#ifdef IMGPROC_X86_SIMD
+        if (cpuFeatures().avx2) {
+            k = { u8ToF32Avx2, u16ToF32Avx2, i16ToF32Avx2, i32ToF32Avx2, f32ToU8Avx2, f32ToU16Avx2, f32ToI16Avx2, f32ToF64Avx2, f64ToF32Avx2 };
+        }
+#endif
+        return k;
+    }();
+    return kernels;
+}
+
+// One row of any conversion; the pairs below have vector kernels
+template <typename T, typename U>
+void convertRow(const T* src, U* dst, int n, Narrowing narrowing) noexcept {
+    convertRowScalar(src, dst, n, narrowing);
+}
+
+inline void convertRow(const uint8_t* src, float* dst, int n, Narrowing) noexcept { convertKernels().u8ToF32(src, dst, n); }
+inline void convertRow(const uint16_t* src, float* dst, int n, Narrowing) noexcept { convertKernels().u16ToF32(src, dst, n); }
+inline void convertRow(const int16_t* src, float* dst, int n, Narrowing) noexcept { convertKernels().i16ToF32(src, dst, n); }
+inline void convertRow(const int32_t* src, float* dst, int n, Narrowing) noexcept { convertKernels().i32ToF32(src, dst, n); }
+inline void convertRow(const float* src, double* dst, int n, Narrowing) noexcept { convertKernels().f32ToF64(src, dst, n); }
+inline void convertRow(const double* src, float* dst, int n, Narrowing) noexcept { convertKernels().f64ToF32(src, dst, n); }
+
+inline void convertRow(const float* src, uint8_t* dst, int n, Narrowing narrowing) noexcept {
+    if (narrowing == Narrowing::SATURATE) convertKernels().f32ToU8(src, dst, n);
+    else convertRowScalar(src, dst, n, narrowing);
+}
+
+inline void convertRow(const float* src, uint16_t* dst, int n, Narrowing narrowing) noexcept {
+    if (narrowing == Narrowing::SATURATE) convertKernels().f32ToU16(src, dst, n);
+    else convertRowScalar(src, dst, n, narrowing);
+}
+
+inline void convertRow(const float* src, int16_t* dst, int n, Narrowing narrowing) noexcept {
+    if (narrowing == Narrowing::SATURATE) convertKernels().f32ToI16(src, dst, n);
+    else convertRowScalar(src, dst, n, narrowing);
+}
+
+// `width` values per row; strides are in values too
+template <typename T, typename U>
+void convertRows(const T* src, std::ptrdiff_t srcStride, U* dst, std::ptrdiff_t dstStride, int height, int width, Narrowing narrowing) {
+    parallelRows(height, width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            convertRow(src + y * srcStride, dst + y * dstStride, width, narrowing);
+        }
+    });
+}
+
+} // namespace detail
+
+///////////////////////////////////////
+//      Matrix implementation        //
+///////////////////////////////////////
+
+template <typename Scalar>
+MatrixT<Scalar>::MatrixT(int height, int width) : Grid<Scalar>(height, width) {}
+
+template <typename Scalar>
+MatrixT<Scalar>::MatrixT(std::initializer_list<std::initializer_list<Scalar>> list) : Grid<Scalar>(list.size(), list.size() ? list.begin()->size() : 0) {
+    Scalar* dst = data();
+    for (const auto& row : list) {
+        if (static_cast<int>(row.size()) != width) throw std::runtime_error("All rows of a matrix must have the same length!");
+        dst = std::copy(row.begin(), row.end(), dst);
+    }
+}
+
+template <typename Scalar>
+MatrixT<Scalar>::MatrixT(int height, int width, Uninitialized) : Grid<Scalar>(height, width, UNINITIALIZED) {}
+
+template <typename Scalar>
+MatrixT<Scalar>::MatrixT(int height, int width, Scalar value) : Grid<Scalar>(height, width, value) {}
+
+template <typename Scalar>
+template <typename E>
+MatrixT<Scalar>::MatrixT(const MatrixExpr<E>& expr) : Grid<Scalar>(expr.self().height, expr.self().width, UNINITIALIZED) {
+    IMGPROC_PROFILE_SCOPE("Matrix::evaluate", 2 * sizeof(Scalar) * height * width);
+#ifdef IMGPROC_PROFILE
+    // The buffer was allocated before the scope began
+    if (height && width) detail::profileAllocation();
+#endif
+    assign<E, detail::AssignOp>(expr);
+}
+
+template <typename Scalar>
+template <typename E>
+MatrixT<Scalar>& MatrixT<Scalar>::operator=(const MatrixExpr<E>& expr) {
+    const E& e = expr.self();
+    IMGPROC_PROFILE_SCOPE("Matrix::evaluate", 2 * sizeof(Scalar) * e.height * e.width);
+    // A leaf may be a view into *this, as in m = m.submatrix(...), so a new
+    // shape is evaluated into a fresh buffer before the old one is freed
+    if (width != e.width || height != e.height) {
+        MatrixT result(e.height, e.width, UNINITIALIZED);
+        result.template assign<E, detail::AssignOp>(expr);
+        return *this = std::move(result);
+    }
+    assign<E, detail::AssignOp>(expr);
+    return *this;
+}
+
+template <typename Scalar>
+template <typename E>
+MatrixT<Scalar>& MatrixT<Scalar>::operator+=(const MatrixExpr<E>& other) {
+    const E& e = other.self();
+    IMGPROC_PROFILE_SCOPE("Matrix::operator+=", 3 * sizeof(Scalar) * height * width);
+    if (width != e.width || height != e.height)
+        throw std::runtime_error(detail::shapeMismatch(detail::AddOp::name(), width, height, e.width, e.height));
+    assign<E, detail::AddOp>(other);
+    return *this;
+}
+
+template <typename Scalar>
+template <typename E>
+MatrixT<Scalar>& MatrixT<Scalar>::operator-=(const MatrixExpr<E>& other) {
+    const E& e = other.self();
+    IMGPROC_PROFILE_SCOPE("Matrix::operator-=", 3 * sizeof(Scalar) * height * width);
+    if (width != e.width || height != e.height)
+        throw std::runtime_error(detail::shapeMismatch(detail::SubOp::name(), width, height, e.width, e.height));
+    assign<E, detail::SubOp>(other);
+    return *this;
+}
+
+// The fused loop: dst = dst op expr
+template <typename Scalar>
+template <typename E, typename Op>
+void MatrixT<Scalar>::assign(const MatrixExpr<E>& expr) {
+    static_assert(std::is_same<Scalar, typename MatrixExpr<E>::value_type>::value, "Matrix expressions must have the element type of the matrix; convert with convertTo");
+    const E& e = expr.self();
+
+    detail::parallelRows(height, width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            auto src = e.evalRow(y);
+            Scalar* dst = (*this)[y].data();
+            for (int x = 0; x < width; x++) {
+                dst[x] = Op::template apply<Scalar>(dst[x], src[x]);
+            }
+        }
+    });
+}
+
+template <typename E>
+MatrixT<typename MatrixExpr<E>::value_type> MatrixExpr<E>::eval() const {
+    return MatrixT<value_type>(*this);
+}
+
+template <typename E>
+MatrixT<typename MatrixExpr<E>::value_type> MatrixExpr<E>::transpose() const {
+    return eval().transpose();
+}
+
+template <typename E>
+MatrixT<typename MatrixExpr<E>::value_type> MatrixExpr<E>::T() const {
+    return eval().transpose();
+}
+
+template <typename E>
+template <typename F>
+double MatrixExpr<E>::dot(const MatrixExpr<F>& other) const {
+    const E& a = self();
+    const F& b = other.self();
+    IMGPROC_PROFILE_SCOPE("Matrix::dot", (sizeof(typename MatrixExpr<E>::value_type) + sizeof(typename MatrixExpr<F>::value_type)) * a.height * a.width);
+    if (a.width != b.width || a.height != b.height)
+        throw std::runtime_error("Cannot calculate dot product of matrices with different shapes! Got " + std::to_string(a.width) + "x" + std::to_string(a.height) + " and " + std::to_string(b.width) + "x" + std::to_string(b.height));
+
+    double sum = 0;
+
+    for (int y = 0; y < a.height; y++) {
+        auto lhs = a.evalRow(y);
+        auto rhs = b.evalRow(y);
+        for (int x = 0; x < a.width; x++) {
+            sum += static_cast<double>(lhs[x]) * rhs[x];
+        }
+    }
+
+    return sum;
+}
+
+inline Matrix operator*(const Matrix& lhs, const Matrix& rhs) {
+    IMGPROC_PROFILE_SCOPE("Matrix::operator*", sizeof(double) * (static_cast<uint64_t>(lhs.height) * lhs.width + static_cast<uint64_t>(rhs.height) * rhs.width + static_cast<uint64_t>(lhs.height) * rhs.width));
+    if (lhs.width != rhs.height)
+        throw std::runtime_error("Cannot multiply matrices with incompatible shapes! Got " + std::to_string(lhs.width) + "x" + std::to_string(lhs.height) + " and " + std::to_string(rhs.width) + "x" + std::to_string(rhs.height));
+
+    Matrix result(lhs.height, rhs.width);
+
+    // See the GEMM section for the blocking scheme and accuracy guarantees
+    detail::gemm(lhs.height, rhs.width, lhs.width, lhs.data(), lhs.stride(), rhs.data(), rhs.stride(), result.data(), result.stride());
+
+    return result;
+}
+
+template <typename T>
+MatrixT<T> operator*(const MatrixT<T>& lhs, const MatrixT<T>& rhs) {
+    IMGPROC_PROFILE_SCOPE("Matrix::operator*", sizeof(T) * (static_cast<uint64_t>(lhs.height) * lhs.width + static_cast<uint64_t>(rhs.height) * rhs.width + static_cast<uint64_t>(lhs.height) * rhs.width));
+    if (lhs.width != rhs.height)
+        throw std::runtime_error("Cannot multiply matrices with incompatible shapes! Got " + std::to_string(lhs.width) + "x" + std::to_string(lhs.height) + " and " + std::to_string(rhs.width) + "x" + std::to_string(rhs.height));
+
+    MatrixT<T> result(lhs.height, rhs.width);
+
+    // Row of the result += lhs[y][k] * row k of rhs, which vectorizes along the rows
+    detail::parallelRows(lhs.height, lhs.width * rhs.width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            T* dst = result[y].data();
+            for (int k = 0; k < lhs.width; k++) {
+                T a = lhs[y][k];
+                const T* b = rhs[k].data();
+                for (int x = 0; x < rhs.width; x++) dst[x] = static_cast<T>(dst[x] + a * b[x]);
+            }
+        }
+    });
+
+    return result;
+}
+
+template <typename L, typename R>
+MatrixT<typename MatrixExpr<L>::value_type> operator*(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs) {
+    static_assert(std::is_same<typename MatrixExpr<L>::value_type, typename MatrixExpr<R>::value_type>::value, "Matrix operands must have the same element type; convert one with convertTo");
+    return lhs.eval() * rhs.eval();
+}
+
+template <typename E>
+MatrixNegateExpr<E> operator-(const MatrixExpr<E>& matrix) noexcept {
+    return MatrixNegateExpr<E>(matrix.self());
+}
+
+template <typename L, typename R>
+MatrixBinaryExpr<L, R, detail::AddOp> operator+(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs) {
+    return MatrixBinaryExpr<L, R, detail::AddOp>(lhs.self(), rhs.self());
+}
+
+template <typename L, typename R>
+MatrixBinaryExpr<L, R, detail::SubOp> operator-(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs) {
+    return MatrixBinaryExpr<L, R, detail::SubOp>(lhs.self(), rhs.self());
+}
+
+template <typename E>
+MatrixScalarExpr<E, detail::AddOp, false> operator+(const MatrixExpr<E>& matrix, typename MatrixExpr<E>::value_type scalar) noexcept {
+    return MatrixScalarExpr<E, detail::AddOp, false>(matrix.self(), scalar);
+}
+
+template <typename E>
+MatrixScalarExpr<E, detail::SubOp, false> operator-(const MatrixExpr<E>& matrix, typename MatrixExpr<E>::value_type scalar) noexcept {
+    return MatrixScalarExpr<E, detail::SubOp, false>(matrix.self(), scalar);
+}
+
+template <typename E>
+MatrixScalarExpr<E, detail::MulOp, false> operator*(const MatrixExpr<E>& matrix, typename MatrixExpr<E>::value_type scalar) noexcept {
+    return MatrixScalarExpr<E, detail::MulOp, false>(matrix.self(), scalar);
+}
+
+template <typename E>
+MatrixScalarExpr<E, detail::AddOp, true> operator+(typename MatrixExpr<E>::value_type scalar, const MatrixExpr<E>& matrix) noexcept {
+    return MatrixScalarExpr<E, detail::AddOp, true>(matrix.self(), scalar);
+}
+
+template <typename E>
+MatrixScalarExpr<E, detail::SubOp, true> operator-(typename MatrixExpr<E>::value_type scalar, const MatrixExpr<E>& matrix) noexcept {
+    return MatrixScalarExpr<E, detail::SubOp, true>(matrix.self(), scalar);
+}
+
+template <typename E>
+MatrixScalarExpr<E, detail::MulOp, true> operator*(typename MatrixExpr<E>::value_type scalar, const MatrixExpr<E>& matrix) noexcept {
+    return MatrixScalarExpr<E, detail::MulOp, true>(matrix.self(), scalar);
+}
+
+template <typename Scalar>
+MatrixT<Scalar>& MatrixT<Scalar>::operator*=(const MatrixT& other) {
+    return *this = *this * other;
+}
+
+template <typename Scalar>
+MatrixT<Scalar>& MatrixT<Scalar>::operator*=(Scalar scalar) {
+    IMGPROC_PROFILE_SCOPE("Matrix::operator*=", 2 * sizeof(Scalar) * height * width);
+    detail::parallelRows(height, width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            Scalar* a = (*this)[y].data();
+            for (int x = 0; x < width; x++) {
+                a[x] *= scalar;
+            }
+        }
+    });
+    return *this;
+}
+
+template <typename Scalar>
+MatrixT<Scalar>& MatrixT<Scalar>::operator+=(Scalar scalar) {
+    IMGPROC_PROFILE_SCOPE("Matrix::operator+=", 2 * sizeof(Scalar) * height * width);
+    detail::parallelRows(height, width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            Scalar* a = (*this)[y].data();
+            for (int x = 0; x < width; x++) {
+                a[x] += scalar;
+            }
+        }
+    });
+    return *this;
+}
+
+template <typename Scalar>
+MatrixT<Scalar>& MatrixT<Scalar>::operator-=(Scalar scalar) {
+    IMGPROC_PROFILE_SCOPE("Matrix::operator-=", 2 * sizeof(Scalar) * height * width);
+    detail::parallelRows(height, width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            Scalar* a = (*this)[y].data();
+            for (int x = 0; x < width; x++) {
+                a[x] -= scalar;
+            }
+        }
+    });
+    return *this;
+}
+
+template <typename L, typename R>
+bool operator==(const MatrixExpr<L>& left, const MatrixExpr<R>& right) noexcept {
+    static_assert(std::is_same<typename MatrixExpr<L>::value_type, typename MatrixExpr<R>::value_type>::value, "Matrix operands must have the same element type; convert one with convertTo");
+    const L& lhs = left.self();
+    const R& rhs = right.self();
+    IMGPROC_PROFILE_SCOPE("Matrix::operator==", 2 * sizeof(typename MatrixExpr<L>::value_type) * lhs.height * lhs.width);
+    if (lhs.width != rhs.width || lhs.height != rhs.height) return false;
+
+    for (int y = 0; y < lhs.height; y++) {
+        auto a = lhs.evalRow(y);
+        auto b = rhs.evalRow(y);
+        for (int x = 0; x < lhs.width; x++) {
+            if (a[x] != b[x]) return false;
+        }
+    }
+
+    return true;
+}
+
+template <typename L, typename R>
+bool operator!=(const MatrixExpr<L>& lhs, const MatrixExpr<R>& rhs) noexcept {
+    return !(lhs == rhs);
+}
+
+template <typename Scalar>
+MatrixT<Scalar> MatrixT<Scalar>::transpose() const {
+    IMGPROC_PROFILE_SCOPE("Matrix::transpose", 2 * sizeof(Scalar) * height * width);
+    MatrixT result(width, height, UNINITIALIZED);
+
+    for (int y = 0; y < height; y++) {
+        const Scalar* a = (*this)[y].data();
+        for (int x = 0; x < width; x++) {
+            result[x][y] = a[x];
+        }
+    }
+
+    return result;
+}
+
+template <typename Scalar>
+MatrixT<Scalar> MatrixT<Scalar>::T() const {
+    return transpose();
+}
+
+// The window shares storage with the matrix; nothing is copied
+template <typename Scalar>
+MatrixViewT<Scalar> MatrixT<Scalar>::submatrix(int y, int x, int h, int w) const {
+    detail::checkRegion("Submatrix", "Matrix", width, height, y, x, h, w);
+    return GridView<const Scalar>(data() + y * stride() + x, h, w, stride());
+}
+
+template <typename Scalar>
+MatrixViewT<Scalar> MatrixViewT<Scalar>::submatrix(int y, int x, int h, int w) const {
+    detail::checkRegion("Submatrix", "Matrix", this->width, this->height, y, x, h, w);
+    return GridView<const Scalar>(this->origin + y * this->rowStride + x, h, w, this->rowStride);
+}
+
+template <typename Scalar>
+template <typename U>
+MatrixT<U> MatrixT<Scalar>::convertTo(Narrowing narrowing) const {
+    IMGPROC_PROFILE_SCOPE("Matrix::convertTo", (sizeof(Scalar) + sizeof(U)) * height * width);
+    MatrixT<U> result(height, width, UNINITIALIZED);
+    detail::convertRows(data(), stride(), result.data(), result.stride(), height, width, narrowing);
+    return result;
+}
+
+////////////////////////////////////////
+//     FixedMatrix implementation     //
+////////////////////////////////////////
+
+// C++11 constexpr functions are single return statements, so the compile-time
+// operations expand an index pack over the values or recurse over them
+
+namespace detail {
+
+template <int... I> struct IndexSequence {};
+
+template <typename A, typename B> struct ConcatIndices;
+template <int... I, int... J> struct ConcatIndices<IndexSequence<I...>, IndexSequence<J...>> {
+    typedef IndexSequence<I..., (static_cast<int>(sizeof...(I)) + J)...> type;
+};
+
+// 0, 1, ..., N - 1, built by halving so large matrices stay within the template depth limit
+template <int N> struct MakeIndices {
+    typedef typename ConcatIndices<typename MakeIndices<N / 2>::type, typename MakeIndices<N - N / 2>::type>::type type;
+};
+template <> struct MakeIndices<0> { typedef IndexSequence<> type; };
+template <> struct MakeIndices<1> { typedef IndexSequence<0> type; };
+
+template <typename Op, int H, int W, typename S, int... I>
+constexpr FixedMatrix<H, W, S> fixedZip(const FixedMatrix<H, W, S>& a, const FixedMatrix<H, W, S>& b, IndexSequence<I...>) {
+    return {{ Op::template apply<S>(a.values[I], b.values[I])... }};
+}
+
+template <int H, int W, typename S, int... I>
+constexpr FixedMatrix<H, W, S> fixedScale(const FixedMatrix<H, W, S>& a, S scalar, IndexSequence<I...>) {
+    return {{ static_cast<S>(a.values[I] * scalar)... }};
+}
+
+template <int H, int W, typename S, int... I>
+constexpr FixedMatrix<H, W, S> fixedNegate(const FixedMatrix<H, W, S>& a, IndexSequence<I...>) {
+    return {{ static_cast<S>(-a.values[I])... }};
+}
+
+template <typename U, int H, int W, typename S, int... I>
+constexpr FixedMatrix<H, W, U> fixedConvert(const FixedMatrix<H, W, S>& a, IndexSequence<I...>) {
+    return {{ static_cast<U>(a.values[I])... }};
+}
+
+// Value I of the W x H transpose is a(I % H, I / H)
+template <int H, int W, typename S, int... I>
+constexpr FixedMatrix<W, H, S> fixedTranspose(const FixedMatrix<H, W, S>& a, IndexSequence<I...>) {
+    return {{ a.values[I % H * W + I / H]... }};
+}
+
+// Adds the values from index k on to `sum`, left to right like MatrixExpr::dot
+template <int N, typename S>
+constexpr S fixedSum(const S* a, int k, S sum) {
+    return k == N ? sum : fixedSum<N, S>(a, k + 1, static_cast<S>(sum + a[k]));
+}
+
+template <int N, typename S>
+constexpr S fixedDot(const S* a, const S* b, int k, S sum) {
+    return k == N ? sum : fixedDot<N, S>(a, b, k + 1, static_cast<S>(sum + a[k] * b[k]));
+}
+
+template <int N, typename S>
+constexpr bool fixedEqual(const S* a, const S* b, int k) {
+    return k == N || (a[k] == b[k] && fixedEqual<N, S>(a, b, k + 1));
+}
+
+// sum over k of a(y, k) * b(k, x)
+template <int H, int K, int W, typename S>
+constexpr S fixedProductTerm(const FixedMatrix<H, K, S>& a, const FixedMatrix<K, W, S>& b, int y, int x, int k, S sum) {
+    return k == K ? sum : fixedProductTerm(a, b, y, x, k + 1, static_cast<S>(sum + a.values[y * K + k] * b.values[k * W + x]));
+}
+
+template <int H, int K, int W, typename S, int... I>
+constexpr FixedMatrix<H, W, S> fixedProduct(const FixedMatrix<H, K, S>& a, const FixedMatrix<K, W, S>& b, IndexSequence<I...>) {
+    return {{ fixedProductTerm(a, b, I / W, I % W, 0, S()) ... }};
+}
+
+constexpr int binomialCoefficient(int n, int k) {
+    return k == 0 ? 1 : binomialCoefficient(n, k - 1) * (n - k + 1) / k;
+}
+
+template <int N, int... I>
+constexpr FixedMatrix<1, N, int> binomialRow(IndexSequence<I...>) {
+    return {{ binomialCoefficient(N - 1, I)... }};
+}
+
+} // namespace detail
+
+template <int H, int W, typename Scalar> constexpr int FixedMatrix<H, W, Scalar>::height;
+template <int H, int W, typename Scalar> constexpr int FixedMatrix<H, W, Scalar>::width;
+
+template <int H, int W, typename Scalar>
+constexpr Scalar FixedMatrix<H, W, Scalar>::sum() const {
+    return detail::fixedSum<H * W, Scalar>(values, 0, Scalar());
+}
+
+template <int H, int W, typename Scalar>
+constexpr Scalar FixedMatrix<H, W, Scalar>::dot(const FixedMatrix& other) const {
+    return detail::fixedDot<H * W, Scalar>(values, other.values, 0, Scalar());
+}
+
+template <int H, int W, typename Scalar>
+constexpr FixedMatrix<W, H, Scalar> FixedMatrix<H, W, Scalar>::transpose() const {
+    return detail::fixedTranspose(*this, typename detail::MakeIndices<H * W>::type());
+}
+
+template <int H, int W, typename Scalar>
+constexpr FixedMatrix<W, H, Scalar> FixedMatrix<H, W, Scalar>::T() const {
+    return transpose();
+}
+
+template <int H, int W, typename Scalar>
+template <typename U>
+constexpr FixedMatrix<H, W, U> FixedMatrix<H, W, Scalar>::convertTo() const {
+    return detail::fixedConvert<U>(*this, typename detail::MakeIndices<H * W>::type());
+}
+
+template <int H, int W, typename Scalar>
+Matrix FixedMatrix<H, W, Scalar>::toMatrix() const {
+    Matrix matrix(H, W);
+    for (int y = 0; y < H; y++)
+        for (int x = 0; x < W; x++) matrix[y][x] = static_cast<double>(values[y * W + x]);
+    return matrix;
+}
+
+template <int H, int W, typename S>
+constexpr FixedMatrix<H, W, S> operator-(const FixedMatrix<H, W, S>& matrix) {
+    return detail::fixedNegate(matrix, typename detail::MakeIndices<H * W>::type());
+}
+
+template <int H, int W, typename S>
+constexpr FixedMatrix<H, W, S> operator+(const FixedMatrix<H, W, S>& lhs, const FixedMatrix<H, W, S>& rhs) {
+    return detail::fixedZip<detail::AddOp>(lhs, rhs, typename detail::MakeIndices<H * W>::type());
+}
+
+template <int H, int W, typename S>
+constexpr FixedMatrix<H, W, S> operator-(const FixedMatrix<H, W, S>& lhs, const FixedMatrix<H, W, S>& rhs) {
+    return detail::fixedZip<detail::SubOp>(lhs, rhs, typename detail::MakeIndices<H * W>::type());
+}
+
+template <int H, int K, int W, typename S>
+constexpr FixedMatrix<H, W, S> operator*(const FixedMatrix<H, K, S>& lhs, const FixedMatrix<K, W, S>& rhs) {
+    return detail::fixedProduct(lhs, rhs, typename detail::MakeIndices<H * W>::type());
+}
+
+template <int H, int W, typename S>
+constexpr FixedMatrix<H, W, S> operator*(const FixedMatrix<H, W, S>& matrix, typename FixedMatrix<H, W, S>::value_type scalar) {
+    return detail::fixedScale(matrix, scalar, typename detail::MakeIndices<H * W>::type());
+}
+
+template <int H, int W, typename S>
+constexpr FixedMatrix<H, W, S> operator*(typename FixedMatrix<H, W, S>::value_type scalar, const FixedMatrix<H, W, S>& matrix) {
+    return matrix * scalar;
+}
+
+template <int H, int W, typename S>
+constexpr bool operator==(const FixedMatrix<H, W, S>& lhs, const FixedMatrix<H, W, S>& rhs) {
+    return detail::fixedEqual<H * W, S>(lhs.values, rhs.values, 0);
+}
+
+template <int H, int W, typename S>
+constexpr bool operator!=(const FixedMatrix<H, W, S>& lhs, const FixedMatrix<H, W, S>& rhs) {
+    return !(lhs == rhs);
+}
+
+// Same shape check and order of additions as the MatrixExpr overload, with constant loop bounds
+template <typename E>
+template <int H, int W, typename K>
+double MatrixExpr<E>::dot(const FixedMatrix<H, W, K>& kernel) const {
+    const E& a = self();
+    if (a.width != W || a.height != H)
+        throw std::runtime_error("Cannot calculate dot product of matrices with different shapes! Got " + std::to_string(a.width) + "x" + std::to_string(a.height) + " and " + std::to_string(W) + "x" + std::to_string(H));
+
+    double sum = 0;
+
+    for (int y = 0; y < H; y++) {
+        auto row = a.evalRow(y);
+        for (int x = 0; x < W; x++) {
+            sum += static_cast<double>(row[x]) * static_cast<double>(kernel.values[y * W + x]);
+        }
+    }
+
+    return sum;
+}
+
+constexpr FixedMatrix<3, 3, int> FixedKernel::sobelX() {
+    return {{ -1, 0, 1, -2, 0, 2, -1, 0, 1 }};
+}
+
+constexpr FixedMatrix<3, 3, int> FixedKernel::sobelY() {
+    return sobelX().T();
+}
+
+constexpr FixedMatrix<3, 3, int> FixedKernel::scharrX() {
+    return {{ -3, 0, 3, -10, 0, 10, -3, 0, 3 }};
+}
+
+constexpr FixedMatrix<3, 3, int> FixedKernel::scharrY() {
+    return scharrX().T();
+}
+
+constexpr FixedMatrix<3, 3, int> FixedKernel::prewittX() {
+    return {{ -1, 0, 1, -1, 0, 1, -1, 0, 1 }};
+}
+
+constexpr FixedMatrix<3, 3, int> FixedKernel::prewittY() {
+    return prewittX().T();
+}
+
+constexpr FixedMatrix<3, 3, int> FixedKernel::laplacian() {
+    return {{ 0, 1, 0, 1, -4, 1, 0, 1, 0 }};
+}
+
+template <int N>
+constexpr FixedMatrix<1, N, int> FixedKernel::binomialRow() {
+    static_assert(N >= 1 && N <= 15, "Binomial kernels have 1 to 15 taps");
+    return detail::binomialRow<N>(typename detail::MakeIndices<N>::type());
+}
+
+template <int N>
+constexpr FixedMatrix<N, N, int> FixedKernel::binomial() {
+    return binomialRow<N>().T() * binomialRow<N>();
+}
+
+// 4^(N - 1) is a power of two, so the normalized taps are exact
+template <int N>
+constexpr FixedMatrix<N, N, double> FixedKernel::gaussian() {
+    return binomial<N>().template convertTo<double>() * (1.0 / (1 << 2 * (N - 1)));
+}
+
+////////////////////////////////////////
+//        BMP codec implementation    //
+////////////////////////////////////////
+
+namespace detail {
+
+inline void grayHeaders(int height, int width, BITMAPFILEHEADER& fileHeader, BITMAPINFOHEADER& infoHeader) noexcept {
+    // Initializer list
+    fileHeader = {
+        0x4D42,
+        static_cast<uint32_t>(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + COLOR_TABLE_SIZE * 4 + height * ((width + 3) & ~3)),
+        0, 0,
+        static_cast<uint32_t>(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + COLOR_TABLE_SIZE * 4),
+    };
+
+    infoHeader = {
+        sizeof(BITMAPINFOHEADER),
+        width,
+        height,
+        1,
+        8,
+        BI_RGB,
+        0, 0, 0,
+        COLOR_TABLE_SIZE,
+        0,
+    };
+}
+
+inline void rgbHeaders(int height, int width, BITMAPFILEHEADER& fileHeader, BITMAPINFOHEADER& infoHeader) noexcept {
+    int paddingSize = (4 - (width * 3 % 4)) % 4;
+
+    fileHeader = {
+        0x4D42,
+        static_cast<uint32_t>(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + height * width * 3 + height * paddingSize),
+        0, 0,
+        static_cast<uint32_t>(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)),
+    };
+
+    infoHeader = {
+        sizeof(BITMAPINFOHEADER),
+        width,
+        height,
+        1,
+        24,
+        BI_RGB,
+        0, 0, 0, 0, 0,
+    };
+}
+
+// Describes why headers do not describe an uncompressed 24-bit BMP, or returns nullptr
+inline const char* rgbHeaderError(const BITMAPFILEHEADER& fileHeader, const BITMAPINFOHEADER& infoHeader) noexcept {
+    if (fileHeader.bfType != 0x4D42) return "Not a BMP file: ";
+    if (infoHeader.biSize < sizeof(BITMAPINFOHEADER)) return "Unsupported BMP header version: ";
+    if (infoHeader.biCompression != BI_RGB) return "Only uncompressed BMP files are supported: ";
+    if (infoHeader.biBitCount != 24) return "Only 24-bit BMP files are supported: ";
+    if (infoHeader.biWidth < 0 || infoHeader.biHeight == std::numeric_limits<int32_t>::min()) return "Invalid BMP dimensions: ";
+    return nullptr;
+}
+
+// Rows are moved through this many bytes of scratch at a time
+constexpr std::size_t IO_CHUNK_BYTES = 1 << 20;
+
+// Per-thread staging buffer reused across calls, so steady-state I/O does not
+// allocate. Requests are a chunk of rows, or one row when that is larger; a
+// buffer grown past a few chunks by very wide rows is released again by the
+// next ordinary request, so a thread never holds on to it.
+inline std::vector<char>& ioScratch(std::size_t bytes) {
+    static thread_local std::vector<char> scratch;
+    if (scratch.capacity() > 4 * IO_CHUNK_BYTES && bytes <= IO_CHUNK_BYTES) std::vector<char>(bytes).swap(scratch);
+    if (scratch.size() < bytes) scratch.resize(bytes);
+    return scratch;
+}
+
+// Stored BMP rows are padded to a multiple of 4 bytes
+inline std::size_t paddedRowBytes(std::size_t rowBytes) noexcept {
+    return (rowBytes + 3) & ~static_cast<std::size_t>(3);
+}
+
+// Write pixel rows bottom-up with explicit zero padding, a chunk of rows per call
+template <typename T>
+void writeRows(std::ofstream& file, GridView<const T> pixels) {
+    std::size_t rowBytes = static_cast<std::size_t>(pixels.width) * sizeof(T);
+    std::size_t stored = paddedRowBytes(rowBytes);
+    if (pixels.height <= 0 || stored == 0) return;
+
+    int chunkRows = static_cast<int>(std::max<std::size_t>(1, IO_CHUNK_BYTES / stored));
+    chunkRows = std::min(chunkRows, pixels.height);
+    std::vector<char>& scratch = ioScratch(stored * chunkRows);
+
+    // BMP files are stored bottom-up
+    for (int done = 0; done < pixels.height; done += chunkRows) {
+        int rows = std::min(chunkRows, pixels.height - done);
+        for (int i = 0; i < rows; i++) {
+            char* dst = scratch.data() + i * stored;
+            std::memcpy(dst, pixels[pixels.height - 1 - done - i].data(), rowBytes);
+            std::memset(dst + rowBytes, 0, stored - rowBytes);
+        }
+        file.write(scratch.data(), stored * rows);
+    }
+}
+
+// Read stored pixel rows starting at the current position into `pixels`,
+// bottom-up unless told otherwise.
+// The padding of the final row may be missing; older writers omitted it.
+template <typename T>
+void readRows(std::ifstream& file, GridView<T> pixels, bool bottomUp = true) {
+    std::size_t rowBytes = static_cast<std::size_t>(pixels.width) * sizeof(T);
+    std::size_t stored = paddedRowBytes(rowBytes);
+    if (pixels.height <= 0 || stored == 0) return;
+
+    if (stored == rowBytes && pixels.stride() == pixels.width) {
+        // Unpadded and contiguous: one read, then flip the rows in memory
+        std::size_t total = stored * pixels.height;
+        file.read(reinterpret_cast<char*>(pixels.data()), total);
+        if (static_cast<std::size_t>(file.gcount()) != total) throw std::runtime_error("Unexpected end of file while reading pixel data!");
+        for (int y = 0; bottomUp && y < pixels.height / 2; y++) {
+            std::swap_ranges(pixels[y].begin(), pixels[y].end(), pixels[pixels.height - 1 - y].begin());
+        }
+        return;
+    }
+
+    int chunkRows = static_cast<int>(std::max<std::size_t>(1, IO_CHUNK_BYTES / stored));
+    chunkRows = std::min(chunkRows, pixels.height);
+    std::vector<char>& scratch = ioScratch(stored * chunkRows);
+
+    for (int done = 0; done < pixels.height; done += chunkRows) {
+        int rows = std::min(chunkRows, pixels.height - done);
+        std::size_t wanted = stored * rows;
+        file.read(scratch.data(), wanted);
+        std::size_t got = static_cast<std::size_t>(file.gcount());
+        bool last = done + rows == pixels.height;
+        if (got < wanted && !(last && got >= wanted - (stored - rowBytes)))
+            throw std::runtime_error("Unexpected end of file while reading pixel data!");
+        for (int i = 0; i < rows; i++) {
+            int y = bottomUp ? pixels.height - 1 - done - i : done + i;
+            std::memcpy(pixels[y].data(), scratch.data() + i * stored, rowBytes);
+        }
+    }
+}
+
+// Call fn(y, storedRow) for each of `height` stored rows of `rowBytes` pixel
+// bytes starting at the current position, reading a chunk of rows at a time
+template <typename F>
+void forEachStoredRow(std::ifstream& file, std::size_t rowBytes, int height, bool bottomUp, F fn) {
+    std::size_t stored = paddedRowBytes(rowBytes);
+    if (height <= 0 || stored == 0) return;
+
+    int chunkRows = static_cast<int>(std::max<std::size_t>(1, IO_CHUNK_BYTES / stored));
+    chunkRows = std::min(chunkRows, height);
+    std::vector<char>& scratch = ioScratch(stored * chunkRows);
+
+    for (int done = 0; done < height; done += chunkRows) {
+        int rows = std::min(chunkRows, height - done);
+        std::size_t wanted = stored * rows;
+        file.read(scratch.data(), wanted);
+        std::size_t got = static_cast<std::size_t>(file.gcount());
+        bool last = done + rows == height;
+        if (got < wanted && !(last && got >= wanted - (stored - rowBytes)))
+            throw std::runtime_error("Unexpected end of file while reading pixel data!");
+        for (int i = 0; i < rows; i++) {
+            fn(bottomUp ? height - 1 - done - i : done + i, reinterpret_cast<const uint8_t*>(scratch.data()) + i * stored);
+        }
+    }
+}
+
+// Read the color table that follows the info header, whichever version it is
+inline std::size_t readPalette(std::ifstream& file, const BITMAPINFOHEADER& infoHeader, std::array<uint8_t, COLOR_TABLE_SIZE * 4>& palette) {
+    if (infoHeader.biBitCount > 8) throw std::runtime_error("Only 1, 4 and 8-bit BMP files have a color table!");
+    std::size_t colors = infoHeader.biClrUsed ? infoHeader.biClrUsed : std::size_t(1) << infoHeader.biBitCount;
+    colors = std::min<std::size_t>(colors, COLOR_TABLE_SIZE);
+    palette.fill(0);
+    file.seekg(sizeof(BITMAPFILEHEADER) + infoHeader.biSize, std::ios::beg);
+    file.read(reinterpret_cast<char*>(palette.data()), colors * 4);
+    if (!file) throw std::runtime_error("Color table is truncated!");
+    return colors;
+}
+
+// Expand RLE8/RLE4 data into palette indices. Lines are stored bottom-up;
+// pixels skipped by end-of-line or delta escapes stay at index 0, and
+// anything that would land outside the image is dropped.
+inline void decodeRLE(const uint8_t* src, std::size_t size, int bits, GridView<uint8_t> indices) noexcept {
+    const uint8_t* end = src + size;
+    int width = indices.width, height = indices.height;
+    int x = 0, line = 0;
+
+    while (end - src >= 2 && line < height) {
+        int count = src[0], value = src[1];
+        src += 2;
+        uint8_t* row = indices[height - 1 - line].data();
+
+        if (count) {
+            // Encoded run: one index (RLE8) or two alternating nibbles (RLE4)
+            int n = std::min(count, width - x);
+            if (bits == 8) {
+                if (n > 0) std::memset(row + x, value, n);
+            } else {
+                uint8_t pair[2] = { static_cast<uint8_t>(value >> 4), static_cast<uint8_t>(value & 0x0F) };
+                for (int i = 0; i < n; i++) row[x + i] = pair[i & 1];
+            }
+            x += count;
+            continue;
+        }
+
+        switch (value) {
+            case 0:     // End of line
+                x = 0;
+                line++;
+                break;
+            case 1:     // End of bitmap
+                return;
+            case 2:     // Delta
+                if (end - src < 2) return;
+                x += src[0];
+                line += src[1];
+                src += 2;
+                break;
+            default: {  // Absolute run, padded to a 16-bit boundary
+                std::size_t bytes = bits == 8 ? value : (value + 1) / 2;
+                if (static_cast<std::size_t>(end - src) < bytes) return;
+                int n = std::min(value, width - x);
+                if (bits == 8) {
+                    if (n > 0) std::memcpy(row + x, src, n);
+                } else {
+                    for (int i = 0; i < n; i++) row[x + i] = (i & 1) ? src[i / 2] & 0x0F : src[i / 2] >> 4;
+                }
+                x += value;
+                src += std::min<std::size_t>((bytes + 1) & ~static_cast<std::size_t>(1), end - src);
+            }
+        }
+    }
+}
+
+// RLE8 encoding, bottom-up: runs of two or more equal pixels become encoded
+// runs, stretches without a run of three become absolute runs
+inline void encodeRLE8(GridView<const uint8_t> pixels, std::vector<uint8_t>& out) {
+    out.clear();
+    out.reserve(static_cast<std::size_t>(pixels.height) * (pixels.width + 2) + 2);
+
+    for (int y = pixels.height - 1; y >= 0; --y) {
+        const uint8_t* row = pixels[y].data();
+        int width = pixels.width;
+        int x = 0;
+
+        while (x < width) {
+            int run = 1;
+            while (x + run < width && run < 255 && row[x + run] == row[x]) run++;
+            if (run >= 2) {
+                out.push_back(static_cast<uint8_t>(run));
+                out.push_back(row[x]);
+                x += run;
+                continue;
+            }
+
+            int start = x;
+            while (x < width && x - start < 255 && !(x + 2 < width && row[x] == row[x + 1] && row[x] == row[x + 2])) x++;
+            int n = x - start;
+            if (n >= 3) {
+                out.push_back(0);
+                out.push_back(static_cast<uint8_t>(n));
+                out.insert(out.end(), row + start, row + x);
+                if (n & 1) out.push_back(0);
+            } else {
+                // Absolute runs of 1 or 2 would collide with the escape codes
+                for (int i = start; i < x; i++) {
+                    out.push_back(1);
+                    out.push_back(row[i]);
+                }
+            }
+        }
+
+        out.push_back(0);   // End of line
+        out.push_back(0);
+    }
+
+    out.push_back(0);       // End of bitmap
+    out.push_back(1);
+}
+
+// Palette indices of a 1, 4 or 8-bit BMP, uncompressed or RLE, top row first
+inline Grid<uint8_t> readIndices(std::ifstream& file, const BITMAPFILEHEADER& fileHeader, const BITMAPINFOHEADER& infoHeader) {
+    int bits = infoHeader.biBitCount;
+    if (infoHeader.biWidth < 0 || infoHeader.biHeight == std::numeric_limits<int32_t>::min()) throw std::runtime_error("Invalid BMP dimensions!");
+    int width = infoHeader.biWidth;
+    int height = infoHeader.biHeight < 0 ? -infoHeader.biHeight : infoHeader.biHeight;
+    bool bottomUp = infoHeader.biHeight >= 0;
+
+    Grid<uint8_t> indices(height, width);
+    file.seekg(fileHeader.bfOffBits, std::ios::beg);
+
+    if (infoHeader.biCompression == BI_RLE8 || infoHeader.biCompression == BI_RLE4) {
+        if (!bottomUp) throw std::runtime_error("Compressed BMP files cannot be stored top-down!");
+        if ((infoHeader.biCompression == BI_RLE8) != (bits == 8) || (infoHeader.biCompression == BI_RLE4) != (bits == 4))
+            throw std::runtime_error("RLE8 requires 8-bit and RLE4 requires 4-bit pixels!");
+
+        // The header's size is only a hint: never read past the end of the file
+        file.seekg(0, std::ios::end);
+        std::size_t end = static_cast<std::size_t>(file.tellg());
+        std::size_t remaining = end - std::min<std::size_t>(fileHeader.bfOffBits, end);
+        file.seekg(fileHeader.bfOffBits, std::ios::beg);
+        std::size_t size = infoHeader.biSizeRGBImage ? std::min<std::size_t>(infoHeader.biSizeRGBImage, remaining) : remaining;
+
+        // Compressed data is read whole, into a buffer freed on return
+        std::vector<char> data(size);
+        file.read(data.data(), size);
+        decodeRLE(reinterpret_cast<const uint8_t*>(data.data()), static_cast<std::size_t>(file.gcount()), bits, indices.view());
+        return indices;
+    }
+
+    if (bits == 8) {
+        readRows(file, indices.view(), bottomUp);
+        return indices;
+    }
+
+    // Sub-byte pixels are packed most significant bits first
+    int perByte = 8 / bits;
+    int mask = (1 << bits) - 1;
+    forEachStoredRow(file, (static_cast<std::size_t>(width) * bits + 7) / 8, height, bottomUp, [&](int y, const uint8_t* src) {
+        uint8_t* dst = indices[y].data();
+        for (int x = 0; x < width; x++) {
+            int shift = 8 - bits * (x % perByte + 1);
+            dst[x] = (src[x / perByte] >> shift) & mask;
+        }
+    });
+    return indices;
+}
+
+// One color channel of a BI_BITFIELDS (or 16/32-bit BI_RGB) pixel
+struct BitfieldChannel {
+    uint32_t mask;
+    int shift;
+    uint32_t maximum;
+
+    explicit BitfieldChannel(uint32_t mask) noexcept : mask(mask), shift(0), maximum(0) {
+        if (!mask) return;
+        while (!((mask >> shift) & 1)) shift++;
+        maximum = mask >> shift;
+    }
+
+    // Rescale the field to 0..255, rounding to nearest
+    uint8_t operator()(uint32_t pixel) const noexcept {
+        if (!maximum) return 0;
+        uint32_t value = (pixel & mask) >> shift;
+        if (maximum == 255) return static_cast<uint8_t>(value);
+        return static_cast<uint8_t>((static_cast<uint64_t>(value) * 255 + maximum / 2) / maximum);
+    }
+};
+
+// Unpack 16 or 32-bit pixels through precomputed channel masks
+inline void readBitfields(std::ifstream& file, const BITMAPFILEHEADER& fileHeader, const BITMAPINFOHEADER& infoHeader, GridView<RGBTRIPLE> pixels) {
+    int bytes = infoHeader.biBitCount / 8;
+    uint32_t masks[3];
+
+    if (infoHeader.biCompression == BI_BITFIELDS) {
+        // The masks directly follow the 40-byte header, also inside V4/V5 headers
+        file.seekg(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER), std::ios::beg);
+        file.read(reinterpret_cast<char*>(masks), sizeof(masks));
+        if (!file) throw std::runtime_error("Bit field masks are truncated!");
+    } else if (bytes == 2) {
+        masks[0] = 0x7C00; masks[1] = 0x03E0; masks[2] = 0x001F;          // 5-5-5
+    } else {
+        masks[0] = 0xFF0000; masks[1] = 0x00FF00; masks[2] = 0x0000FF;    // 8-8-8 with an unused byte
+    }
+
+    BitfieldChannel red(masks[0]), green(masks[1]), blue(masks[2]);
+
+    file.seekg(fileHeader.bfOffBits, std::ios::beg);
+    forEachStoredRow(file, static_cast<std::size_t>(pixels.width) * bytes, pixels.height, infoHeader.biHeight >= 0, [&](int y, const uint8_t* src) {
+        RGBTRIPLE* dst = pixels[y].data();
+        for (int x = 0; x < pixels.width; x++, src += bytes) {
+            uint32_t pixel = bytes == 4 ? src[0] | src[1] << 8 | src[2] << 16 | static_cast<uint32_t>(src[3]) << 24 : src[0] | src[1] << 8;
+            dst[x] = { blue(pixel), green(pixel), red(pixel) };
+        }
+    });
+}
+
+// Headers, gray color table(Mandatory for color depths ≤ 8 bits) and all go out in one write
+inline void writeGrayPrologue(std::ofstream& file, const BITMAPFILEHEADER& fileHeader, const BITMAPINFOHEADER& infoHeader) {
+    std::array<char, sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + COLOR_TABLE_SIZE * 4> prologue;
+    std::memcpy(prologue.data(), &fileHeader, sizeof(BITMAPFILEHEADER));
+    std::memcpy(prologue.data() + sizeof(BITMAPFILEHEADER), &infoHeader, sizeof(BITMAPINFOHEADER));
+    uint8_t* colorTable = reinterpret_cast<uint8_t*>(prologue.data() + sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER));
+    for (uint16_t i = 0; i < COLOR_TABLE_SIZE; i++) {
+        uint8_t* color = colorTable + i * 4;
+        color[0] = color[1] = color[2] = i; // BGR channels
+        color[3] = 0;                       // Alpha channel
+    }
+    file.write(prologue.data(), prologue.size());
+}
+
+inline void writeGray(const std::string& filename, const BITMAPFILEHEADER& fileHeader, const BITMAPINFOHEADER& infoHeader, GridView<const uint8_t> pixels) {
+    std::ofstream file(filename, std::ios::binary);
+
+    if (!file) throw std::runtime_error("Failed to open the file: " + filename);
+
+    writeGrayPrologue(file, fileHeader, infoHeader);
+    writeRows(file, pixels);
+
+    file.close();
+    if (!file) throw std::runtime_error("Failed to write the file: " + filename);
+}
+
+inline void writeGrayRLE8(const std::string& filename, BITMAPFILEHEADER fileHeader, BITMAPINFOHEADER infoHeader, GridView<const uint8_t> pixels) {
+    std::vector<uint8_t> encoded;
+    encodeRLE8(pixels, encoded);
+
+    infoHeader.biCompression = BI_RLE8;
+    infoHeader.biSizeRGBImage = static_cast<uint32_t>(encoded.size());
+    fileHeader.bfSize = static_cast<uint32_t>(fileHeader.bfOffBits + encoded.size());
+
+    std::ofstream file(filename, std::ios::binary);
+
+    if (!file) throw std::runtime_error("Failed to open the file: " + filename);
+
+    writeGrayPrologue(file, fileHeader, infoHeader);
+    file.write(reinterpret_cast<const char*>(encoded.data()), encoded.size());
+
+    file.close();
+    if (!file) throw std::runtime_error("Failed to write the file: " + filename);
+}
+
+inline void writeRGB(const std::string& filename, const BITMAPFILEHEADER& fileHeader, const BITMAPINFOHEADER& infoHeader, GridView<const RGBTRIPLE> pixels) {
+    std::ofstream file(filename, std::ios::binary);
+
+    if (!file) throw std::runtime_error("Failed to open the file: " + filename);
+
+    file.write(reinterpret_cast<const char*>(&fileHeader), sizeof(BITMAPFILEHEADER));
+    file.write(reinterpret_cast<const char*>(&infoHeader), sizeof(BITMAPINFOHEADER));
+
+    writeRows(file, pixels);
+
+    file.close();
+    if (!file) throw std::runtime_error("Failed to write the file: " + filename);
+}
+
+inline void writeView(const std::string& filename, GridView<const uint8_t> pixels) {
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER infoHeader;
+    grayHeaders(pixels.height, pixels.width, fileHeader, infoHeader);
+    writeGray(filename, fileHeader, infoHeader, pixels);
+}
+
+inline void writeView(const std::string& filename, GridView<const RGBTRIPLE> pixels) {
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER infoHeader;
+    rgbHeaders(pixels.height, pixels.width, fileHeader, infoHeader);
+    writeRGB(filename, fileHeader, infoHeader, pixels);
+}
+
+} // namespace detail
+
+// Writes just the region, with headers sized to it
+template <typename T>
+const ImageView<T>& ImageView<T>::toFile(const std::string& filename) const {
+    detail::writeView(filename, GridView<const typename std::remove_const<T>::type>(*this));
+    return *this;
+}
+
+////////////////////////////////////////
+//      Color conversion kernels      //
+////////////////////////////////////////
+
+// Row kernels behind toGray, getChannel and fromGrays. The SSSE3 and AVX2
+// versions must reproduce the scalar ones bit for bit.
+
+namespace detail {
+
+// The reference definitions of both gray conversions
+inline uint8_t grayHSI(RGBTRIPLE pixel) noexcept {
+    return (pixel.rgbtRed + pixel.rgbtGreen + pixel.rgbtBlue) / 3;
+}
+
+inline uint8_t grayYCC(RGBTRIPLE pixel) noexcept {
+    return static_cast<uint8_t>(0.299 * pixel.rgbtRed + 0.587 * pixel.rgbtGreen + 0.114 * pixel.rgbtBlue);
+}
+
+inline void grayHSIRowScalar(const RGBTRIPLE* src, uint8_t* dst, int n) noexcept {
+    for (int x = 0; x < n; x++) dst[x] = grayHSI(src[x]);
+}
+
+inline void grayYCCRowScalar(const RGBTRIPLE* src, uint8_t* dst, int n) noexcept {
+    for (int x = 0; x < n; x++) dst[x] = grayYCC(src[x]);
+}
+
+// `channel` is the byte offset within RGBTRIPLE: 0 blue, 1 green, 2 red
+inline void channelRowScalar(const RGBTRIPLE* src, uint8_t* dst, int n, int channel) noexcept {
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(src) + channel;
+    for (int x = 0; x < n; x++) dst[x] = bytes[x * 3];
+}
+
+inline void mergeRowScalar(const uint8_t* b, const uint8_t* g, const uint8_t* r, RGBTRIPLE* dst, int n) noexcept {
+    for (int x = 0; x < n; x++) dst[x] = { b[x], g[x], r[x] };
+}
+
+inline uint8_t narrow(double value, Narrowing mode) noexcept {
+    if (mode == Narrowing::SATURATE) return value > 0 ? static_cast<uint8_t>(value < 255 ? value : 255) : 0;
+    return static_cast<uint8_t>(static_cast<int>(value));
+}
+
+inline void narrowRow(const double* src, uint8_t* dst, int n, Narrowing mode) noexcept {
+    if (mode == Narrowing::SATURATE) {
+        for (int x = 0; x < n; x++) dst[x] = src[x] > 0 ? static_cast<uint8_t>(src[x] < 255 ? src[x] : 255) : 0;
+    } else {
+        for (int x = 0; x < n; x++) dst[x] = static_cast<uint8_t>(static_cast<int>(src[x]));
+    }
+}
+
+inline void splitRowScalar(const RGBTRIPLE* src, uint8_t* b, uint8_t* g, uint8_t* r, int n) noexcept {
+    for (int x = 0; x < n; x++) {
+        b[x] = src[x].rgbtBlue;
+        g[x] = src[x].rgbtGreen;
+        r[x] = src[x].rgbtRed;
+    }
+}
+
+#ifdef IMGPROC_X86_SIMD
+
+// pshufb masks for moving between 16 packed BGR pixels (three 16-byte
+// chunks) and 16 bytes of a single channel
+struct ShuffleTables {
+    alignas(16) int8_t deinterleave[3][3][16];  // [channel][input chunk][byte]
+    alignas(16) int8_t interleave[3][3][16];    // [output chunk][channel][byte]
+
+    ShuffleTables() noexcept {
+        for (int k = 0; k < 3; k++) {
+            for (int chunk = 0; chunk < 3; chunk++) {
+                for (int i = 0; i < 16; i++) {
+                    int from = 3 * i + k - 16 * chunk;
+                    deinterleave[k][chunk][i] = static_cast<int8_t>(from >= 0 && from < 16 ? from : -128);
+
+                    int to = 16 * k + i;    // Here k is the output chunk and chunk the channel
+                    interleave[k][chunk][i] = static_cast<int8_t>(to % 3 == chunk ? to / 3 : -128);
+                }
+            }
+        }
+    }
+};
+
+inline const ShuffleTables& shuffleTables() noexcept {
+    static const ShuffleTables tables;
+    return tables;
+}
+
+// YCC luma is floor((299 R + 587 G + 114 B) / 1000), computed exactly with
+// 16-bit multiply-adds and a reciprocal multiply: S / 1000 = (S >> 3) / 125,
+// and (T * 33555) >> 22 == T / 125 for every T <= 31875. The double
+// expression only disagrees when S is a multiple of 1000, where it may round
+// just below the integer, so those lanes are redone with grayYCC().
+constexpr int YCC_WEIGHT_R = 299;
+constexpr int YCC_WEIGHT_G = 587;
+constexpr int YCC_WEIGHT_B = 114;
+// Above INT16_MAX: set1_epi16 takes it as int16_t, and the unsigned
+// multiply (mulhi_epu16) reads the bits back as 33555
+constexpr int DIV125_MAGIC = 33555;
+constexpr int DIV3_MAGIC = 21846;   // (v * 21846) >> 16 == v / 3 for v <= 765
+
+IMGPROC_TARGET("ssse3")
+inline __m128i deinterleaveSsse3(__m128i a, __m128i b, __m128i c, const int8_t (*masks)[16]) noexcept {
+    __m128i x = _mm_shuffle_epi8(a, _mm_load_si128(reinterpret_cast<const __m128i*>(masks[0])));
+    __m128i y = _mm_shuffle_epi8(b, _mm_load_si128(reinterpret_cast<const __m128i*>(masks[1])));
+    __m128i z = _mm_shuffle_epi8(c, _mm_load_si128(reinterpret_cast<const __m128i*>(masks[2])));
+    return _mm_or_si128(_mm_or_si128(x, y), z);
+}
+
+// Luma of 8 pixels held as 16-bit lanes, plus a mask of lanes needing the scalar fix-up
+IMGPROC_TARGET("ssse3")
+inline __m128i lumaSsse3(__m128i r, __m128i g, __m128i b, __m128i& inexact) noexcept {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i weightsRG = _mm_set1_epi32(YCC_WEIGHT_G << 16 | YCC_WEIGHT_R);
+    const __m128i weightB = _mm_set1_epi32(YCC_WEIGHT_B);
+    const __m128i seven = _mm_set1_epi32(7);
+
+    __m128i s0 = _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(r, g), weightsRG), _mm_madd_epi16(_mm_unpacklo_epi16(b, zero), weightB));
+    __m128i s1 = _mm_add_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(r, g), weightsRG), _mm_madd_epi16(_mm_unpackhi_epi16(b, zero), weightB));
+    __m128i t = _mm_packs_epi32(_mm_srli_epi32(s0, 3), _mm_srli_epi32(s1, 3));
+    __m128i low = _mm_packs_epi32(_mm_and_si128(s0, seven), _mm_and_si128(s1, seven));
+    __m128i q = _mm_srli_epi16(_mm_mulhi_epu16(t, _mm_set1_epi16(static_cast<int16_t>(DIV125_MAGIC))), 6);
+
+    inexact = _mm_and_si128(_mm_cmpeq_epi16(_mm_mullo_epi16(q, _mm_set1_epi16(125)), t), _mm_cmpeq_epi16(low, zero));
+    return q;
+}
+
+IMGPROC_TARGET("ssse3")
+inline void grayYCCRowSsse3(const RGBTRIPLE* src, uint8_t* dst, int n) noexcept {
+    const ShuffleTables& tables = shuffleTables();
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+    const __m128i zero = _mm_setzero_si128();
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * x));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * x + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * x + 32));
+        __m128i blue = deinterleaveSsse3(a, b, c, tables.deinterleave[0]);
+        __m128i green = deinterleaveSsse3(a, b, c, tables.deinterleave[1]);
+        __m128i red = deinterleaveSsse3(a, b, c, tables.deinterleave[2]);
+
+        __m128i fixLo, fixHi;
+        __m128i lo = lumaSsse3(_mm_unpacklo_epi8(red, zero), _mm_unpacklo_epi8(green, zero), _mm_unpacklo_epi8(blue, zero), fixLo);
+        __m128i hi = lumaSsse3(_mm_unpackhi_epi8(red, zero), _mm_unpackhi_epi8(green, zero), _mm_unpackhi_epi8(blue, zero), fixHi);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(lo, hi));
+
+        int fix = _mm_movemask_epi8(_mm_packs_epi16(fixLo, fixHi));
+        while (fix) {
+            int i = __builtin_ctz(fix);
+            dst[x + i] = grayYCC(src[x + i]);
+            fix &= fix - 1;
+        }
+    }
+
+    grayYCCRowScalar(src + x, dst + x, n - x);
+}
+
+IMGPROC_TARGET("ssse3")
+inline void grayHSIRowSsse3(const RGBTRIPLE* src, uint8_t* dst, int n) noexcept {
+    const ShuffleTables& tables = shuffleTables();
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i magic = _mm_set1_epi16(DIV3_MAGIC);
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * x));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * x + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * x + 32));
+        __m128i blue = deinterleaveSsse3(a, b, c, tables.deinterleave[0]);
+        __m128i green = deinterleaveSsse3(a, b, c, tables.deinterleave[1]);
+        __m128i red = deinterleaveSsse3(a, b, c, tables.deinterleave[2]);
+
+        __m128i lo = _mm_add_epi16(_mm_add_epi16(_mm_unpacklo_epi8(red, zero), _mm_unpacklo_epi8(green, zero)), _mm_unpacklo_epi8(blue, zero));
+        __m128i hi = _mm_add_epi16(_mm_add_epi16(_mm_unpackhi_epi8(red, zero), _mm_unpackhi_epi8(green, zero)), _mm_unpackhi_epi8(blue, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_packus_epi16(_mm_mulhi_epu16(lo, magic), _mm_mulhi_epu16(hi, magic)));
+    }
+
+    grayHSIRowScalar(src + x, dst + x, n - x);
+}
+
+IMGPROC_TARGET("ssse3")
+inline void channelRowSsse3(const RGBTRIPLE* src, uint8_t* dst, int n, int channel) noexcept {
+    const int8_t (*masks)[16] = shuffleTables().deinterleave[channel];
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * x));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * x + 16));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * x + 32));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), deinterleaveSsse3(a, b, c, masks));
+    }
+
+    channelRowScalar(src + x, dst + x, n - x, channel);
+}
+
+IMGPROC_TARGET("ssse3")
+inline void splitRowSsse3(const RGBTRIPLE* src, uint8_t* b, uint8_t* g, uint8_t* r, int n) noexcept {
+    const ShuffleTables& tables = shuffleTables();
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16) {
+        __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * x));
+        __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * x + 16));
+        __m128i p2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 3 * x + 32));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(b + x), deinterleaveSsse3(p0, p1, p2, tables.deinterleave[0]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(g + x), deinterleaveSsse3(p0, p1, p2, tables.deinterleave[1]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(r + x), deinterleaveSsse3(p0, p1, p2, tables.deinterleave[2]));
+    }
+
+    splitRowScalar(src + x, b + x, g + x, r + x, n - x);
+}
+
+IMGPROC_TARGET("ssse3")
+inline void mergeRowSsse3(const uint8_t* b, const uint8_t* g, const uint8_t* r, RGBTRIPLE* dst, int n) noexcept {
+    const ShuffleTables& tables = shuffleTables();
+    uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16) {
+        __m128i planes[3] = {
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + x)),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(g + x)),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(r + x)),
+        };
+        for (int chunk = 0; chunk < 3; chunk++) {
+            const int8_t (*masks)[16] = tables.interleave[chunk];
+            __m128i v = _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(planes[0], _mm_load_si128(reinterpret_cast<const __m128i*>(masks[0]))),
+                _mm_shuffle_epi8(planes[1], _mm_load_si128(reinterpret_cast<const __m128i*>(masks[1])))),
+                _mm_shuffle_epi8(planes[2], _mm_load_si128(reinterpret_cast<const __m128i*>(masks[2]))));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 3 * x + 16 * chunk), v);
+        }
+    }
+
+    mergeRowScalar(b + x, g + x, r + x, dst + x, n - x);
+}
+
+// The AVX2 kernels run the SSSE3 shuffles on both 128-bit lanes at once:
+// the low lane handles pixels 0-15 of a block, the high lane pixels 16-31.
+
+IMGPROC_TARGET("avx2")
+inline __m256i loadLanesAvx2(const uint8_t* lo, const uint8_t* hi) noexcept {
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(lo))), _mm_loadu_si128(reinterpret_cast<const __m128i*>(hi)), 1);
+}
+
+IMGPROC_TARGET("avx2")
+inline __m256i maskAvx2(const int8_t* mask) noexcept {
+    return _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(mask)));
+}
+
+IMGPROC_TARGET("avx2")
+inline __m256i deinterleaveAvx2(__m256i a, __m256i b, __m256i c, const int8_t (*masks)[16]) noexcept {
+    __m256i x = _mm256_shuffle_epi8(a, maskAvx2(masks[0]));
+    __m256i y = _mm256_shuffle_epi8(b, maskAvx2(masks[1]));
+    __m256i z = _mm256_shuffle_epi8(c, maskAvx2(masks[2]));
+    return _mm256_or_si256(_mm256_or_si256(x, y), z);
+}
+
+IMGPROC_TARGET("avx2")
+inline __m256i lumaAvx2(__m256i r, __m256i g, __m256i b, __m256i& inexact) noexcept {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i weightsRG = _mm256_set1_epi32(YCC_WEIGHT_G << 16 | YCC_WEIGHT_R);
+    const __m256i weightB = _mm256_set1_epi32(YCC_WEIGHT_B);
+    const __m256i seven = _mm256_set1_epi32(7);
+
+    __m256i s0 = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(r, g), weightsRG), _mm256_madd_epi16(_mm256_unpacklo_epi16(b, zero), weightB));
+    __m256i s1 = _mm256_add_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(r, g), weightsRG), _mm256_madd_epi16(_mm256_unpackhi_epi16(b, zero), weightB));
+    __m256i t = _mm256_packs_epi32(_mm256_srli_epi32(s0, 3), _mm256_srli_epi32(s1, 3));
+    __m256i low = _mm256_packs_epi32(_mm256_and_si256(s0, seven), _mm256_and_si256(s1, seven));
+    __m256i q = _mm256_srli_epi16(_mm256_mulhi_epu16(t, _mm256_set1_epi16(static_cast<int16_t>(DIV125_MAGIC))), 6);
+
+    inexact = _mm256_and_si256(_mm256_cmpeq_epi16(_mm256_mullo_epi16(q, _mm256_set1_epi16(125)), t), _mm256_cmpeq_epi16(low, zero));
+    return q;
+}
+
+IMGPROC_TARGET("avx2")
+inline void grayYCCRowAvx2(const RGBTRIPLE* src, uint8_t* dst, int n) noexcept {
+    const ShuffleTables& tables = shuffleTables();
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+    const __m256i zero = _mm256_setzero_si256();
+    int x = 0;
+
+    for (; x + 32 <= n; x += 32) {
+        const uint8_t* p = in + 3 * x;
+        __m256i a = loadLanesAvx2(p, p + 48);
+        __m256i b = loadLanesAvx2(p + 16, p + 64);
+        __m256i c = loadLanesAvx2(p + 32, p + 80);
+        __m256i blue = deinterleaveAvx2(a, b, c, tables.deinterleave[0]);
+        __m256i green = deinterleaveAvx2(a, b, c, tables.deinterleave[1]);
+        __m256i red = deinterleaveAvx2(a, b, c, tables.deinterleave[2]);
+
+        __m256i fixLo, fixHi;
+        __m256i lo = lumaAvx2(_mm256_unpacklo_epi8(red, zero), _mm256_unpacklo_epi8(green, zero), _mm256_unpacklo_epi8(blue, zero), fixLo);
+        __m256i hi = lumaAvx2(_mm256_unpackhi_epi8(red, zero), _mm256_unpackhi_epi8(green, zero), _mm256_unpackhi_epi8(blue, zero), fixHi);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), _mm256_packus_epi16(lo, hi));
+
+        uint32_t fix = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_packs_epi16(fixLo, fixHi)));
+        while (fix) {
+            int i = __builtin_ctz(fix);
+            dst[x + i] = grayYCC(src[x + i]);
+            fix &= fix - 1;
+        }
+    }
+
+    grayYCCRowSsse3(src + x, dst + x, n - x);
+}
+
+IMGPROC_TARGET("avx2")
+inline void grayHSIRowAvx2(const RGBTRIPLE* src, uint8_t* dst, int n) noexcept {
+    const ShuffleTables& tables = shuffleTables();
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i magic = _mm256_set1_epi16(DIV3_MAGIC);
+    int x = 0;
+
+    for (; x + 32 <= n; x += 32) {
+        const uint8_t* p = in + 3 * x;
+        __m256i a = loadLanesAvx2(p, p + 48);
+        __m256i b = loadLanesAvx2(p + 16, p + 64);
+        __m256i c = loadLanesAvx2(p + 32, p + 80);
+        __m256i blue = deinterleaveAvx2(a, b, c, tables.deinterleave[0]);
+        __m256i green = deinterleaveAvx2(a, b, c, tables.deinterleave[1]);
+        __m256i red = deinterleaveAvx2(a, b, c, tables.deinterleave[2]);
+
+        __m256i lo = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(red, zero), _mm256_unpacklo_epi8(green, zero)), _mm256_unpacklo_epi8(blue, zero));
+        __m256i hi = _mm256_add_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(red, zero), _mm256_unpackhi_epi8(green, zero)), _mm256_unpackhi_epi8(blue, zero));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), _mm256_packus_epi16(_mm256_mulhi_epu16(lo, magic), _mm256_mulhi_epu16(hi, magic)));
+    }
+
+    grayHSIRowSsse3(src + x, dst + x, n - x);
+}
+
+IMGPROC_TARGET("avx2")
+inline void channelRowAvx2(const RGBTRIPLE* src, uint8_t* dst, int n, int channel) noexcept {
+    const int8_t (*masks)[16] = shuffleTables().deinterleave[channel];
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+    int x = 0;
+
+    for (; x + 32 <= n; x += 32) {
+        const uint8_t* p = in + 3 * x;
+        __m256i a = loadLanesAvx2(p, p + 48);
+        __m256i b = loadLanesAvx2(p + 16, p + 64);
+        __m256i c = loadLanesAvx2(p + 32, p + 80);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), deinterleaveAvx2(a, b, c, masks));
+    }
+
+    channelRowSsse3(src + x, dst + x, n - x, channel);
+}
+
+IMGPROC_TARGET("avx2")
+inline void splitRowAvx2(const RGBTRIPLE* src, uint8_t* b, uint8_t* g, uint8_t* r, int n) noexcept {
+    const ShuffleTables& tables = shuffleTables();
+    const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+    int x = 0;
+
+    for (; x + 32 <= n; x += 32) {
+        const uint8_t* p = in + 3 * x;
+        __m256i p0 = loadLanesAvx2(p, p + 48);
+        __m256i p1 = loadLanesAvx2(p + 16, p + 64);
+        __m256i p2 = loadLanesAvx2(p + 32, p + 80);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(b + x), deinterleaveAvx2(p0, p1, p2, tables.deinterleave[0]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(g + x), deinterleaveAvx2(p0, p1, p2, tables.deinterleave[1]));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(r + x), deinterleaveAvx2(p0, p1, p2, tables.deinterleave[2]));
+    }
+
+    splitRowSsse3(src + x, b + x, g + x, r + x, n - x);
+}
+
+IMGPROC_TARGET("avx2")
+inline void mergeRowAvx2(const uint8_t* b, const uint8_t* g, const uint8_t* r, RGBTRIPLE* dst, int n) noexcept {
+    const ShuffleTables& tables = shuffleTables();
+    uint8_t* out = reinterpret_cast<uint8_t*>(dst);
+    int x = 0;
+
+    for (; x + 32 <= n; x += 32) {
+        __m256i planes[3] = {
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + x)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(g + x)),
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(r + x)),
+        };
+        for (int chunk = 0; chunk < 3; chunk++) {
+            const int8_t (*masks)[16] = tables.interleave[chunk];
+            __m256i v = _mm256_or_si256(_mm256_or_si256(
+                _mm256_shuffle_epi8(planes[0], maskAvx2(masks[0])),
+                _mm256_shuffle_epi8(planes[1], maskAvx2(masks[1]))),
+                _mm256_shuffle_epi8(planes[2], maskAvx2(masks[2])));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 3 * x + 16 * chunk), _mm256_castsi256_si128(v));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 3 * x + 48 + 16 * chunk), _mm256_extracti128_si256(v, 1));
+        }
+    }
+
+    mergeRowSsse3(b + x, g + x, r + x, dst + x, n - x);
+}
+
+#endif // IMGPROC_X86_SIMD
+
+struct ColorKernels {
+    void (*grayHSI)(const RGBTRIPLE* src, uint8_t* dst, int n);
+    void (*grayYCC)(const RGBTRIPLE* src, uint8_t* dst, int n);
+    void (*channel)(const RGBTRIPLE* src, uint8_t* dst, int n, int channel);
+    void (*merge)(const uint8_t* b, const uint8_t* g, const uint8_t* r, RGBTRIPLE* dst, int n);
+    void (*split)(const RGBTRIPLE* src, uint8_t* b, uint8_t* g, uint8_t* r, int n);
+};
+
+inline const ColorKernels& colorKernels() noexcept {
+    static const ColorKernels kernels = [] {
+        ColorKernels k = { grayHSIRowScalar, grayYCCRowScalar, channelRowScalar, mergeRowScalar, splitRowScalar };
+#ifdef IMGPROC_X86_SIMD
+        const CpuFeatures& cpu = cpuFeatures();
+        if (cpu.avx2) k = { grayHSIRowAvx2, grayYCCRowAvx2, channelRowAvx2, mergeRowAvx2, splitRowAvx2 };
+        else if (cpu.ssse3) k = { grayHSIRowSsse3, grayYCCRowSsse3, channelRowSsse3, mergeRowSsse3, splitRowSsse3 };
+#endif
+        return k;
+    }();
+    return kernels;
+}
+
+} // namespace detail
+
+////////////////////////////////////////
+//     LookupTable implementation     //
+////////////////////////////////////////
+
+namespace detail {
+
+inline void lutRowScalar(const uint8_t* src, uint8_t* dst, int n, const uint8_t* table) noexcept {
+    for (int x = 0; x < n; x++) dst[x] = table[src[x]];
+}
+
+inline void lutRGBRowScalar(RGBTRIPLE* row, int n, const uint8_t* b, const uint8_t* g, const uint8_t* r) noexcept {
+    for (int x = 0; x < n; x++) row[x] = { b[row[x].rgbtBlue], g[row[x].rgbtGreen], r[row[x].rgbtRed] };
+}
+
+#ifdef IMGPROC_X86_SIMD
+
+// pshufb only indexes 16 bytes, so the table is walked as 16 slices. Step k
+// shifts the values down by 16k and adds 0x70 with unsigned saturation:
+// values inside slice k land on 0x70-0x7F and look up their low nibble,
+// everything else lands on 0x80 or above, which pshufb turns into zero.
+IMGPROC_TARGET("ssse3")
+inline __m128i lookupSsse3(__m128i values, const uint8_t* table) noexcept {
+    const __m128i bias = _mm_set1_epi8(0x70);
+    const __m128i step = _mm_set1_epi8(16);
+    __m128i result = _mm_setzero_si128();
+
+    for (int k = 0; k < 16; k++) {
+        __m128i slice = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table + 16 * k));
+        result = _mm_or_si128(result, _mm_shuffle_epi8(slice, _mm_adds_epu8(values, bias)));
+        values = _mm_sub_epi8(values, step);
+    }
+    return result;
+}
+
+IMGPROC_TARGET("ssse3")
+inline void lutRowSsse3(const uint8_t* src, uint8_t* dst, int n, const uint8_t* table) noexcept {
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), lookupSsse3(values, table));
+    }
+    lutRowScalar(src + x, dst + x, n - x, table);
+}
+
+IMGPROC_TARGET("ssse3")
+inline void lutRGBRowSsse3(RGBTRIPLE* row, int n, const uint8_t* b, const uint8_t* g, const uint8_t* r) noexcept {
+    const ShuffleTables& tables = shuffleTables();
+    uint8_t* bytes = reinterpret_cast<uint8_t*>(row);
+    int x = 0;
+
+    for (; x + 16 <= n; x += 16) {
+        __m128i p0 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + 3 * x));
+        __m128i p1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + 3 * x + 16));
+        __m128i p2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + 3 * x + 32));
+        __m128i planes[3] = {
+            lookupSsse3(deinterleaveSsse3(p0, p1, p2, tables.deinterleave[0]), b),
+            lookupSsse3(deinterleaveSsse3(p0, p1, p2, tables.deinterleave[1]), g),
+            lookupSsse3(deinterleaveSsse3(p0, p1, p2, tables.deinterleave[2]), r),
+        };
+        for (int chunk = 0; chunk < 3; chunk++) {
+            const int8_t (*masks)[16] = tables.interleave[chunk];
+            __m128i v = _mm_or_si128(_mm_or_si128(
+                _mm_shuffle_epi8(planes[0], _mm_load_si128(reinterpret_cast<const __m128i*>(masks[0]))),
+                _mm_shuffle_epi8(planes[1], _mm_load_si128(reinterpret_cast<const __m128i*>(masks[1])))),
+                _mm_shuffle_epi8(planes[2], _mm_load_si128(reinterpret_cast<const __m128i*>(masks[2]))));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(bytes + 3 * x + 16 * chunk), v);
+        }
+    }
+
+    lutRGBRowScalar(row + x, n - x, b, g, r);
+}
+
+IMGPROC_TARGET("avx2")
+inline __m256i lookupAvx2(__m256i values, const uint8_t* table) noexcept {
+    const __m256i bias = _mm256_set1_epi8(0x70);
+    const __m256i step = _mm256_set1_epi8(16);
+    __m256i result = _mm256_setzero_si256();
+
+    for (int k = 0; k < 16; k++) {
+        __m256i slice = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table + 16 * k)));
+        result = _mm256_or_si256(result, _mm256_shuffle_epi8(slice, _mm256_adds_epu8(values, bias)));
+        values = _mm256_sub_epi8(values, step);
+    }
+    return result;
+}
+
+IMGPROC_TARGET("avx2")
+inline void lutRowAvx2(const uint8_t* src, uint8_t* dst, int n, const uint8_t* table) noexcept {
+    int x = 0;
+    for (; x + 32 <= n; x += 32) {
+        __m256i values = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x), lookupAvx2(values, table));
+    }
+    lutRowSsse3(src + x, dst + x, n - x, table);
+}
+
+IMGPROC_TARGET("avx2")
+inline void lutRGBRowAvx2(RGBTRIPLE* row, int n, const uint8_t* b, const uint8_t* g, const uint8_t* r) noexcept {
+    const ShuffleTables& tables = shuffleTables();
+    uint8_t* bytes = reinterpret_cast<uint8_t*>(row);
+    int x = 0;
+
+    for (; x + 32 <= n; x += 32) {
+        uint8_t* p = bytes + 3 * x;
+        __m256i p0 = loadLanesAvx2(p, p + 48);
+        __m256i p1 = loadLanesAvx2(p + 16, p + 64);
+        __m256i p2 = loadLanesAvx2(p + 32, p + 80);
+        __m256i planes[3] = {
+            lookupAvx2(deinterleaveAvx2(p0, p1, p2, tables.deinterleave[0]), b),
+            lookupAvx2(deinterleaveAvx2(p0, p1, p2, tables.deinterleave[1]), g),
+            lookupAvx2(deinterleaveAvx2(p0, p1, p2, tables.deinterleave[2]), r),
+        };
+        for (int chunk = 0; chunk < 3; chunk++) {
+            const int8_t (*masks)[16] = tables.interleave[chunk];
+            __m256i v = _mm256_or_si256(_mm256_or_si256(
+                _mm256_shuffle_epi8(planes[0], maskAvx2(masks[0])),
+                _mm256_shuffle_epi8(planes[1], maskAvx2(masks[1]))),
+                _mm256_shuffle_epi8(planes[2], maskAvx2(masks[2])));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p + 16 * chunk), _mm256_castsi256_si128(v));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(p + 48 + 16 * chunk), _mm256_extracti128_si256(v, 1));
+        }
+    }
+
+    lutRGBRowSsse3(row + x, n - x, b, g, r);
+}
+
+// With VBMI, vpermi2b looks up 128 entries at once; bit 7 picks the half
+IMGPROC_TARGET("avx512f,avx512bw,avx512vbmi")
+inline __m512i lookupAvx512(__m512i values, const __m512i* table) noexcept {
+    __m512i low = _mm512_permutex2var_epi8(table[0], values, table[1]);
+    __m512i high = _mm512_permutex2var_epi8(table[2], values, table[3]);
+    return _mm512_mask_blend_epi8(_mm512_movepi8_mask(values), low, high);
+}
+
+IMGPROC_TARGET("avx512f,avx512bw,avx512vbmi")
+inline void lutRowAvx512(const uint8_t* src, uint8_t* dst, int n, const uint8_t* table) noexcept {
+    __m512i slices[4];
+    for (int k = 0; k < 4; k++) slices[k] = _mm512_loadu_si512(table + 64 * k);
+
+    int x = 0;
+    for (; x + 64 <= n; x += 64) {
+        __m512i values = _mm512_loadu_si512(src + x);
+        _mm512_storeu_si512(dst + x, lookupAvx512(values, slices));
+    }
+    lutRowAvx2(src + x, dst + x, n - x, table);
+}
+
+// Interleaved bytes are looked up in all three tables and blended by
+// channel; 64 pixels span three vectors, after which the pattern repeats
+IMGPROC_TARGET("avx512f,avx512bw,avx512vbmi")
+inline void lutRGBRowAvx512(RGBTRIPLE* row, int n, const uint8_t* b, const uint8_t* g, const uint8_t* r) noexcept {
+    __m512i tables[3][4];
+    const uint8_t* sources[3] = { b, g, r };
+    for (int c = 0; c < 3; c++)
+        for (int k = 0; k < 4; k++)
+            tables[c][k] = _mm512_loadu_si512(sources[c] + 64 * k);
+
+    __mmask64 greens[3], reds[3];
+    for (int chunk = 0; chunk < 3; chunk++) {
+        uint64_t green = 0, red = 0;
+        for (int i = 0; i < 64; i++) {
+            int channel = (64 * chunk + i) % 3;
+            if (channel == 1) green |= uint64_t(1) << i;
+            if (channel == 2) red |= uint64_t(1) << i;
+        }
+        greens[chunk] = green;
+        reds[chunk] = red;
+    }
+
+    uint8_t* bytes = reinterpret_cast<uint8_t*>(row);
+    int x = 0;
+    for (; x + 64 <= n; x += 64) {
+        for (int chunk = 0; chunk < 3; chunk++) {
+            uint8_t* p = bytes + 3 * x + 64 * chunk;
+            __m512i values = _mm512_loadu_si512(p);
+            __m512i result = lookupAvx512(values, tables[0]);
+            result = _mm512_mask_blend_epi8(greens[chunk], result, lookupAvx512(values, tables[1]));
+            result = _mm512_mask_blend_epi8(reds[chunk], result, lookupAvx512(values, tables[2]));
+            _mm512_storeu_si512(p, result);
+        }
+    }
+    lutRGBRowAvx2(row + x, n - x, b, g, r);
+}
+
+#endif // IMGPROC_X86_SIMD
+
+struct LutKernels {
+    void (*gray)(const uint8_t* src, uint8_t* dst, int n, const uint8_t* table);
+    void (*rgb)(RGBTRIPLE* row, int n, const uint8_t* b, const uint8_t* g, const uint8_t* r);
+};
+
+inline const LutKernels& lutKernels() noexcept {
+    static const LutKernels kernels = [] {
+        LutKernels k = { lutRowScalar, lutRGBRowScalar };
+#ifdef IMGPROC_X86_SIMD
+        const CpuFeatures& cpu = cpuFeatures();
+        if (cpu.avx512vbmi && cpu.avx512bw) k = { lutRowAvx512, lutRGBRowAvx512 };
+        else if (cpu.avx2) k = { lutRowAvx2, lutRGBRowAvx2 };
+        else if (cpu.ssse3) k = { lutRowSsse3, lutRGBRowSsse3 };
+#endif
+        return k;
+    }();
+    return kernels;
+}
+
+} // namespace detail
+
+inline LookupTable LookupTable::identity() noexcept {
+    LookupTable lut;
+    for (std::size_t i = 0; i < COLOR_TABLE_SIZE; i++) lut.table[i] = static_cast<uint8_t>(i);
+    return lut;
+}
+
+template <typename F>
+LookupTable LookupTable::fromFunction(F fn, Narrowing narrowing) {
+    LookupTable lut;
+    for (std::size_t i = 0; i < COLOR_TABLE_SIZE; i++) {
+        lut.table[i] = detail::narrow(static_cast<double>(fn(static_cast<uint8_t>(i))), narrowing);
+    }
+    return lut;
+}
+
+inline LookupTable LookupTable::fromMatrix(const Matrix& matrix, int row, Narrowing narrowing) {
+    if (matrix.width != static_cast<int>(COLOR_TABLE_SIZE))
+        throw std::runtime_error("A lookup table needs a row of " + std::to_string(COLOR_TABLE_SIZE) + " entries! Got " + std::to_string(matrix.width));
+
+    LookupTable lut;
+    detail::narrowRow(matrix.at(row).data(), lut.table.data(), matrix.width, narrowing);
+    return lut;
+}
+
+inline LookupTable LookupTable::compose(const LookupTable& first, const LookupTable& second) noexcept {
+    LookupTable lut;
+    for (std::size_t i = 0; i < COLOR_TABLE_SIZE; i++) lut.table[i] = second.table[first.table[i]];
+    return lut;
+}
+
+////////////////////////////////////////
+//     Convolution implementation     //
+////////////////////////////////////////
+
+namespace detail {
+
+// Columns per tile: the padded source row, the output row and, for
+// separable kernels, one filtered row per kernel tap stay in L1/L2
+constexpr int CONV_TILE = 512;
+// Row bands are at least this tall, so the kernel's halo rows are amortized
+constexpr int CONV_MIN_BAND = 32;
+
+// Maps a row or column index that may lie outside [0, n) back inside it; -1 means CONSTANT
+inline int borderIndex(int i, int n, BorderMode mode) noexcept {
+    if (i >= 0 && i < n) return i;
+
+    switch (mode) {
+        case BorderMode::REPLICATE:
+            return i < 0 ? 0 : n - 1;
+        case BorderMode::REFLECT: {
+            if (n == 1) return 0;
+            int period = 2 * n - 2;
+            i = (i % period + period) % period;
+            return i < n ? i : period - i;
+        }
+        case BorderMode::WRAP:
+            return (i % n + n) % n;
+        default:
+            return -1;
+    }
+}
+
+// out[x] (+)= sum_j taps[j] * in[x + j], with the taps added in order
+template <typename T>
+inline void filterRowScalar(const T* in, const T* taps, int count, T* out, int n, bool accumulate) noexcept {
+    for (int x = 0; x < n; x++) {
+        T sum = accumulate ? out[x] : 0;
+        for (int j = 0; j < count; j++) sum += taps[j] * in[x + j];
+        out[x] = sum;
+    }
+}
+
+// out[x] = sum_i taps[i] * rows[i][x], with the taps added in order
+template <typename T>
+inline void filterColumnsScalar(const T* const* rows, const T* taps, int count, T* out, int n) noexcept {
+    for (int x = 0; x < n; x++) {
+        T sum = 0;
+        for (int i = 0; i < count; i++) sum += taps[i] * rows[i][x];
+        out[x] = sum;
+    }
+}
+
+#ifdef IMGPROC_X86_SIMD
+
+// The vector loops keep the scalar order of additions in every lane, so
+// results do not depend on the instruction set
+
+IMGPROC_TARGET("avx")
+inline void filterRowAvx(const double* in, const double* taps, int count, double* out, int n, bool accumulate) noexcept {
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256d sum0 = accumulate ? _mm256_loadu_pd(out + x) : _mm256_setzero_pd();
+        __m256d sum1 = accumulate ? _mm256_loadu_pd(out + x + 4) : _mm256_setzero_pd();
+        for (int j = 0; j < count; j++) {
+            __m256d tap = _mm256_broadcast_sd(taps + j);
+            sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(tap, _mm256_loadu_pd(in + x + j)));
+            sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(tap, _mm256_loadu_pd(in + x + j + 4)));
+        }
+        _mm256_storeu_pd(out + x, sum0);
+        _mm256_storeu_pd(out + x + 4, sum1);
+    }
+    filterRowScalar(in + x, taps, count, out + x, n - x, accumulate);
+}
+
+IMGPROC_TARGET("avx")
+inline void filterColumnsAvx(const double* const* rows, const double* taps, int count, double* out, int n) noexcept {
+    int x = 0;
+    for (; x + 8 <= n; x += 8) {
+        __m256d sum0 = _mm256_setzero_pd();
+        __m256d sum1 = _mm256_setzero_pd();
+        for (int i = 0; i < count; i++) {
+            __m256d tap = _mm256_broadcast_sd(taps + i);
+            sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(tap, _mm256_loadu_pd(rows[i] + x)));
+            sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(tap, _mm256_loadu_pd(rows[i] + x + 4)));
+        }
+        _mm256_storeu_pd(out + x, sum0);
+        _mm256_storeu_pd(out + x + 4, sum1);
+    }
+    for (; x < n; x++) {
+        double sum = 0;
+        for (int i = 0; i < count; i++) sum += taps[i] * rows[i][x];
+        out[x] = sum;
+    }
+}
+
+IMGPROC_TARGET("avx2")
+inline void filterRowAvx2(const int32_t* in, const int32_t* taps, int count, int32_t* out, int n, bool accumulate) noexcept {
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m256i sum0 = accumulate ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(out + x)) : _mm256_setzero_si256();
+        __m256i sum1 = accumulate ? _mm256_loadu_si256(reinterpret_cast<const __m256i*>(out + x + 8)) : _mm256_setzero_si256();
+        for (int j = 0; j < count; j++) {
+            __m256i tap = _mm256_set1_epi32(taps[j]);
+            sum0 = _mm256_add_epi32(sum0, _mm256_mullo_epi32(tap, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + x + j))));
+            sum1 = _mm256_add_epi32(sum1, _mm256_mullo_epi32(tap, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + x + j + 8))));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), sum0);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x + 8), sum1);
+    }
+    filterRowScalar(in + x, taps, count, out + x, n - x, accumulate);
+}
+
+IMGPROC_TARGET("avx2")
+inline void filterColumnsAvx2(const int32_t* const* rows, const int32_t* taps, int count, int32_t* out, int n) noexcept {
+    int x = 0;
+    for (; x + 16 <= n; x += 16) {
+        __m256i sum0 = _mm256_setzero_si256();
+        __m256i sum1 = _mm256_setzero_si256();
+        for (int i = 0; i < count; i++) {
+            __m256i tap = _mm256_set1_epi32(taps[i]);
+            sum0 = _mm256_add_epi32(sum0, _mm256_mullo_epi32(tap, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[i] + x))));
+            sum1 = _mm256_add_epi32(sum1, _mm256_mullo_epi32(tap, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[i] + x + 8))));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), sum0);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x + 8), sum1);
+    }
+    for (; x < n; x++) {
+        int32_t sum = 0;
+        for (int i = 0; i < count; i++) sum += taps[i] * rows[i][x];
+        out[x] = sum;
+    }
+}
+
+#endif // IMGPROC_X86_SIMD
+
+template <typename T>
+struct ConvKernels {
+    void (*row)(const T* in, const T* taps, int count, T* out, int n, bool accumulate);
+    void (*columns)(const T* const* rows, const T* taps, int count, T* out, int n);
+};
+
+template <typename T>
+inline const ConvKernels<T>& convKernels() noexcept;
+
+template <>
+inline const ConvKernels<double>& convKernels<double>() noexcept {
+    static const ConvKernels<double> kernels = [] {
+        ConvKernels<double> k = { filterRowScalar<double>, filterColumnsScalar<double> };
+#ifdef IMGPROC_X86_SIMD
+        if (cpuFeatures().avx) k = { filterRowAvx, filterColumnsAvx };
+#endif
+        return k;
+    }();
+    return kernels;
+}
+
+template <>
+inline const ConvKernels<int32_t>& convKernels<int32_t>() noexcept {
+    static const ConvKernels<int32_t> kernels = [] {
+        ConvKernels<int32_t> k = { filterRowScalar<int32_t>, filterColumnsScalar<int32_t> };
+#ifdef IMGPROC_X86_SIMD
+        if (cpuFeatures().avx2) k = { filterRowAvx2, filterColumnsAvx2 };
+#endif
+        return k;
+    }();
+    return kernels;
+}
+
+// Kernel taps in the accumulator type, split into a column and a row
+// factor when the kernel has rank one
+template <typename T>
+struct ConvPlan {
+    int height, width;      // Kernel size
+    int anchorY, anchorX;   // Kernel element that lands on the output pixel
+    bool separable;
+    std::vector<T> taps;    // height * width, row-major
+    std::vector<T> columnTaps, rowTaps;
+    T divisor;              // Separable sums are divided by this, unless it is 1
+};
+
+inline void checkKernel(const Matrix& kernel) {
+    if (kernel.empty()) throw std::runtime_error("Convolution kernel must not be empty!");
+}
+
+// Rank-one test: every row must be a multiple of the row holding the
+// largest entry, to within rounding. The factors are that row and the
+// column through the largest entry, unscaled, and the pivot is divided out
+// of the finished sums. Scaling the row instead (6/36 in the 5x5 binomial)
+// would make exact kernels inexact and round 127 down to 126.99999999999999.
+inline ConvPlan<double> planConvolution(const Matrix& kernel) {
+    checkKernel(kernel);
+
+    ConvPlan<double> plan;
+    plan.height = kernel.height;
+    plan.width = kernel.width;
+    plan.anchorY = kernel.height / 2;
+    plan.anchorX = kernel.width / 2;
+    plan.taps.assign(kernel.data(), kernel.data() + kernel.height * kernel.width);
+    plan.divisor = 1;
+
+    int py = 0, px = 0;
+    double largest = 0;
+    for (int y = 0; y < kernel.height; y++)
+        for (int x = 0; x < kernel.width; x++)
+            if (std::abs(kernel[y][x]) > largest) largest = std::abs(kernel[y][x]), py = y, px = x;
+
+    plan.separable = false;
+    if (largest == 0 || kernel.height == 1 || kernel.width == 1) return plan;
+
+    double pivot = kernel[py][px];
+    std::vector<double> column(kernel.height), row(kernel.width);
+    for (int y = 0; y < kernel.height; y++) column[y] = kernel[y][px];
+    for (int x = 0; x < kernel.width; x++) row[x] = kernel[py][x];
+
+    for (int y = 0; y < kernel.height; y++)
+        for (int x = 0; x < kernel.width; x++)
+            if (std::abs(column[y] * row[x] / pivot - kernel[y][x]) > 1e-12 * largest) return plan;
+
+    // A row that divides exactly, as when the pivot is a power of two, saves the final division
+    bool exact = true;
+    for (int x = 0; x < kernel.width && exact; x++) exact = std::fma(row[x] / pivot, pivot, -row[x]) == 0;
+    if (exact) {
+        for (int x = 0; x < kernel.width; x++) row[x] /= pivot;
+        pivot = 1;
+    }
+
+    plan.separable = true;
+    plan.columnTaps = column;
+    plan.rowTaps = row;
+    plan.divisor = pivot;
+    return plan;
+}
+
+// Integer plan for byte images: the kernel must be integers divided by
+// 2^shift, small enough that 255 * sum|taps| fits in an int32. Integer
+// sums are exact, so the result equals the double path bit for bit.
+inline bool planIntegerConvolution(const Matrix& kernel, ConvPlan<int32_t>& plan, int& shift) {
+    checkKernel(kernel);
+
+    for (shift = 0; shift <= 8; shift++) {
+        double scale = static_cast<double>(1 << shift);
+        double total = 0;
+        bool integral = true;
+        for (int i = 0; i < kernel.height * kernel.width && integral; i++) {
+            double tap = kernel.data()[i] * scale;
+            integral = tap == std::floor(tap) && std::abs(tap) <= 32767;
+            total += std::abs(tap);
+        }
+        if (!integral) continue;
+        if (total * 255 > 2147483647.0) return false;
+
+        plan.height = kernel.height;
+        plan.width = kernel.width;
+        plan.anchorY = kernel.height / 2;
+        plan.anchorX = kernel.width / 2;
+        plan.taps.resize(kernel.height * kernel.width);
+        for (int i = 0; i < kernel.height * kernel.width; i++) plan.taps[i] = static_cast<int32_t>(kernel.data()[i] * scale);
+        plan.divisor = 1;
+
+        // Separable in integers: each row is a whole multiple of the reduced first nonzero row
+        plan.separable = false;
+        int py = -1;
+        for (int y = 0; y < kernel.height && py < 0; y++)
+            for (int x = 0; x < kernel.width; x++)
+                if (plan.taps[y * kernel.width + x] != 0) { py = y; break; }
+        if (py < 0 || kernel.height == 1 || kernel.width == 1) return true;
+
+        std::vector<int32_t> row(plan.taps.begin() + py * kernel.width, plan.taps.begin() + (py + 1) * kernel.width);
+        int32_t divisor = 0;
+        for (int32_t tap : row) {
+            int32_t a = std::abs(tap), b = divisor;
+            while (b) { int32_t t = a % b; a = b; b = t; }
+            divisor = a;
+        }
+        int px = 0;
+        for (int x = 0; x < kernel.width; x++) {
+            row[x] /= divisor;
+            if (row[x] != 0 && row[px] == 0) px = x;
+        }
+
+        std::vector<int32_t> column(kernel.height);
+        for (int y = 0; y < kernel.height; y++) {
+            int32_t tap = plan.taps[y * kernel.width + px];
+            if (tap % row[px] != 0) return true;
+            column[y] = tap / row[px];
+            for (int x = 0; x < kernel.width; x++)
+                if (column[y] * row[x] != plan.taps[y * kernel.width + x]) return true;
+        }
+
+        plan.separable = true;
+        plan.columnTaps = column;
+        plan.rowTaps = row;
+        return true;
+    }
+    return false;
+}
+
+// Integer sums divided by 2^shift, narrowed to bytes. Negative sums get
+// 2^shift - 1 added before the shift, so the quotient truncates toward
+// zero like the double-to-int cast, without a division per pixel.
+inline void narrowScaledRow(const int32_t* values, uint8_t* dst, int n, int shift, Narrowing narrowing) noexcept {
+    int32_t bias = (1 << shift) - 1;
+    if (narrowing == Narrowing::SATURATE) {
+        for (int i = 0; i < n; i++) {
+            int32_t v = (values[i] + ((values[i] >> 31) & bias)) >> shift;
+            dst[i] = static_cast<uint8_t>(v < 0 ? 0 : (v > 255 ? 255 : v));
+        }
+    } else {
+        for (int i = 0; i < n; i++) dst[i] = static_cast<uint8_t>((values[i] + ((values[i] >> 31) & bias)) >> shift);
+    }
+}
+
+// The pivot of a separable plan; exact whenever the kernel is
+template <typename T>
+inline void divideRow(T* values, int n, T divisor) noexcept {
+    if (divisor == 1) return;
+    for (int i = 0; i < n; i++) values[i] /= divisor;
+}
+
+// Source columns [x0 - anchorX, x0 - anchorX + count) of row `y`, widened,
+// with out-of-range rows and columns resolved by the border mode
+template <typename S, typename T>
+inline void padRow(GridView<const S> src, int y, int x0, int count, BorderMode mode, T value, T* out) noexcept {
+    int sy = borderIndex(y, src.height, mode);
+    if (sy < 0) {
+        std::fill(out, out + count, value);
+        return;
+    }
+
+    const S* row = src[sy].data();
+    for (int i = 0; i < count; i++) {
+        int x = x0 + i;
+        if (x >= 0 && x < src.width) {
+            // Copy the whole in-range run at once
+            int run = std::min(count - i, src.width - x);
+            for (int j = 0; j < run; j++) out[i + j] = static_cast<T>(row[x + j]);
+            i += run - 1;
+        } else {
+            int sx = borderIndex(x, src.width, mode);
+            out[i] = sx < 0 ? value : static_cast<T>(row[sx]);
+        }
+    }
+}
+
+// The engine: output rows are split into bands across the thread pool, each
+// band is walked in column tiles, and store(y, x, values, n) receives every
+// finished run of output values
+template <typename S, typename T, typename Store>
+void convolve(GridView<const S> src, const ConvPlan<T>& plan, BorderMode mode, T value, Store store) {
+    const ConvKernels<T>& kernels = convKernels<T>();
+    int width = src.width, height = src.height;
+    int grain = std::max(CONV_MIN_BAND, static_cast<int>(PARALLEL_GRAIN_ELEMENTS / std::max(width, 1)));
+    std::size_t work = static_cast<std::size_t>(height) * width * plan.height * plan.width;
+
+    auto band = [&](int begin, int end) {
+        int padded = CONV_TILE + plan.width - 1;
+        std::vector<T> line(padded), out(CONV_TILE);
+        // Separable kernels keep the last plan.height row-filtered lines in a ring
+        std::vector<T> ring(plan.separable ? static_cast<std::size_t>(plan.height) * CONV_TILE : 0);
+        std::vector<const T*> rows(plan.height);
+
+        for (int x0 = 0; x0 < width; x0 += CONV_TILE) {
+            int n = std::min(CONV_TILE, width - x0);
+            int left = x0 - plan.anchorX;
+
+            if (plan.separable) {
+                auto slot = [&](int sy) { return ring.data() + static_cast<std::size_t>((sy % plan.height + plan.height) % plan.height) * CONV_TILE; };
+                int first = begin - plan.anchorY;
+                for (int sy = first; sy < first + plan.height - 1; sy++) {
+                    padRow(src, sy, left, n + plan.width - 1, mode, value, line.data());
+                    kernels.row(line.data(), plan.rowTaps.data(), plan.width, slot(sy), n, false);
+                }
+                for (int y = begin; y < end; y++) {
+                    int newest = y - plan.anchorY + plan.height - 1;
+                    padRow(src, newest, left, n + plan.width - 1, mode, value, line.data());
+                    kernels.row(line.data(), plan.rowTaps.data(), plan.width, slot(newest), n, false);
+                    for (int i = 0; i < plan.height; i++) rows[i] = slot(y - plan.anchorY + i);
+                    kernels.columns(rows.data(), plan.columnTaps.data(), plan.height, out.data(), n);
+                    divideRow(out.data(), n, plan.divisor);
+                    store(y, x0, out.data(), n);
+                }
+            } else {
+                // Taps are added row by row, as submatrix(...).dot(kernel) adds them
+                for (int y = begin; y < end; y++) {
+                    for (int i = 0; i < plan.height; i++) {
+                        padRow(src, y - plan.anchorY + i, left, n + plan.width - 1, mode, value, line.data());
+                        kernels.row(line.data(), plan.taps.data() + i * plan.width, plan.width, out.data(), n, i > 0);
+                    }
+                    store(y, x0, out.data(), n);
+                }
+            }
+        }
+    };
+
+    if (height <= 0 || width <= 0) return;
+    if (work < PARALLEL_MIN_ELEMENTS) band(0, height);
+    else parallelFor(height, grain, band);
+}
+
+// Filters for compile-time kernel sizes: out[x] = sum of taps[i * W + j] *
+// rows[i][x + j] over the H x W window, added in the order of the runtime
+// filters. The loop bounds are constants, so the window is unrolled and the
+// taps stay in registers. H = 1 is the row filter and W = 1 the column filter.
+template <typename T>
+using FixedFilterKernel = void (*)(const T* const* rows, const T* taps, T* out, int x, int n);
+
+template <int H, int W, typename T>
+inline void filterFixedScalar(const T* const* rows, const T* taps, T* out, int x, int n) noexcept {
+    for (; x < n; x++) {
+        T sum = 0;
+        for (int i = 0; i < H; i++)
+            for (int j = 0; j < W; j++) sum += taps[i * W + j] * rows[i][x + j];
+        out[x] = sum;
+    }
+}
+
+#ifdef IMGPROC_X86_SIMD
+
+template <int H, int W>
+IMGPROC_TARGET("avx")
+inline void filterFixedAvx(const double* const* rows, const double* taps, double* out, int x, int n) noexcept {
+    for (; x + 8 <= n; x += 8) {
+        __m256d sum0 = _mm256_setzero_pd();
+        __m256d sum1 = _mm256_setzero_pd();
+        for (int i = 0; i < H; i++) {
+            for (int j = 0; j < W; j++) {
+                __m256d tap = _mm256_broadcast_sd(taps + i * W + j);
+                sum0 = _mm256_add_pd(sum0, _mm256_mul_pd(tap, _mm256_loadu_pd(rows[i] + x + j)));
+                sum1 = _mm256_add_pd(sum1, _mm256_mul_pd(tap, _mm256_loadu_pd(rows[i] + x + j + 4)));
+            }
+        }
+        _mm256_storeu_pd(out + x, sum0);
+        _mm256_storeu_pd(out + x + 4, sum1);
+    }
+    filterFixedScalar<H, W, double>(rows, taps, out, x, n);
+}
+
+template <int H, int W>
+IMGPROC_TARGET("avx2")
+inline void filterFixedAvx2(const int32_t* const* rows, const int32_t* taps, int32_t* out, int x, int n) noexcept {
+    for (; x + 16 <= n; x += 16) {
+        __m256i sum0 = _mm256_setzero_si256();
+        __m256i sum1 = _mm256_setzero_si256();
+        for (int i = 0; i < H; i++) {
+            for (int j = 0; j < W; j++) {
+                __m256i tap = _mm256_set1_epi32(taps[i * W + j]);
+                sum0 = _mm256_add_epi32(sum0, _mm256_mullo_epi32(tap, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[i] + x + j))));
+                sum1 = _mm256_add_epi32(sum1, _mm256_mullo_epi32(tap, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(rows[i] + x + j + 8))));
+            }
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), sum0);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x + 8), sum1);
+    }
+    filterFixedScalar<H, W, int32_t>(rows, taps, out, x, n);
+}
+
+#endif // IMGPROC_X86_SIMD
+
+template <int H, int W, typename T> struct FixedFilter;
+
+template <int H, int W>
+struct FixedFilter<H, W, double> {
+    static FixedFilterKernel<double> select() noexcept {
+#ifdef IMGPROC_X86_SIMD
+        if (cpuFeatures().avx) return filterFixedAvx<H, W>;
+#endif
+        return filterFixedScalar<H, W, double>;
+    }
+};
+
+template <int H, int W>
+struct FixedFilter<H, W, int32_t> {
+    static FixedFilterKernel<int32_t> select() noexcept {
+#ifdef IMGPROC_X86_SIMD
+        if (cpuFeatures().avx2) return filterFixedAvx2<H, W>;
+#endif
+        return filterFixedScalar<H, W, int32_t>;
+    }
+};
+
+// The engine for compile-time kernel sizes: the plans, bands and column tiles
+// of convolve, so the results are the same, but the filters are unrolled.
+// The last H padded (direct) or row-filtered (separable) lines stay in a
+// ring, so each source row is widened once per tile.
+template <int H, int W, typename S, typename T, typename Store>
+void convolveFixed(GridView<const S> src, const ConvPlan<T>& plan, BorderMode mode, T value, Store store) {
+    FixedFilterKernel<T> window = FixedFilter<H, W, T>::select();
+    FixedFilterKernel<T> row = FixedFilter<1, W, T>::select();
+    FixedFilterKernel<T> column = FixedFilter<H, 1, T>::select();
+    int width = src.width, height = src.height;
+    int grain = std::max(CONV_MIN_BAND, static_cast<int>(PARALLEL_GRAIN_ELEMENTS / std::max(width, 1)));
+    std::size_t work = static_cast<std::size_t>(height) * width * H * W;
+    int anchorY = H / 2, anchorX = W / 2;
+
+    auto band = [&](int begin, int end) {
+        int padded = CONV_TILE + W - 1;
+        std::vector<T> line(padded), out(CONV_TILE);
+        std::vector<T> ring(static_cast<std::size_t>(H) * padded);
+        const T* source[1] = { line.data() };
+        const T* rows[H];
+        auto slot = [&](int sy) { return ring.data() + static_cast<std::size_t>((sy % H + H) % H) * padded; };
+        auto load = [&](int sy, int left, int n) {
+            if (plan.separable) {
+                padRow(src, sy, left, n + W - 1, mode, value, line.data());
+                row(source, plan.rowTaps.data(), slot(sy), 0, n);
+            } else {
+                padRow(src, sy, left, n + W - 1, mode, value, slot(sy));
+            }
+        };
+
+        for (int x0 = 0; x0 < width; x0 += CONV_TILE) {
+            int n = std::min(CONV_TILE, width - x0);
+            int left = x0 - anchorX;
+            int first = begin - anchorY;
+            for (int sy = first; sy < first + H - 1; sy++) load(sy, left, n);
+
+            for (int y = begin; y < end; y++) {
+                load(y - anchorY + H - 1, left, n);
+                for (int i = 0; i < H; i++) rows[i] = slot(y - anchorY + i);
+                if (plan.separable) {
+                    column(rows, plan.columnTaps.data(), out.data(), 0, n);
+                    divideRow(out.data(), n, plan.divisor);
+                } else {
+                    window(rows, plan.taps.data(), out.data(), 0, n);
+                }
+                store(y, x0, out.data(), n);
+            }
+        }
+    };
+
+    if (height <= 0 || width <= 0) return;
+    if (work < PARALLEL_MIN_ELEMENTS) band(0, height);
+    else parallelFor(height, grain, band);
+}
+
+} // namespace detail
+
+// Correlates like submatrix(y - kh / 2, x - kw / 2, kh, kw).dot(kernel) at every pixel
+template <typename Scalar>
+Matrix MatrixT<Scalar>::convolve(const Matrix& kernel, BorderMode border, double value) const {
+    static_assert(std::is_same<Scalar, double>::value, "convolve needs a double Matrix; convert with convertTo<double>");
+    IMGPROC_PROFILE_SCOPE("Matrix::convolve", 2 * sizeof(double) * height * width);
+    detail::ConvPlan<double> plan = detail::planConvolution(kernel);
+    Matrix result(height, width, UNINITIALIZED);
+
+    detail::convolve<double, double>(this->view(), plan, border, value, [&](int y, int x, const double* values, int n) {
+        std::memcpy(result[y].data() + x, values, n * sizeof(double));
+    });
+
+    return result;
+}
+
+// Equals fromMatrix(toMatrix().convolve(kernel, border, value), narrowing)
+// bit for bit. Kernels of integers over 2^shift take exact integer sums; the
+// double path gives the same exact sums for them, as the separable factors
+// keep the kernel's taps unrounded. Other kernels run the same double path
+// as Matrix::convolve. tests/convolution_test.cpp checks both.
+inline GrayImage GrayImage::convolve(const Matrix& kernel, BorderMode border, uint8_t value, Narrowing narrowing) const {
+    IMGPROC_PROFILE_SCOPE("GrayImage::convolve", 2 * static_cast<uint64_t>(height) * width);
+    GrayImage result(height, width, UNINITIALIZED);
+
+    detail::ConvPlan<int32_t> integerPlan;
+    int shift;
+    if (detail::planIntegerConvolution(kernel, integerPlan, shift)) {
+        detail::convolve<uint8_t, int32_t>(view(), integerPlan, border, static_cast<int32_t>(value), [&](int y, int x, const int32_t* values, int n) {
+            detail::narrowScaledRow(values, result[y].data() + x, n, shift, narrowing);
+        });
+        return result;
+    }
+
+    detail::ConvPlan<double> plan = detail::planConvolution(kernel);
+    detail::convolve<uint8_t, double>(view(), plan, border, static_cast<double>(value), [&](int y, int x, const double* values, int n) {
+        detail::narrowRow(values, result[y].data() + x, n, narrowing);
+    });
+
+    return result;
+}
+
+// Same result as convolve(kernel.toMatrix(), border, value), with the kernel
+// loops unrolled for its size
+template <typename Scalar>
+template <int H, int W, typename K>
+Matrix MatrixT<Scalar>::convolve(const FixedMatrix<H, W, K>& kernel, BorderMode border, double value) const {
+    static_assert(std::is_same<Scalar, double>::value, "convolve needs a double Matrix; convert with convertTo<double>");
+    IMGPROC_PROFILE_SCOPE("Matrix::convolve", 2 * sizeof(double) * height * width);
+    detail::ConvPlan<double> plan = detail::planConvolution(kernel.toMatrix());
+    Matrix result(height, width, UNINITIALIZED);
+
+    detail::convolveFixed<H, W, double, double>(this->view(), plan, border, value, [&](int y, int x, const double* values, int n) {
+        std::memcpy(result[y].data() + x, values, n * sizeof(double));
+    });
+
+    return result;
+}
+
+// Same result as convolve(kernel.toMatrix(), border, value, narrowing)
+template <int H, int W, typename K>
+GrayImage GrayImage::convolve(const FixedMatrix<H, W, K>& kernel, BorderMode border, uint8_t value, Narrowing narrowing) const {
+    IMGPROC_PROFILE_SCOPE("GrayImage::convolve", 2 * static_cast<uint64_t>(height) * width);
+    GrayImage result(height, width, UNINITIALIZED);
+    Matrix taps = kernel.toMatrix();
+
+    detail::ConvPlan<int32_t> integerPlan;
+    int shift;
+    if (detail::planIntegerConvolution(taps, integerPlan, shift)) {
+        detail::convolveFixed<H, W, uint8_t, int32_t>(view(), integerPlan, border, static_cast<int32_t>(value), [&](int y, int x, const int32_t* values, int n) {
+            detail::narrowScaledRow(values, result[y].data() + x, n, shift, narrowing);
+        });
+        return result;
+    }
+
+    detail::ConvPlan<double> plan = detail::planConvolution(taps);
+    detail::convolveFixed<H, W, uint8_t, double>(view(), plan, border, static_cast<double>(value), [&](int y, int x, const double* values, int n) {
+        detail::narrowRow(values, result[y].data() + x, n, narrowing);
+    });
+
+    return result;
+}
+
+////////////////////////////////////////
+//         FFT implementation         //
+////////////////////////////////////////
+
+namespace detail {
+
+typedef std::complex<double> Complex;
+
+// std::complex multiplication goes through a NaN-recovering library call
+inline Complex multiply(const Complex& a, const Complex& b) noexcept {
+    return Complex(a.real() * b.real() - a.imag() * b.imag(), a.real() * b.imag() + a.imag() * b.real());
+}
+
+// Above this many multiply-adds per output pixel, fftConvolve switches from
+// direct to FFT convolution; measured with bench/fft_bench.cpp
+constexpr int FFT_CROSSOVER_TAPS = 512;
+
+// Twiddles and radix factorization for one transform length
+struct FFTPlan {
+    int size;
+    int largestFactor;
+    std::vector<int> factors;
+    std::vector<Complex> twiddles;  // exp(-2 pi i k / size)
+};
+
+// Plans are built once per length and shared by every thread
+inline std::shared_ptr<const FFTPlan> fftPlan(int size) {
+    static std::mutex mutex;
+    static std::map<int, std::shared_ptr<const FFTPlan>> cache;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    std::shared_ptr<const FFTPlan>& cached = cache[size];
+    if (cached) return cached;
+
+    std::shared_ptr<FFTPlan> plan = std::make_shared<FFTPlan>();
+    plan->size = size;
+    int rest = size;
+    while (rest % 4 == 0) plan->factors.push_back(4), rest /= 4;
+    for (int p = 2; rest > 1; p++) {
+        while (rest % p == 0) plan->factors.push_back(p), rest /= p;
+    }
+    plan->largestFactor = plan->factors.empty() ? 1 : *std::max_element(plan->factors.begin(), plan->factors.end());
+
+    const double pi = 3.14159265358979323846;
+    plan->twiddles.resize(size);
+    for (int k = 0; k < size; k++) plan->twiddles[k] = std::polar(1.0, -2 * pi * k / size);
+
+    cached = plan;
+    return cached;
+}
+
+// Smallest length >= n whose only prime factors are 2, 3 and 5
+inline int fftSize(int n, bool even) noexcept {
+    for (int size = std::max(n, 1);; size++) {
+        if (even && size % 2) continue;
+        int rest = size;
+        for (int p : { 2, 3, 5 }) while (rest % p == 0) rest /= p;
+        if (rest == 1) return size;
+    }
+}
+
+// Mixed-radix decimation in time: `n` inputs `stride` apart become `n`
+// contiguous outputs. Twiddles of this sub-transform are every
+// `twiddleStride`-th entry of the full-length table.
+inline void fftRecursive(const Complex* in, Complex* out, int n, int stride, const int* factor,
+                         const Complex* twiddles, int twiddleStride, Complex* temp) noexcept {
+    int p = *factor, m = n / p;
+    for (int r = 0; r < p; r++) {
+        if (m == 1) out[r] = in[r * stride];
+        else fftRecursive(in + r * stride, out + r * m, m, stride * p, factor + 1, twiddles, twiddleStride * p, temp);
+    }
+
+    if (p == 2) {
+        for (int k = 0; k < m; k++) {
+            Complex t = multiply(twiddles[k * twiddleStride], out[m + k]);
+            out[m + k] = out[k] - t;
+            out[k] += t;
+        }
+    } else if (p == 4) {
+        for (int k = 0; k < m; k++) {
+            Complex a0 = out[k];
+            Complex a1 = multiply(twiddles[k * twiddleStride], out[m + k]);
+            Complex a2 = multiply(twiddles[2 * k * twiddleStride], out[2 * m + k]);
+            Complex a3 = multiply(twiddles[3 * k * twiddleStride], out[3 * m + k]);
+            Complex b0 = a0 + a2, b1 = a0 - a2, b2 = a1 + a3;
+            Complex b3 = Complex((a1 - a3).imag(), -(a1 - a3).real());     // Times -i
+            out[k] = b0 + b2;
+            out[m + k] = b1 + b3;
+            out[2 * m + k] = b0 - b2;
+            out[3 * m + k] = b1 - b3;
+        }
+    } else if (p == 3) {
+        const double sin60 = 0.86602540378443864676;
+        for (int k = 0; k < m; k++) {
+            Complex a0 = out[k];
+            Complex a1 = multiply(twiddles[k * twiddleStride], out[m + k]);
+            Complex a2 = multiply(twiddles[2 * k * twiddleStride], out[2 * m + k]);
+            Complex sum = a1 + a2, difference = a1 - a2;
+            Complex t = a0 - 0.5 * sum;
+            Complex u(sin60 * difference.imag(), -sin60 * difference.real());    // Times -i sin(60)
+            out[k] = a0 + sum;
+            out[m + k] = t + u;
+            out[2 * m + k] = t - u;
+        }
+    } else if (p == 5) {
+        const double cos72 = 0.30901699437494742410, cos144 = -0.80901699437494742410;
+        const double sin72 = 0.95105651629515357212, sin144 = 0.58778525229247312917;
+        for (int k = 0; k < m; k++) {
+            Complex a0 = out[k];
+            Complex a1 = multiply(twiddles[k * twiddleStride], out[m + k]);
+            Complex a2 = multiply(twiddles[2 * k * twiddleStride], out[2 * m + k]);
+            Complex a3 = multiply(twiddles[3 * k * twiddleStride], out[3 * m + k]);
+            Complex a4 = multiply(twiddles[4 * k * twiddleStride], out[4 * m + k]);
+            Complex s14 = a1 + a4, d14 = a1 - a4, s23 = a2 + a3, d23 = a2 - a3;
+            Complex t1 = a0 + cos72 * s14 + cos144 * s23;
+            Complex t2 = a0 + cos144 * s14 + cos72 * s23;
+            Complex v1 = sin72 * d14 + sin144 * d23;
+            Complex v2 = sin144 * d14 - sin72 * d23;
+            Complex u1(v1.imag(), -v1.real()), u2(v2.imag(), -v2.real());      // Times -i
+            out[k] = a0 + s14 + s23;
+            out[m + k] = t1 + u1;
+            out[2 * m + k] = t2 + u2;
+            out[3 * m + k] = t2 - u2;
+            out[4 * m + k] = t1 - u1;
+        }
+    } else {
+        for (int k = 0; k < m; k++) {
+            for (int r = 0; r < p; r++) temp[r] = multiply(twiddles[r * k * twiddleStride], out[r * m + k]);
+            for (int q = 0; q < p; q++) {
+                Complex sum = temp[0];
+                for (int r = 1; r < p; r++) sum += multiply(temp[r], twiddles[(r * q % p) * m * twiddleStride]);
+                out[q * m + k] = sum;
+            }
+        }
+    }
+}
+
+// In-place, unnormalized transform; `work` holds size + largestFactor values
+inline void fft(const FFTPlan& plan, Complex* data, Complex* work, bool inverse) noexcept {
+    // The inverse is the forward transform of the conjugate, conjugated
+    if (inverse) for (int i = 0; i < plan.size; i++) data[i] = std::conj(data[i]);
+    if (!plan.factors.empty()) {
+        fftRecursive(data, work, plan.size, 1, plan.factors.data(), plan.twiddles.data(), 1, work + plan.size);
+        std::copy(work, work + plan.size, data);
+    }
+    if (inverse) for (int i = 0; i < plan.size; i++) data[i] = std::conj(data[i]);
+}
+
+// Transforms of real rows, producing or consuming the size / 2 + 1
+// non-redundant bins. Even sizes run as a half-length complex transform.
+struct RealFFT {
+    int size;
+    std::shared_ptr<const FFTPlan> full, half;
+    std::vector<Complex> buffer, work;
+
+    explicit RealFFT(int size) : size(size), full(fftPlan(size)) {
+        const FFTPlan& plan = size % 2 == 0 ? *(half = fftPlan(size / 2)) : *full;
+        buffer.resize(plan.size);
+        work.resize(plan.size + plan.largestFactor);
+    }
+
+    void forward(const double* in, Complex* out) {
+        if (size % 2) {
+            for (int i = 0; i < size; i++) buffer[i] = in[i];
+            fft(*full, buffer.data(), work.data(), false);
+            std::copy(buffer.begin(), buffer.begin() + size / 2 + 1, out);
+            return;
+        }
+
+        // Pack even samples into the real part and odd ones into the imaginary part
+        int m = size / 2;
+        for (int i = 0; i < m; i++) buffer[i] = Complex(in[2 * i], in[2 * i + 1]);
+        fft(*half, buffer.data(), work.data(), false);
+        for (int k = 0; k <= m; k++) {
+            Complex z = buffer[k % m], zc = std::conj(buffer[(m - k) % m]);
+            Complex even = (z + zc) * 0.5;
+            Complex difference = z - zc;
+            Complex odd(0.5 * difference.imag(), -0.5 * difference.real());     // Divided by 2i
+            out[k] = even + multiply(full->twiddles[k], odd);
+        }
+    }
+
+    // Unnormalized: the result is `size` times the original row
+    void inverse(const Complex* in, double* out) {
+        if (size % 2) {
+            buffer[0] = in[0];
+            for (int k = 1; k <= size / 2; k++) {
+                buffer[k] = in[k];
+                buffer[size - k] = std::conj(in[k]);
+            }
+            fft(*full, buffer.data(), work.data(), true);
+            for (int i = 0; i < size; i++) out[i] = buffer[i].real();
+            return;
+        }
+
+        int m = size / 2;
+        for (int k = 0; k < m; k++) {
+            Complex x = in[k], xc = std::conj(in[m - k]);
+            Complex even = (x + xc) * 0.5;
+            Complex odd = multiply(x - xc, std::conj(full->twiddles[k])) * 0.5;
+            buffer[k] = even + Complex(-odd.imag(), odd.real());    // even + i * odd
+        }
+        fft(*half, buffer.data(), work.data(), true);
+        for (int i = 0; i < m; i++) {
+            out[2 * i] = 2 * buffer[i].real();
+            out[2 * i + 1] = 2 * buffer[i].imag();
+        }
+    }
+};
+
+// Transforms every column of a spectrum in place
+inline void fftColumns(Spectrum& spectrum, bool inverse) {
+    if (spectrum.empty()) return;
+    std::shared_ptr<const FFTPlan> plan = fftPlan(spectrum.height);
+
+    parallelRows(spectrum.width, spectrum.height, [&](int begin, int end) {
+        std::vector<Complex> column(spectrum.height), work(spectrum.height + plan->largestFactor);
+        for (int x = begin; x < end; x++) {
+            for (int y = 0; y < spectrum.height; y++) column[y] = spectrum[y][x];
+            fft(*plan, column.data(), work.data(), inverse);
+            for (int y = 0; y < spectrum.height; y++) spectrum[y][x] = column[y];
+        }
+    });
+}
+
+// Linear correlation through the FFT, with the same borders and result as Matrix::convolve
+inline Matrix convolveFFT(const Matrix& image, const Matrix& kernel, BorderMode border, double value) {
+    checkKernel(kernel);
+    int anchorY = kernel.height / 2, anchorX = kernel.width / 2;
+    int paddedHeight = image.height + kernel.height - 1, paddedWidth = image.width + kernel.width - 1;
+    int height = fftSize(paddedHeight, false), width = fftSize(paddedWidth, true);
+
+    // Circular correlation on a grid at least as large as the padded image never wraps into the result
+    Matrix padded(height, width);
+    parallelRows(paddedHeight, paddedWidth, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            padRow(image.view(), y - anchorY, -anchorX, paddedWidth, border, value, padded[y].data());
+        }
+    });
+
+    // Correlating with k is convolving with k mirrored through the origin
+    Matrix mirrored(height, width);
+    for (int i = 0; i < kernel.height; i++)
+        for (int j = 0; j < kernel.width; j++)
+            mirrored[(height - i) % height][(width - j) % width] = kernel[i][j];
+
+    Spectrum spectrum = Spectrum::fromMatrix(padded);
+    spectrum *= Spectrum::fromMatrix(mirrored);
+    Matrix full = spectrum.toMatrix();
+
+    Matrix result(image.height, image.width);
+    for (int y = 0; y < image.height; y++) {
+        std::memcpy(result[y].data(), full[y].data(), image.width * sizeof(double));
+    }
+    return result;
+}
+
+} // namespace detail
+
+inline Spectrum::Spectrum(int height, int realWidth) : Grid<std::complex<double>>(height, realWidth / 2 + 1), realWidth(realWidth) {}
+
+inline Spectrum Spectrum::fromMatrix(const Matrix& matrix) {
+    if (matrix.empty()) return Spectrum();
+    Spectrum spectrum(matrix.height, matrix.width);
+
+    detail::parallelRows(matrix.height, matrix.width, [&](int begin, int end) {
+        detail::RealFFT transform(matrix.width);
+        for (int y = begin; y < end; y++) {
+            transform.forward(matrix[y].data(), spectrum[y].data());
+        }
+    });
+    detail::fftColumns(spectrum, false);
+
+    return spectrum;
+}
+
+inline Matrix Spectrum::toMatrix() const {
+    if (empty()) return Matrix(0, 0);
+    Spectrum columns = *this;
+    detail::fftColumns(columns, true);
+
+    Matrix matrix(height, realWidth);
+    double scale = 1.0 / (static_cast<double>(height) * realWidth);
+    detail::parallelRows(height, realWidth, [&](int begin, int end) {
+        detail::RealFFT transform(realWidth);
+        for (int y = begin; y < end; y++) {
+            double* row = matrix[y].data();
+            transform.inverse(columns[y].data(), row);
+            for (int x = 0; x < realWidth; x++) row[x] *= scale;
+        }
+    });
+
+    return matrix;
+}
+
+inline Spectrum& Spectrum::operator*=(const Spectrum& other) {
+    if (height != other.height || realWidth != other.realWidth)
+        throw std::runtime_error("Cannot multiply spectra of different sizes! Got " + std::to_string(realWidth) + "x" + std::to_string(height) + " and " + std::to_string(other.realWidth) + "x" + std::to_string(other.height));
+
+    detail::parallelRows(height, width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            std::complex<double>* a = (*this)[y].data();
+            const std::complex<double>* b = other[y].data();
+            for (int x = 0; x < width; x++) a[x] = detail::multiply(a[x], b[x]);
+        }
+    });
+    return *this;
+}
+
+inline Spectrum& Spectrum::applyFilter(const std::function<double(double u, double v)>& transfer) {
+    detail::parallelRows(height, width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            double u = y <= height / 2 ? y : y - height;
+            std::complex<double>* row = (*this)[y].data();
+            for (int x = 0; x < width; x++) row[x] *= transfer(u, x);
+        }
+    });
+    return *this;
+}
+
+inline std::function<double(double, double)> FrequencyFilter::idealLowpass(double cutoff) {
+    return [cutoff](double u, double v) { return std::sqrt(u * u + v * v) <= cutoff ? 1.0 : 0.0; };
+}
+
+inline std::function<double(double, double)> FrequencyFilter::idealHighpass(double cutoff) {
+    return [cutoff](double u, double v) { return std::sqrt(u * u + v * v) > cutoff ? 1.0 : 0.0; };
+}
+
+inline std::function<double(double, double)> FrequencyFilter::butterworthLowpass(double cutoff, int order) {
+    return [cutoff, order](double u, double v) { return 1 / (1 + std::pow(std::sqrt(u * u + v * v) / cutoff, 2 * order)); };
+}
+
+inline std::function<double(double, double)> FrequencyFilter::butterworthHighpass(double cutoff, int order) {
+    return [cutoff, order](double u, double v) {
+        double distance = std::sqrt(u * u + v * v);
+        return distance == 0 ? 0.0 : 1 / (1 + std::pow(cutoff / distance, 2 * order));
+    };
+}
+
+inline std::function<double(double, double)> FrequencyFilter::gaussianLowpass(double cutoff) {
+    return [cutoff](double u, double v) { return std::exp(-(u * u + v * v) / (2 * cutoff * cutoff)); };
+}
+
+inline std::function<double(double, double)> FrequencyFilter::gaussianHighpass(double cutoff) {
+    return [cutoff](double u, double v) { return 1 - std::exp(-(u * u + v * v) / (2 * cutoff * cutoff)); };
+}
+
+// Direct convolution for small kernels, FFT convolution for large ones
+template <typename Scalar>
+Matrix MatrixT<Scalar>::fftConvolve(const Matrix& kernel, BorderMode border, double value) const {
+    static_assert(std::is_same<Scalar, double>::value, "fftConvolve needs a double Matrix; convert with convertTo<double>");
+    IMGPROC_PROFILE_SCOPE("Matrix::fftConvolve", 2 * sizeof(double) * height * width);
+    detail::ConvPlan<double> plan = detail::planConvolution(kernel);
+    int taps = plan.separable ? plan.height + plan.width : plan.height * plan.width;
+    if (taps <= detail::FFT_CROSSOVER_TAPS) return convolve(kernel, border, value);
+    return detail::convolveFFT(*this, kernel, border, value);
+}
+
+template <typename Scalar>
+Matrix MatrixT<Scalar>::filterFrequencies(const std::function<double(double u, double v)>& transfer) const {
+    static_assert(std::is_same<Scalar, double>::value, "filterFrequencies needs a double Matrix; convert with convertTo<double>");
+    return Spectrum::fromMatrix(*this).applyFilter(transfer).toMatrix();
+}
+
+////////////////////////////////////////
+//      GrayImage implementation      //
+////////////////////////////////////////
+
+namespace detail {
+
+// Converts every channel value; pixels are arrays of `Channels` values of T
+template <typename U, typename T, int Channels, typename Pixel>
+Image<U, Channels> convertImage(const Grid<Pixel>& image, Narrowing narrowing) {
+    Image<U, Channels> result(image.height, image.width, UNINITIALIZED);
+    convertRows(reinterpret_cast<const T*>(image.data()), image.stride() * Channels, reinterpret_cast<U*>(result.data()), result.stride() * Channels,
+                image.height, image.width * Channels, narrowing);
+    return result;
+}
+
+} // namespace detail
+
+template <typename T, int Channels>
+template <typename U>
+Image<U, Channels> Image<T, Channels>::convertTo(Narrowing narrowing) const {
+    return detail::convertImage<U, T, Channels>(*this, narrowing);
+}
+
+template <typename T, int Channels>
+template <typename U>
+MatrixT<U> Image<T, Channels>::toMatrix(Narrowing narrowing) const {
+    static_assert(Channels == 1, "Only single-channel images convert to a matrix");
+    MatrixT<U> matrix(this->height, this->width, UNINITIALIZED);
+    detail::convertRows(this->data(), this->stride(), matrix.data(), matrix.stride(), this->height, this->width, narrowing);
+    return matrix;
+}
+
+template <typename T, int Channels>
+template <typename U>
+Image<T, Channels> Image<T, Channels>::fromMatrix(const MatrixT<U>& matrix, Narrowing narrowing) {
+    static_assert(Channels == 1, "Only single-channel images convert from a matrix");
+    Image image(matrix.height, matrix.width, UNINITIALIZED);
+    detail::convertRows(matrix.data(), matrix.stride(), image.data(), image.stride(), matrix.height, matrix.width, narrowing);
+    return image;
+}
+
+inline GrayImage::Image(int height, int width) : Grid<uint8_t>(height, width)
+{
+    detail::grayHeaders(height, width, fileHeader, infoHeader);
+}
+
+inline GrayImage::Image(int height, int width, Uninitialized) : Grid<uint8_t>(height, width, UNINITIALIZED)
+{
+    detail::grayHeaders(height, width, fileHeader, infoHeader);
+}
+
+inline ImageView<uint8_t> GrayImage::roi(int y, int x, int h, int w) {
+    return view().subview(y, x, h, w);
+}
+
+inline ImageView<const uint8_t> GrayImage::roi(int y, int x, int h, int w) const {
+    return view().subview(y, x, h, w);
+}
+
+// Reads 1, 4 and 8-bit palettized BMPs, uncompressed or RLE. Palette entries
+// are reduced to gray with the same (R + G + B) / 3 average as
+// RGBImage::toGray's default, and an identity gray palette is recognized so
+// those files need no mapping.
+inline GrayImage GrayImage::fromFile(const std::string& filename) {
+    IMGPROC_PROFILE_SCOPE("GrayImage::fromFile", 0);
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER infoHeader;
+
+    std::ifstream file(filename, std::ios::binary);
+
+    if (!file) throw std::runtime_error("Failed to open the file: " + filename);
+
+    file.read(reinterpret_cast<char*>(&fileHeader), sizeof(BITMAPFILEHEADER));
+    file.read(reinterpret_cast<char*>(&infoHeader), sizeof(BITMAPINFOHEADER));
+
+    if (!file || fileHeader.bfType != 0x4D42) throw std::runtime_error("Not a BMP file: " + filename);
+    if (infoHeader.biBitCount != 1 && infoHeader.biBitCount != 4 && infoHeader.biBitCount != 8)
+        throw std::runtime_error("Only 1, 4 and 8-bit palettized BMP files can be read as gray images: " + filename);
+    if (infoHeader.biCompression != BI_RGB && infoHeader.biCompression != BI_RLE8 && infoHeader.biCompression != BI_RLE4)
+        throw std::runtime_error("Unsupported BMP compression: " + filename);
+    if (infoHeader.biWidth < 0 || infoHeader.biHeight == std::numeric_limits<int32_t>::min()) throw std::runtime_error("Invalid BMP dimensions: " + filename);
+
+    std::array<uint8_t, COLOR_TABLE_SIZE * 4> palette;
+    std::size_t colors = detail::readPalette(file, infoHeader, palette);
+
+    LookupTable lut;
+    bool identity = true;
+    for (std::size_t i = 0; i < COLOR_TABLE_SIZE; i++) {
+        const uint8_t* color = palette.data() + i * 4;
+        lut.table[i] = static_cast<uint8_t>((color[0] + color[1] + color[2]) / 3);
+        if (i < colors && (color[0] != i || color[1] != i || color[2] != i)) identity = false;
+    }
+
+    Grid<uint8_t> indices = detail::readIndices(file, fileHeader, infoHeader);
+
+    GrayImage image;
+    static_cast<Grid<uint8_t>&>(image) = std::move(indices);
+    detail::grayHeaders(image.height, image.width, image.fileHeader, image.infoHeader);
+    IMGPROC_PROFILE_BYTES(static_cast<uint64_t>(image.height) * image.width);
+    if (identity) return image;
+
+    return image.applyLUT(lut);
+}
+
+inline GrayImage& GrayImage::toFile(const std::string& filename, Compression compression) {
+    IMGPROC_PROFILE_SCOPE("GrayImage::toFile", static_cast<uint64_t>(height) * width);
+    switch (compression) {
+        case BI_RGB:
+            detail::writeGray(filename, fileHeader, infoHeader, view());
+            break;
+        case BI_RLE8:
+            detail::writeGrayRLE8(filename, fileHeader, infoHeader, view());
+            break;
+        default:
+            throw std::runtime_error("Gray images can only be written uncompressed or as RLE8!");
+    }
+    return *this;
+}
+
+inline Matrix GrayImage::toMatrix() const {
+    IMGPROC_PROFILE_SCOPE("GrayImage::toMatrix", (1 + sizeof(double)) * height * width);
+    Matrix matrix(height, width, UNINITIALIZED);
+
+    detail::parallelRows(height, width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            const uint8_t* src = (*this)[y].data();
+            double* dst = matrix[y].data();
+            for (int x = 0; x < width; x++) {
+                dst[x] = src[x];
+            }
+        }
+    });
+
+    return matrix;
+}
+
+inline GrayImage GrayImage::fromMatrix(const Matrix& matrix, Narrowing narrowing) {
+    IMGPROC_PROFILE_SCOPE("GrayImage::fromMatrix", (sizeof(double) + 1) * matrix.height * matrix.width);
+    GrayImage image(matrix.height, matrix.width, UNINITIALIZED);
+
+    detail::parallelRows(matrix.height, matrix.width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            detail::narrowRow(matrix[y].data(), image[y].data(), matrix.width, narrowing);
+        }
+    });
+
+    return image;
+}
+
+template <typename U>
+MatrixT<U> GrayImage::toMatrix(Narrowing narrowing) const {
+    IMGPROC_PROFILE_SCOPE("GrayImage::toMatrix", (1 + sizeof(U)) * height * width);
+    MatrixT<U> matrix(height, width, UNINITIALIZED);
+    detail::convertRows(data(), stride(), matrix.data(), matrix.stride(), height, width, narrowing);
+    return matrix;
+}
+
+template <typename U>
+GrayImage GrayImage::fromMatrix(const MatrixT<U>& matrix, Narrowing narrowing) {
+    IMGPROC_PROFILE_SCOPE("GrayImage::fromMatrix", (sizeof(U) + 1) * matrix.height * matrix.width);
+    GrayImage image(matrix.height, matrix.width, UNINITIALIZED);
+    detail::convertRows(matrix.data(), matrix.stride(), image.data(), image.stride(), matrix.height, matrix.width, narrowing);
+    return image;
+}
+
+template <typename U>
+Image<U, 1> GrayImage::convertTo(Narrowing narrowing) const {
+    return detail::convertImage<U, uint8_t, 1>(*this, narrowing);
+}
+
+inline GrayImage& GrayImage::applyLUT(const LookupTable& lut) {
+    const detail::LutKernels& kernels = detail::lutKernels();
+
+    detail::parallelRows(height, width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            uint8_t* row = (*this)[y].data();
+            kernels.gray(row, row, width, lut.table.data());
+        }
+    });
+
+    return *this;
+}
+
+inline GrayImage& GrayImage::equalize() {
+    return applyLUT(Histogram(*this).equalization());
+}
+
+inline GrayImage& GrayImage::threshold(uint8_t threshold, uint8_t maxValue) {
+    LookupTable lut;
+    for (std::size_t i = 0; i < COLOR_TABLE_SIZE; i++) lut.table[i] = i > threshold ? maxValue : 0;
+    return applyLUT(lut);
+}
+
+inline RGBImage::Image(int height, int width) : Grid<RGBTRIPLE>(height, width)
+{
+    detail::rgbHeaders(height, width, fileHeader, infoHeader);
+}
+
+inline RGBImage::Image(int height, int width, Uninitialized) : Grid<RGBTRIPLE>(height, width, UNINITIALIZED)
+{
+    detail::rgbHeaders(height, width, fileHeader, infoHeader);
+}
+
+inline ImageView<RGBTRIPLE> RGBImage::roi(int y, int x, int h, int w) {
+    return view().subview(y, x, h, w);
+}
+
+inline ImageView<const RGBTRIPLE> RGBImage::roi(int y, int x, int h, int w) const {
+    return view().subview(y, x, h, w);
+}
+
+inline GrayImage RGBImage::getChannel(const Channel& channel) const {
+    if (channel != Channel::BLUE && channel != Channel::GREEN && channel != Channel::RED)
+        throw std::runtime_error("Unknown channel!");
+
+    IMGPROC_PROFILE_SCOPE("RGBImage::getChannel", 4 * static_cast<uint64_t>(height) * width);
+    GrayImage image(height, width, UNINITIALIZED);
+    const detail::ColorKernels& kernels = detail::colorKernels();
+
+    // Channel order matches the byte order of RGBTRIPLE
+    detail::parallelRows(height, width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            kernels.channel((*this)[y].data(), image[y].data(), width, static_cast<int>(channel));
+        }
+    });
+
+    return image;
+}
+
+// Reads uncompressed 24-bit, 16/32-bit BI_RGB and BI_BITFIELDS, and
+// 1/4/8-bit palettized (including RLE8/RLE4) BMP files
+inline RGBImage RGBImage::fromFile(const std::string& filename) {
+    IMGPROC_PROFILE_SCOPE("RGBImage::fromFile", 0);
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER infoHeader;
+
+    std::ifstream file(filename, std::ios::binary);
+
+    if (!file) throw std::runtime_error("Failed to open the file: " + filename);
+
+    file.read(reinterpret_cast<char*>(&fileHeader), sizeof(BITMAPFILEHEADER));
+    file.read(reinterpret_cast<char*>(&infoHeader), sizeof(BITMAPINFOHEADER));
+
+    if (!file || fileHeader.bfType != 0x4D42) throw std::runtime_error("Not a BMP file: " + filename);
+    if (infoHeader.biWidth < 0 || infoHeader.biHeight == std::numeric_limits<int32_t>::min()) throw std::runtime_error("Invalid BMP dimensions: " + filename);
+
+    int width = infoHeader.biWidth;
+    int height = infoHeader.biHeight < 0 ? -infoHeader.biHeight : infoHeader.biHeight;
+    int bits = infoHeader.biBitCount;
+    uint32_t compression = infoHeader.biCompression;
+
+    RGBImage image(height, width);
+    IMGPROC_PROFILE_BYTES(3 * static_cast<uint64_t>(height) * width);
+
+    if (compression == BI_RGB && bits == 24) {
+        file.seekg(fileHeader.bfOffBits, std::ios::beg);
+        detail::readRows(file, image.view(), infoHeader.biHeight >= 0);
+    } else if ((compression == BI_RGB || compression == BI_BITFIELDS) && (bits == 16 || bits == 32)) {
+        detail::readBitfields(file, fileHeader, infoHeader, image.view());
+    } else if ((compression == BI_RGB && (bits == 1 || bits == 4 || bits == 8)) || (compression == BI_RLE8 && bits == 8) || (compression == BI_RLE4 && bits == 4)) {
+        std::array<uint8_t, COLOR_TABLE_SIZE * 4> palette;
+        detail::readPalette(file, infoHeader, palette);
+        std::array<RGBTRIPLE, COLOR_TABLE_SIZE> colors;
+        for (std::size_t i = 0; i < COLOR_TABLE_SIZE; i++) {
+            colors[i] = { palette[i * 4], palette[i * 4 + 1], palette[i * 4 + 2] };
         }
+
+        Grid<uint8_t> indices = detail::readIndices(file, fileHeader, infoHeader);
+        for (int y = 0; y < height; y++) {
+            const uint8_t* src = indices[y].data();
+            RGBTRIPLE* dst = image[y].data();
+            for (int x = 0; x < width; x++) {
+                dst[x] = colors[src[x]];
+            }
+        }
+    } else {
+        throw std::runtime_error("Unsupported BMP format: " + std::to_string(bits) + "-bit with compression " + std::to_string(compression));
     }
 
-    return true;
+    file.close();
+    return image;
+}
+
+inline RGBImage& RGBImage::toFile(const std::string& filename) {
+    IMGPROC_PROFILE_SCOPE("RGBImage::toFile", 3 * static_cast<uint64_t>(height) * width);
+    detail::writeRGB(filename, fileHeader, infoHeader, view());
+    return *this;
+}
+
+inline GrayImage RGBImage::toGray(const ColorSpace& method) {
+    IMGPROC_PROFILE_SCOPE("RGBImage::toGray", 4 * static_cast<uint64_t>(height) * width);
+    GrayImage grayImage(height, width, UNINITIALIZED);
+    const detail::ColorKernels& kernels = detail::colorKernels();
+
+    switch (method) {
+        case ColorSpace::HSI:
+            detail::parallelRows(height, width, [&](int begin, int end) {
+                for (int y = begin; y < end; y++) {
+                    kernels.grayHSI((*this)[y].data(), grayImage[y].data(), width);
+                }
+            });
+            break;
+        case ColorSpace::YCC:
+            detail::parallelRows(height, width, [&](int begin, int end) {
+                for (int y = begin; y < end; y++) {
+                    kernels.grayYCC((*this)[y].data(), grayImage[y].data(), width);
+                }
+            });
+            break;
+        default:
+            throw std::runtime_error("Unknown method! Supported methods are HSI and YCC.");
+    }
+
+    return grayImage;
+}
+
+inline RGBImage RGBImage::fromGrays(const GrayImage& bChannel, const GrayImage& gChannel, const GrayImage& rChannel) {
+    if (gChannel.width != bChannel.width || gChannel.height != bChannel.height || rChannel.width != bChannel.width || rChannel.height != bChannel.height)
+        throw std::runtime_error("Cannot merge channels with different shapes! Got " + std::to_string(bChannel.width) + "x" + std::to_string(bChannel.height) + ", " + std::to_string(gChannel.width) + "x" + std::to_string(gChannel.height) + " and " + std::to_string(rChannel.width) + "x" + std::to_string(rChannel.height));
+    IMGPROC_PROFILE_SCOPE("RGBImage::fromGrays", 6 * static_cast<uint64_t>(bChannel.height) * bChannel.width);
+    RGBImage image(bChannel.height, bChannel.width, UNINITIALIZED);
+    const detail::ColorKernels& kernels = detail::colorKernels();
+
+    detail::parallelRows(bChannel.height, bChannel.width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            kernels.merge(bChannel[y].data(), gChannel[y].data(), rChannel[y].data(), image[y].data(), bChannel.width);
+        }
+    });
+
+    return image;
+}
+
+inline RGBImage& RGBImage::applyLUT(const LookupTable& lut) {
+    const detail::LutKernels& kernels = detail::lutKernels();
+
+    // With one table the channels need not be told apart; rows are plain bytes
+    detail::parallelRows(height, width * 3, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            uint8_t* row = reinterpret_cast<uint8_t*>((*this)[y].data());
+            kernels.gray(row, row, width * 3, lut.table.data());
+        }
+    });
+
+    return *this;
+}
+
+inline RGBImage& RGBImage::applyLUT(const LookupTable& bLut, const LookupTable& gLut, const LookupTable& rLut) {
+    const detail::LutKernels& kernels = detail::lutKernels();
+
+    detail::parallelRows(height, width * 3, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            kernels.rgb((*this)[y].data(), width, bLut.table.data(), gLut.table.data(), rLut.table.data());
+        }
+    });
+
+    return *this;
+}
+
+template <typename U>
+Image<U, 3> RGBImage::convertTo(Narrowing narrowing) const {
+    return detail::convertImage<U, uint8_t, 3>(*this, narrowing);
+}
+
+////////////////////////////////////////
+//   PlanarRGBImage implementation    //
+////////////////////////////////////////
+
+inline PlanarRGBImage::PlanarRGBImage(int height, int width) : PlanarRGBImage(height, width, UNINITIALIZED) {
+    if (buffer.size()) std::memset(buffer.data(), 0, buffer.size());
+}
+
+inline PlanarRGBImage::PlanarRGBImage(int height, int width, Uninitialized) : width(width), height(height) {
+    // Round each plane up to whole cache lines so every plane starts aligned
+    std::size_t planeBytes = static_cast<std::size_t>(height) * width;
+    planeStride = static_cast<std::ptrdiff_t>((planeBytes + BUFFER_ALIGNMENT - 1) & ~(BUFFER_ALIGNMENT - 1));
+    buffer = AlignedBuffer<uint8_t>(3 * planeStride);
+}
+
+inline PlanarRGBImage& PlanarRGBImage::operator=(const PlanarRGBImage& other) {
+    buffer = other.buffer;
+    width = other.width;
+    height = other.height;
+    planeStride = other.planeStride;
+    return *this;
+}
+
+inline ImageView<uint8_t> PlanarRGBImage::getChannel(const Channel& channel) {
+    if (channel != Channel::BLUE && channel != Channel::GREEN && channel != Channel::RED)
+        throw std::runtime_error("Unknown channel!");
+
+    return GridView<uint8_t>(plane(static_cast<int>(channel)), height, width, width);
+}
+
+inline ImageView<const uint8_t> PlanarRGBImage::getChannel(const Channel& channel) const {
+    if (channel != Channel::BLUE && channel != Channel::GREEN && channel != Channel::RED)
+        throw std::runtime_error("Unknown channel!");
+
+    return GridView<const uint8_t>(plane(static_cast<int>(channel)), height, width, width);
+}
+
+inline PlanarRGBImage PlanarRGBImage::fromRGB(GridView<const RGBTRIPLE> image) {
+    PlanarRGBImage planar(image.height, image.width, UNINITIALIZED);
+    const detail::ColorKernels& kernels = detail::colorKernels();
+
+    // One pass over the interleaved pixels fills all three planes
+    detail::parallelRows(image.height, image.width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            std::ptrdiff_t offset = static_cast<std::ptrdiff_t>(y) * image.width;
+            kernels.split(image[y].data(), planar.plane(0) + offset, planar.plane(1) + offset, planar.plane(2) + offset, image.width);
+        }
+    });
+
+    return planar;
+}
+
+inline RGBImage PlanarRGBImage::toRGB() const {
+    RGBImage image(height, width, UNINITIALIZED);
+    const detail::ColorKernels& kernels = detail::colorKernels();
+
+    detail::parallelRows(height, width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            std::ptrdiff_t offset = static_cast<std::ptrdiff_t>(y) * width;
+            kernels.merge(plane(0) + offset, plane(1) + offset, plane(2) + offset, image[y].data(), width);
+        }
+    });
+
+    return image;
+}
+
+inline PlanarRGBImage PlanarRGBImage::fromFile(const std::string& filename) {
+    return fromRGB(RGBImage::fromFile(filename));
+}
+
+inline const PlanarRGBImage& PlanarRGBImage::toFile(const std::string& filename) const {
+    toRGB().toFile(filename);
+    return *this;
+}
+
+////////////////////////////////////////
+//    IntegralImage implementation    //
+////////////////////////////////////////
+
+namespace detail {
+
+// Sums of a byte image with at most this many pixels fit in 32 bits
+constexpr std::size_t INTEGRAL_32BIT_PIXELS = 0xFFFFFFFFu / 255;
+
+// Two-pass prefix scan into a (height + 1) x (width + 1) table whose first
+// row and column stay zero. The rows are split into one band per thread and
+// each band is scanned in both directions on its own; the bottom rows of
+// the bands are then carried down, and a second pass adds the carried row
+// above each band to the rest of it. One band needs no second pass.
+template <typename T, typename S, typename F>
+void buildSummedArea(GridView<const S> source, Grid<T>& table, F value) {
+    table = Grid<T>(source.height + 1, source.width + 1);
+    int width = source.width;
+
+    std::size_t elements = static_cast<std::size_t>(source.height) * width;
+    int bands = elements < PARALLEL_MIN_ELEMENTS || insideParallelFor() ? 1 : std::min(ThreadPool::instance().threadCount(), source.height);
+    auto bandStart = [&](int band) { return static_cast<int>(static_cast<long long>(source.height) * band / bands); };
+
+    parallelFor(bands, 1, [&](int begin, int end) {
+        for (int band = begin; band < end; band++) {
+            for (int y = bandStart(band); y < bandStart(band + 1); y++) {
+                const S* in = source[y].data();
+                T* out = table[y + 1].data() + 1;
+                T sum = 0;
+                if (y == bandStart(band)) {
+                    for (int x = 0; x < width; x++) out[x] = sum += value(in[x]);
+                } else {
+                    const T* above = table[y].data() + 1;
+                    for (int x = 0; x < width; x++) out[x] = (sum += value(in[x])) + above[x];
+                }
+            }
+        }
+    });
+    if (bands == 1) return;
+
+    for (int band = 1; band < bands; band++) {
+        const T* carry = table[bandStart(band)].data();
+        T* last = table[bandStart(band + 1)].data();
+        for (int x = 1; x <= width; x++) last[x] += carry[x];
+    }
+    parallelFor(bands - 1, 1, [&](int begin, int end) {
+        for (int band = begin + 1; band < end + 1; band++) {
+            const T* carry = table[bandStart(band)].data();
+            for (int y = bandStart(band) + 1; y < bandStart(band + 1); y++) {
+                T* row = table[y].data();
+                for (int x = 1; x <= width; x++) row[x] += carry[x];
+            }
+        }
+    });
+}
+
+// Unsigned tables may have wrapped around; the difference is still exact
+template <typename T>
+double boxTotal(const Grid<T>& table, int y0, int x0, int y1, int x1) noexcept {
+    return static_cast<double>(static_cast<T>(table[y1][x1] - table[y0][x1] - table[y1][x0] + table[y0][x0]));
+}
+
+// Sums of every window in one output row: rows [y0, y1) of the table,
+// columns within `radius` of x clipped to the image
+template <typename T>
+void windowSums(const Grid<T>& table, int y0, int y1, int width, int radius, double* out) noexcept {
+    const T* top = table[y0].data();
+    const T* bottom = table[y1].data();
+    for (int x = 0; x < width; x++) {
+        int x0 = std::max(x - radius, 0), x1 = std::min(x + radius + 1, width);
+        out[x] = static_cast<double>(static_cast<T>(bottom[x1] - top[x1] - bottom[x0] + top[x0]));
+    }
+}
+
+inline void checkRadius(int radiusY, int radiusX) {
+    if (radiusY < 0 || radiusX < 0)
+        throw std::runtime_error("Box filter radius must not be negative! Got " + std::to_string(radiusX) + "x" + std::to_string(radiusY));
+}
+
+} // namespace detail
+
+inline IntegralImage::IntegralImage(GridView<const uint8_t> image) : width(image.width), height(image.height) {
+    if (static_cast<std::size_t>(width) * height <= detail::INTEGRAL_32BIT_PIXELS)
+        detail::buildSummedArea(image, byteSums, [](uint8_t v) { return static_cast<uint32_t>(v); });
+    else
+        detail::buildSummedArea(image, wideSums, [](uint8_t v) { return static_cast<uint64_t>(v); });
+}
+
+inline IntegralImage::IntegralImage(const Matrix& matrix) : width(matrix.width), height(matrix.height) {
+    detail::buildSummedArea(matrix.view(), sums, [](double v) { return v; });
+}
+
+inline bool IntegralImage::clip(int& y0, int& x0, int& y1, int& x1) const noexcept {
+    y0 = std::max(y0, 0);
+    x0 = std::max(x0, 0);
+    y1 = std::min(y1, height);
+    x1 = std::min(x1, width);
+    return y0 < y1 && x0 < x1;
+}
+
+inline double IntegralImage::sum(int y0, int x0, int y1, int x1) const noexcept {
+    if (!byteSums.empty()) return detail::boxTotal(byteSums, y0, x0, y1, x1);
+    if (!wideSums.empty()) return detail::boxTotal(wideSums, y0, x0, y1, x1);
+    return detail::boxTotal(sums, y0, x0, y1, x1);
+}
+
+inline void IntegralImage::windowSums(int y0, int y1, int radius, double* out) const noexcept {
+    if (!byteSums.empty()) detail::windowSums(byteSums, y0, y1, width, radius, out);
+    else if (!wideSums.empty()) detail::windowSums(wideSums, y0, y1, width, radius, out);
+    else detail::windowSums(sums, y0, y1, width, radius, out);
+}
+
+inline double IntegralImage::boxSum(int y, int x, int boxHeight, int boxWidth) const noexcept {
+    int y1 = y + boxHeight, x1 = x + boxWidth;
+    return clip(y, x, y1, x1) ? sum(y, x, y1, x1) : 0;
+}
+
+inline double IntegralImage::boxMean(int y, int x, int boxHeight, int boxWidth) const noexcept {
+    int y1 = y + boxHeight, x1 = x + boxWidth;
+    if (!clip(y, x, y1, x1)) return 0;
+    return sum(y, x, y1, x1) / (static_cast<double>(y1 - y) * (x1 - x));
+}
+
+inline Matrix IntegralImage::boxFilter(int radiusY, int radiusX) const {
+    detail::checkRadius(radiusY, radiusX);
+    Matrix result(height, width);
+
+    detail::parallelRows(height, width, [&](int begin, int end) {
+        for (int y = begin; y < end; y++) {
+            int y0 = std::max(y - radiusY, 0), y1 = std::min(y + radiusY + 1, height);
+            double* row = result[y].data();
+            windowSums(y0, y1, radiusX, row);
+            for (int x = 0; x < width; x++) {
+                row[x] /= (y1 - y0) * (std::min(x + radiusX + 1, width) - std::max(x - radiusX, 0));
+            }
+        }
+    });
+
+    return result;
+}
+
+inline SquaredIntegralImage::SquaredIntegralImage(GridView<const uint8_t> image) : IntegralImage(image) {
+    detail::buildSummedArea(image, byteSquares, [](uint8_t v) { return static_cast<uint64_t>(v * v); });
+}
+
+inline SquaredIntegralImage::SquaredIntegralImage(const Matrix& matrix) : IntegralImage(matrix) {
+    detail::buildSummedArea(matrix.view(), squares, [](double v) { return v * v; });
+}
+
+inline double SquaredIntegralImage::squaredSum(int y0, int x0, int y1, int x1) const noexcept {
+    if (!byteSquares.empty()) return detail::boxTotal(byteSquares, y0, x0, y1, x1);
+    return detail::boxTotal(squares, y0, x0, y1, x1);
+}
+
+inline double SquaredIntegralImage::boxSquaredSum(int y, int x, int boxHeight, int boxWidth) const noexcept {
+    int y1 = y + boxHeight, x1 = x + boxWidth;
+    return clip(y, x, y1, x1) ? squaredSum(y, x, y1, x1) : 0;
+}
+
+inline double SquaredIntegralImage::boxVariance(int y, int x, int boxHeight, int boxWidth) const noexcept {
+    int y1 = y + boxHeight, x1 = x + boxWidth;
+    if (!clip(y, x, y1, x1)) return 0;
+    double area = static_cast<double>(y1 - y) * (x1 - x);
+    double total = sum(y, x, y1, x1);
+    return std::max(0.0, (squaredSum(y, x, y1, x1) - total * total / area) / area);
+}
+
+inline Matrix SquaredIntegralImage::varianceFilter(int radiusY, int radiusX) const {
+    detail::checkRadius(radiusY, radiusX);
+    Matrix result(height, width);
+
+    detail::parallelRows(height, width, [&](int begin, int end) {
+        std::vector<double> squaredRow(width);
+        for (int y = begin; y < end; y++) {
+            int y0 = std::max(y - radiusY, 0), y1 = std::min(y + radiusY + 1, height);
+            double* row = result[y].data();
+            windowSums(y0, y1, radiusX, row);
+            if (!byteSquares.empty()) detail::windowSums(byteSquares, y0, y1, width, radiusX, squaredRow.data());
+            else detail::windowSums(squares, y0, y1, width, radiusX, squaredRow.data());
+
+            for (int x = 0; x < width; x++) {
+                double area = (y1 - y0) * (std::min(x + radiusX + 1, width) - std::max(x - radiusX, 0));
+                row[x] = std::max(0.0, (squaredRow[x] - row[x] * row[x] / area) / area);
+            }
+        }
+    });
+
+    return result;
+}
+
+////////////////////////////////////////
+//      Histogram implementation      //
+////////////////////////////////////////
+
+namespace detail {
+
+// Rows per chunk are chosen so that chunks hold at least this many pixels
+constexpr std::size_t HISTOGRAM_GRAIN_PIXELS = 1 << 18;
+// Interleaved sub-histograms, so runs of one value don't wait on their own increments
+constexpr int HISTOGRAM_LANES = 8;
+
+typedef uint32_t HistogramBins[HISTOGRAM_LANES][COLOR_TABLE_SIZE];
+
+// Counts every `step`-th byte of a row
+inline void countRow(const uint8_t* row, int width, int step, HistogramBins& bins) noexcept {
+    int x = 0;
+    if (step == 1) {
+        for (; x + 8 <= width; x += 8) {
+            uint64_t v;
+            std::memcpy(&v, row + x, sizeof(v));
+            bins[0][v & 0xFF]++;
+            bins[1][v >> 8 & 0xFF]++;
+            bins[2][v >> 16 & 0xFF]++;
+            bins[3][v >> 24 & 0xFF]++;
+            bins[4][v >> 32 & 0xFF]++;
+            bins[5][v >> 40 & 0xFF]++;
+            bins[6][v >> 48 & 0xFF]++;
+            bins[7][v >> 56]++;
+        }
+    } else {
+        for (; x + 4 <= width; x += 4) {
+            bins[0][row[x * step]]++;
+            bins[1][row[(x + 1) * step]]++;
+            bins[2][row[(x + 2) * step]]++;
+            bins[3][row[(x + 3) * step]]++;
+        }
+    }
+    for (; x < width; x++) bins[0][row[x * step]]++;
+}
+
+// Counts `width` bytes `step` apart in each row. Every chunk of rows counts
+// into its own 32-bit bins, flushed into the 64-bit result under a lock
+// before they could overflow.
+inline void countBytes(const uint8_t* origin, std::ptrdiff_t strideBytes, int height, int width, int step, Histogram& histogram) {
+    std::mutex mutex;
+    int grain = static_cast<int>(std::max<std::size_t>(1, HISTOGRAM_GRAIN_PIXELS / std::max(width, 1)));
+    std::size_t flushPixels = std::numeric_limits<uint32_t>::max() - static_cast<std::size_t>(width);
+
+    auto count = [&](int begin, int end) {
+        HistogramBins bins = {};
+        std::size_t pending = 0;
+        auto flush = [&] {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (std::size_t v = 0; v < COLOR_TABLE_SIZE; v++) {
+                for (int lane = 0; lane < HISTOGRAM_LANES; lane++) histogram.bins[v] += bins[lane][v];
+            }
+            std::memset(bins, 0, sizeof(bins));
+            pending = 0;
+        };
+
+        for (int y = begin; y < end; y++) {
+            if (pending > flushPixels) flush();
+            countRow(origin + y * strideBytes, width, step, bins);
+            pending += width;
+        }
+        flush();
+    };
+
+    if (static_cast<std::size_t>(height) * width < PARALLEL_MIN_ELEMENTS) {
+        if (height > 0 && width > 0) count(0, height);
+    } else {
+        parallelFor(height, grain, count);
+    }
+}
+
+} // namespace detail
+
+inline Histogram::Histogram(GridView<const uint8_t> image) : Histogram() {
+    detail::countBytes(image.data(), image.stride(), image.height, image.width, 1, *this);
+}
+
+inline Histogram::Histogram(GridView<const RGBTRIPLE> image, const Channel& channel) : Histogram() {
+    const uint8_t* origin = reinterpret_cast<const uint8_t*>(image.data()) + static_cast<int>(channel);
+    detail::countBytes(origin, image.stride() * sizeof(RGBTRIPLE), image.height, image.width, sizeof(RGBTRIPLE), *this);
+}
+
+inline Histogram& Histogram::operator+=(const Histogram& other) noexcept {
+    for (std::size_t v = 0; v < bins.size(); v++) bins[v] += other.bins[v];
+    return *this;
+}
+
+inline uint64_t Histogram::total() const noexcept {
+    uint64_t sum = 0;
+    for (uint64_t count : bins) sum += count;
+    return sum;
+}
+
+inline std::array<uint64_t, 256> Histogram::cumulative() const noexcept {
+    std::array<uint64_t, 256> result;
+    uint64_t sum = 0;
+    for (std::size_t v = 0; v < bins.size(); v++) result[v] = sum += bins[v];
+    return result;
+}
+
+inline LookupTable Histogram::equalization() const noexcept {
+    std::array<uint64_t, 256> cdf = cumulative();
+    uint64_t total = cdf.back();
+
+    // The darkest value present maps to 0 and the brightest to 255
+    uint64_t darkest = 0;
+    for (uint64_t count : bins) {
+        if (count) {
+            darkest = count;
+            break;
+        }
+    }
+    if (total == darkest) return LookupTable::identity();     // Empty or flat images stay as they are
+
+    LookupTable lut;
+    double scale = 255.0 / static_cast<double>(total - darkest);
+    for (std::size_t v = 0; v < bins.size(); v++) {
+        double mapped = cdf[v] < darkest ? 0 : (cdf[v] - darkest) * scale;
+        lut.table[v] = static_cast<uint8_t>(mapped + 0.5);
+    }
+    return lut;
+}
+
+inline uint8_t Histogram::otsuThreshold() const noexcept {
+    double total = 0, weightedTotal = 0;
+    for (std::size_t v = 0; v < bins.size(); v++) {
+        total += bins[v];
+        weightedTotal += static_cast<double>(v) * bins[v];
+    }
+
+    // Between-class variance is w0 * w1 * (mean0 - mean1)^2; the first maximum wins
+    double below = 0, weightedBelow = 0, best = -1;
+    uint8_t threshold = 0;
+    for (std::size_t t = 0; t < bins.size(); t++) {
+        below += bins[t];
+        weightedBelow += static_cast<double>(t) * bins[t];
+        double above = total - below;
+        if (below == 0 || above == 0) continue;
+
+        double difference = weightedBelow / below - (weightedTotal - weightedBelow) / above;
+        double variance = below * above * difference * difference;
+        if (variance > best) {
+            best = variance;
+            threshold = static_cast<uint8_t>(t);
+        }
+    }
+    return threshold;
+}
+
+////////////////////////////////////////
+//    PointPipeline implementation    //
+////////////////////////////////////////
+
+namespace detail {
+
+// Pixels per fused tile; the double and byte buffers stay within L1
+constexpr int PIPELINE_TILE = 512;
+
+} // namespace detail
+
+inline PointPipeline::PointPipeline(ImageView<const uint8_t> source)
+    : graySource(source), isRGB(false), method(ColorSpace::RGB), selected(-1), mode(Narrowing::TRUNCATE) {}
+
+inline PointPipeline::PointPipeline(ImageView<const RGBTRIPLE> source)
+    : rgbSource(source), isRGB(true), method(ColorSpace::RGB), selected(-1), mode(Narrowing::TRUNCATE) {}
+
+inline PointPipeline& PointPipeline::gray(const ColorSpace& method) {
+    if (!isRGB || !stages.empty() || this->method != ColorSpace::RGB || selected >= 0)
+        throw std::runtime_error("Gray conversion must be the first stage of an RGB pipeline!");
+    if (method != ColorSpace::HSI && method != ColorSpace::YCC)
+        throw std::runtime_error("Unknown method! Supported methods are HSI and YCC.");
+
+    this->method = method;
+    return *this;
+}
+
+inline PointPipeline& PointPipeline::channel(const Channel& channel) {
+    if (!isRGB || !stages.empty() || method != ColorSpace::RGB || selected >= 0)
+        throw std::runtime_error("Channel selection must be the first stage of an RGB pipeline!");
+    if (channel != Channel::BLUE && channel != Channel::GREEN && channel != Channel::RED)
+        throw std::runtime_error("Unknown channel!");
+
+    selected = static_cast<int>(channel);
+    return *this;
+}
+
+inline PointPipeline& PointPipeline::scale(double factor) {
+    stages.push_back({ Op::SCALE, factor, 0, {} });
+    return *this;
 }
 
-bool Matrix::operator!=(const Matrix& other) const noexcept {
-    return !(*this == other);
+inline PointPipeline& PointPipeline::offset(double value) {
+    stages.push_back({ Op::OFFSET, value, 0, {} });
+    return *this;
 }
 
-Matrix Matrix::transpose() const noexcept {
-    Matrix result(width, height);
+inline PointPipeline& PointPipeline::clamp(double low, double high) {
+    if (low > high) throw std::runtime_error("Clamp range is empty! Got " + std::to_string(low) + " to " + std::to_string(high));
+    stages.push_back({ Op::CLAMP, low, high, {} });
+    return *this;
+}
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            result[x][y] = (*this)[y][x];
-        }
-    }
+inline PointPipeline& PointPipeline::threshold(uint8_t threshold, uint8_t maxValue) {
+    stages.push_back({ Op::THRESHOLD, static_cast<double>(threshold), static_cast<double>(maxValue), {} });
+    return *this;
+}
 
-    return result;
+inline PointPipeline& PointPipeline::lut(const LookupTable& table) {
+    stages.push_back({ Op::LUT, 0, 0, table });
+    return *this;
 }
 
-Matrix Matrix::T() const noexcept {
-    return transpose();
+inline PointPipeline& PointPipeline::narrowing(Narrowing mode) noexcept {
+    this->mode = mode;
+    return *this;
 }
 
-// Frobenius inner product
-double Matrix::dot(const Matrix& other) const {
-    if (width != other.width || height != other.height)
-        throw std::runtime_error("Cannot calculate dot product of matrices with different shapes! Got " + std::to_string(width) + "x" + std::to_string(height) + " and " + std::to_string(other.width) + "x" + std::to_string(other.height));
+inline GrayImage PointPipeline::run() const {
+    GrayImage image(isRGB ? rgbSource.height : graySource.height, isRGB ? rgbSource.width : graySource.width, UNINITIALIZED);
+    run(image.view());
+    return image;
+}
 
-    double sum = 0;
+inline void PointPipeline::run(ImageView<uint8_t> destination) const {
+    int width = isRGB ? rgbSource.width : graySource.width;
+    int height = isRGB ? rgbSource.height : graySource.height;
+    if (isRGB && method == ColorSpace::RGB && selected < 0)
+        throw std::runtime_error("RGB pipelines need a gray or channel stage first!");
+    if (destination.width != width || destination.height != height)
+        throw std::runtime_error("Destination size " + std::to_string(destination.width) + "x" + std::to_string(destination.height) + " does not match the source size " + std::to_string(width) + "x" + std::to_string(height));
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            sum += (*this)[y][x] * other[y][x];
+    detail::parallelRows(height, width, [&](int begin, int end) {
+        alignas(BUFFER_ALIGNMENT) double values[detail::PIPELINE_TILE];
+        alignas(BUFFER_ALIGNMENT) uint8_t bytes[detail::PIPELINE_TILE];
+        for (int y = begin; y < end; y++) {
+            runRow(y, destination[y].data(), values, bytes);
         }
-    }
-
-    return sum;
+    });
 }
 
-Matrix Matrix::submatrix(int y, int x, int h, int w) const {
-    if (y + h > height || x + w > width)
-        throw std::runtime_error("Submatrix out of bounds! Matrix size is " + std::to_string(width) + "x" + std::to_string(height) + ", requested submatrix size is " + std::to_string(w) + "x" + std::to_string(h) + " at position " + std::to_string(x) + "," + std::to_string(y));
+inline void PointPipeline::runRow(int y, uint8_t* dst, double* values, uint8_t* bytes) const {
+    const detail::ColorKernels& kernels = detail::colorKernels();
+    int width = isRGB ? rgbSource.width : graySource.width;
 
-    if (y < 0 || x < 0 || h < 0 || w < 0)
-        throw std::runtime_error("Submatrix size and position must be positive! Got " + std::to_string(w) + "x" + std::to_string(h) + " at position " + std::to_string(x) + "," + std::to_string(y));
+    for (int x0 = 0; x0 < width; x0 += detail::PIPELINE_TILE) {
+        int n = std::min(detail::PIPELINE_TILE, width - x0);
 
-    Matrix result(h, w);
+        // Source bytes, exactly as toGray or getChannel would produce them
+        const uint8_t* src = bytes;
+        if (!isRGB) src = graySource[y].data() + x0;
+        else if (selected >= 0) kernels.channel(rgbSource[y].data() + x0, bytes, n, selected);
+        else if (method == ColorSpace::YCC) kernels.grayYCC(rgbSource[y].data() + x0, bytes, n);
+        else kernels.grayHSI(rgbSource[y].data() + x0, bytes, n);
 
-    for (int i = 0; i < h; i++) {
-        for (int j = 0; j < w; j++) {
-            result[i][j] = (*this)[y + i][x + j];
+        for (int x = 0; x < n; x++) values[x] = src[x];
+
+        for (const Stage& stage : stages) {
+            switch (stage.op) {
+                case Op::SCALE:
+                    for (int x = 0; x < n; x++) values[x] *= stage.a;
+                    break;
+                case Op::OFFSET:
+                    for (int x = 0; x < n; x++) values[x] += stage.a;
+                    break;
+                case Op::CLAMP:
+                    for (int x = 0; x < n; x++) values[x] = values[x] < stage.a ? stage.a : (values[x] > stage.b ? stage.b : values[x]);
+                    break;
+                case Op::THRESHOLD:
+                    for (int x = 0; x < n; x++) values[x] = detail::narrow(values[x], mode) > stage.a ? stage.b : 0;
+                    break;
+                case Op::LUT:
+                    for (int x = 0; x < n; x++) values[x] = stage.table[detail::narrow(values[x], mode)];
+                    break;
+            }
         }
-    }
 
-    return result;
+        detail::narrowRow(values, dst + x0, n, mode);
+    }
 }
 
 ////////////////////////////////////////
-//      GrayImage implementation      //
+//   Strip streaming implementation   //
 ////////////////////////////////////////
 
-GrayImage::GrayImage(int height, int width) noexcept : std::vector<std::vector<uint8_t>>(height, std::vector<uint8_t>(width)), height(height), width(width)
-{
-    // Initializer list
-    fileHeader = {
-        0x4D42,
-        static_cast<uint32_t>(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + COLOR_TABLE_SIZE * 4 + height * ((width + 3) & ~3)),
-        0, 0,
-        static_cast<uint32_t>(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + COLOR_TABLE_SIZE * 4),
-    };
+inline BMPStripReader::BMPStripReader(const std::string& filename, int stripRows, int overlap)
+    : width(0), height(0), file(filename, std::ios::binary), stripRows(stripRows), overlap(overlap), first(0), core(0), coreCount(0), count(0), topDown(false), pitch(0) {
+    if (!file) throw std::runtime_error("Failed to open the file: " + filename);
+    if (stripRows <= 0 || overlap < 0) throw std::runtime_error("Strips need at least one row and a non-negative overlap!");
 
-    infoHeader = {
-        sizeof(BITMAPINFOHEADER),
-        width,
-        height,
-        1,
-        8,
-        BI_RGB,
-        0, 0, 0,
-        COLOR_TABLE_SIZE,
-        0,
-    };
+    file.read(reinterpret_cast<char*>(&fileHeader), sizeof(BITMAPFILEHEADER));
+    file.read(reinterpret_cast<char*>(&infoHeader), sizeof(BITMAPINFOHEADER));
+    if (!file) throw std::runtime_error("File is too small to be a BMP: " + filename);
+    if (const char* problem = detail::rgbHeaderError(fileHeader, infoHeader)) throw std::runtime_error(problem + filename);
+
+    width = infoHeader.biWidth;
+    height = infoHeader.biHeight < 0 ? -infoHeader.biHeight : infoHeader.biHeight;
+    topDown = infoHeader.biHeight < 0;
+    pitch = detail::paddedRowBytes(static_cast<std::size_t>(width) * 3);
+    buffer = RGBImage(std::min(height, stripRows + 2 * overlap), width);
 }
 
-GrayImage& GrayImage::toFile(const std::string& filename) {
+inline bool BMPStripReader::next() {
+    int nextCore = core + coreCount;
+    if (nextCore >= height) return false;
 
-    std::ofstream file(filename, std::ios::binary);
+    core = nextCore;
+    coreCount = std::min(stripRows, height - core);
+    first = std::max(0, core - overlap);
+    int last = std::min(height, core + coreCount + overlap);
+    count = last - first;
+
+    // Rows [first, last) are contiguous in the file; bottom-up files store `last - 1` first
+    std::size_t storedIndex = topDown ? first : height - last;
+    file.clear();
+    file.seekg(fileHeader.bfOffBits + storedIndex * pitch, std::ios::beg);
+    detail::readRows(file, GridView<RGBTRIPLE>(buffer.data(), count, width, buffer.stride()), !topDown);
+    return true;
+}
 
+inline BMPStripWriter::BMPStripWriter(const std::string& filename, int height, int width)
+    : width(width), height(height), file(filename, std::ios::binary), filename(filename), written(0), pitch(detail::paddedRowBytes(static_cast<std::size_t>(width) * 3)) {
     if (!file) throw std::runtime_error("Failed to open the file: " + filename);
 
-    file.write(reinterpret_cast<char*>(&fileHeader), sizeof(BITMAPFILEHEADER));
-    file.write(reinterpret_cast<char*>(&infoHeader), sizeof(BITMAPINFOHEADER));
-    
-    // Color table(Mandatory for color depths ≤ 8 bits)
-    std::array<uint8_t, COLOR_TABLE_SIZE * 4> colorTable;
-    for (uint16_t i = 0; i < COLOR_TABLE_SIZE; i++) {
-        uint8_t* color = colorTable.data() + i * 4;
-        color[0] = color[1] = color[2] = i; // BGR channels
-        color[3] = 0;                       // Alpha channel
+    // Placeholder headers; close() writes the final ones
+    char placeholder[sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)] = {};
+    file.write(placeholder, sizeof(placeholder));
+}
+
+inline BMPStripWriter::~BMPStripWriter() {
+    if (!file.is_open()) return;
+    try {
+        close();
+    } catch (...) {
+        // Destructors must not throw; call close() explicitly to see errors
     }
-    file.write(reinterpret_cast<char*>(colorTable.data()), colorTable.size() * sizeof(uint8_t));
+}
 
+inline BMPStripWriter& BMPStripWriter::write(GridView<const RGBTRIPLE> rows) {
+    if (!file.is_open()) throw std::runtime_error("Cannot write to a closed file: " + filename);
+    if (rows.width != width) throw std::runtime_error("Strip width " + std::to_string(rows.width) + " does not match the image width " + std::to_string(width));
+    if (written + rows.height > height) throw std::runtime_error("Too many rows written! Image height is " + std::to_string(height));
 
-    int padding = (4 - (width % 4)) % 4;
+    // The strip's bottom row comes first in the file
+    std::size_t storedIndex = height - written - rows.height;
+    file.seekp(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + storedIndex * pitch, std::ios::beg);
+    detail::writeRows(file, rows);
+    if (!file) throw std::runtime_error("Failed to write the file: " + filename);
 
-    // BMP files are stored bottom-up
-    for (int y = height - 1; y >= 0; --y) {
-        file.write(reinterpret_cast<char*>(this->at(y).data()), width);
-        file.write("\0\0\0", padding);
+    written += rows.height;
+    return *this;
+}
+
+inline void BMPStripWriter::close() {
+    if (!file.is_open()) return;
+    if (written != height) {
+        file.close();
+        throw std::runtime_error("Only " + std::to_string(written) + " of " + std::to_string(height) + " rows were written to " + filename);
     }
 
+    BITMAPFILEHEADER fileHeader;
+    BITMAPINFOHEADER infoHeader;
+    detail::rgbHeaders(height, width, fileHeader, infoHeader);
+    infoHeader.biSizeRGBImage = static_cast<uint32_t>(pitch * height);
+    fileHeader.bfSize = static_cast<uint32_t>(fileHeader.bfOffBits + pitch * height);
+
+    file.seekp(0, std::ios::beg);
+    file.write(reinterpret_cast<const char*>(&fileHeader), sizeof(BITMAPFILEHEADER));
+    file.write(reinterpret_cast<const char*>(&infoHeader), sizeof(BITMAPINFOHEADER));
     file.close();
-    return *this;
+    if (!file) throw std::runtime_error("Failed to write the file: " + filename);
 }
 
-Matrix GrayImage::toMatrix() const noexcept {
-    Matrix matrix(height, width);
+inline void processBMPStrips(const std::string& input, const std::string& output, int stripRows, int overlap,
+                      const std::function<void(ImageView<const RGBTRIPLE> strip, int coreOffset, ImageView<RGBTRIPLE> out)>& process) {
+    BMPStripReader reader(input, stripRows, overlap);
+    BMPStripWriter writer(output, reader.height, reader.width);
+    RGBImage out(std::min(stripRows, reader.height), reader.width);
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            matrix[y][x] = (*this)[y][x];
-        }
+    while (reader.next()) {
+        ImageView<RGBTRIPLE> rows = out.roi(0, 0, reader.coreRows(), reader.width);
+        process(reader.strip(), reader.coreOffset(), rows);
+        writer.write(rows);
     }
 
-    return matrix;
+    writer.close();
 }
 
-GrayImage GrayImage::fromMatrix(const Matrix& matrix) noexcept {
-    GrayImage image(matrix.height, matrix.width);
+////////////////////////////////////////
+//      MappedBMP implementation      //
+////////////////////////////////////////
+
+inline MappedBMP::MappedBMP(const std::string& filename) : width(0), height(0), mapping(nullptr), mappingSize(0), pixels(nullptr), pitch(0), topDown(false) {
+#ifdef IMGPROC_HAS_MMAP
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Failed to open the file: " + filename);
+
+    struct stat info;
+    if (::fstat(fd, &info) != 0) {
+        ::close(fd);
+        throw std::runtime_error("Failed to open the file: " + filename);
+    }
+    mappingSize = static_cast<std::size_t>(info.st_size);
+
+    void* address = mappingSize ? ::mmap(nullptr, mappingSize, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    ::close(fd);
+    if (address == MAP_FAILED) throw std::runtime_error("Failed to map the file: " + filename);
+    mapping = static_cast<const uint8_t*>(address);
+#else
+    std::ifstream file(filename, std::ios::binary | std::ios::ate);
+    if (!file) throw std::runtime_error("Failed to open the file: " + filename);
+    fallback.resize(static_cast<std::size_t>(file.tellg()));
+    file.seekg(0, std::ios::beg);
+    file.read(reinterpret_cast<char*>(fallback.data()), fallback.size());
+    mapping = fallback.data();
+    mappingSize = fallback.size();
+#endif
 
-    for (int y = 0; y < matrix.height; y++) {
-        for (int x = 0; x < matrix.width; x++) {
-            image[y][x] = static_cast<uint8_t>(matrix[y][x]);
+    // Validate everything up front so row access never has to
+    std::string error;
+    if (mappingSize < sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)) {
+        error = "File is too small to be a BMP: ";
+    } else {
+        std::memcpy(&fileHeader, mapping, sizeof(BITMAPFILEHEADER));
+        std::memcpy(&infoHeader, mapping + sizeof(BITMAPFILEHEADER), sizeof(BITMAPINFOHEADER));
+
+        if (const char* problem = detail::rgbHeaderError(fileHeader, infoHeader)) {
+            error = problem;
+        } else {
+            width = infoHeader.biWidth;
+            height = infoHeader.biHeight < 0 ? -infoHeader.biHeight : infoHeader.biHeight;
+            topDown = infoHeader.biHeight < 0;
+            pitch = static_cast<std::ptrdiff_t>(detail::paddedRowBytes(static_cast<std::size_t>(width) * 3));
+
+            // The padding of the final row may be missing; older writers omitted it
+            if (height > 0 && fileHeader.bfOffBits + static_cast<std::size_t>(pitch) * (height - 1) + static_cast<std::size_t>(width) * 3 > mappingSize) error = "Pixel data is truncated: ";
         }
     }
 
-    return image;
+    if (!error.empty()) {
+#ifdef IMGPROC_HAS_MMAP
+        ::munmap(const_cast<uint8_t*>(mapping), mappingSize);
+#endif
+        throw std::runtime_error(error + filename);
+    }
+
+    pixels = mapping + fileHeader.bfOffBits;
 }
 
-RGBImage::RGBImage(int height, int width) noexcept : std::vector<std::vector<RGBTRIPLE>>(height, std::vector<RGBTRIPLE>(width)), height(height), width(width)
-{
-    int paddingSize = (4 - (width * 3 % 4)) % 4;
+inline MappedBMP::MappedBMP(MappedBMP&& other) noexcept
+    : width(other.width), height(other.height), fileHeader(other.fileHeader), infoHeader(other.infoHeader),
+      mapping(other.mapping), mappingSize(other.mappingSize), pixels(other.pixels), pitch(other.pitch), topDown(other.topDown),
+      fallback(std::move(other.fallback)) {
+    other.mapping = nullptr;
+    other.pixels = nullptr;
+    other.mappingSize = 0;
+    other.width = other.height = 0;
+}
 
-    fileHeader = {
-        0x4D42,
-        static_cast<uint32_t>(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER) + height * width * 3 + height * paddingSize),
-        0, 0,
-        static_cast<uint32_t>(sizeof(BITMAPFILEHEADER) + sizeof(BITMAPINFOHEADER)),
-    };
+inline MappedBMP::~MappedBMP() {
+#ifdef IMGPROC_HAS_MMAP
+    if (mapping) ::munmap(const_cast<uint8_t*>(mapping), mappingSize);
+#endif
+}
 
-    infoHeader = {
-        sizeof(BITMAPINFOHEADER),
-        width,
-        height,
-        1,
-        24,
-        BI_RGB,
-        0, 0, 0, 0,
-    };
+inline Row<const RGBTRIPLE> MappedBMP::at(int y) const {
+    if (y < 0 || y >= height) throw std::out_of_range("Row " + std::to_string(y) + " out of range! Height is " + std::to_string(height));
+    return (*this)[y];
 }
 
-GrayImage RGBImage::getChannel(const Channel& channel) const {
-    GrayImage image(height, width);
+inline RGBImage MappedBMP::crop(int y, int x, int h, int w) const {
+    detail::checkRegion("Region", "Image", width, height, y, x, h, w);
 
-    switch (channel) {
-        case Channel::BLUE:
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width; x++) {
-                    image[y][x] = (*this)[y][x].rgbtBlue;
-                }
-            }
-            break;
-        case Channel::GREEN:
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width; x++) {
-                    image[y][x] = (*this)[y][x].rgbtGreen;
-                }
-            }
-            break;
-        case Channel::RED:
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width; x++) {
-                    image[y][x] = (*this)[y][x].rgbtRed;
-                }
-            }
-            break;
-        default:
-            throw std::runtime_error("Unknown channel!");
+    RGBImage image(h, w, UNINITIALIZED);
+
+    for (int i = 0; i < h; i++) {
+        std::memcpy(image[i].data(), (*this)[y + i].data() + x, static_cast<std::size_t>(w) * sizeof(RGBTRIPLE));
     }
 
     return image;
 }
 
-RGBImage RGBImage::fromFile(const std::string& filename) {
-    BITMAPFILEHEADER fileHeader;
-    BITMAPINFOHEADER infoHeader;
-    
-    std::ifstream file(filename, std::ios::binary);
-    
-    if (!file) throw std::runtime_error("Failed to open the file: " + filename);
-
-    file.read(reinterpret_cast<char*>(&fileHeader), sizeof(BITMAPFILEHEADER));
-    file.read(reinterpret_cast<char*>(&infoHeader), sizeof(BITMAPINFOHEADER));
+inline RGBImage MappedBMP::toImage() const {
+    return crop(0, 0, height, width);
+}
 
-    if(infoHeader.biCompression != BI_RGB) throw std::runtime_error("Only uncompressed BMP files are supported!");
+////////////////////////////////////////
+//  Batch processing implementation   //
+////////////////////////////////////////
 
-    int width = infoHeader.biWidth;
-    int height = infoHeader.biHeight;
-    int paddingSize = (4 - (width * 3 % 4)) % 4;
+namespace detail {
 
-    RGBImage image(height, width);
+// Bounded multi-producer, multi-consumer ring after Dmitry Vyukov. Each cell
+// carries a sequence number saying whose turn it is, so a push or a pop is
+// one CAS on a shared position and never blocks. Both fail instead of
+// waiting when the ring is full or empty. Values live in raw storage from
+// push to pop, so an empty cell holds no image.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(std::size_t capacity) {
+        std::size_t size = 2;
+        while (size < capacity) size *= 2;
+        cells.reset(new Cell[size]);
+        for (std::size_t i = 0; i < size; i++) cells[i].sequence.store(i, std::memory_order_relaxed);
+        mask = size - 1;
+        enqueuePosition.store(0, std::memory_order_relaxed);
+        dequeuePosition.store(0, std::memory_order_relaxed);
+    }
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
 
-    file.seekg(fileHeader.bfOffBits, std::ios::beg);
+    ~BoundedQueue() {
+        T value;
+        while (tryPop(value)) {}
+    }
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            RGBTRIPLE pixel;
-            file.read(reinterpret_cast<char*>(&pixel), sizeof(RGBTRIPLE));
+    // Moves from value on success
+    bool tryPush(T& value) {
+        std::size_t position = enqueuePosition.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[position & mask];
+            std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t turn = static_cast<std::ptrdiff_t>(sequence - position);
+            if (turn == 0) {
+                if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    new (&cell.storage) T(std::move(value));
+                    cell.sequence.store(position + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (turn < 0) {
+                return false;
+            } else {
+                position = enqueuePosition.load(std::memory_order_relaxed);
+            }
+        }
+    }
 
-            // BMP files are stored bottom-up
-            image[height - y - 1][x] = pixel;
+    bool tryPop(T& value) {
+        std::size_t position = dequeuePosition.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[position & mask];
+            std::size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            std::ptrdiff_t turn = static_cast<std::ptrdiff_t>(sequence - (position + 1));
+            if (turn == 0) {
+                if (dequeuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    T* stored = reinterpret_cast<T*>(&cell.storage);
+                    value = std::move(*stored);
+                    stored->~T();
+                    cell.sequence.store(position + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (turn < 0) {
+                return false;
+            } else {
+                position = dequeuePosition.load(std::memory_order_relaxed);
+            }
         }
-        file.seekg(paddingSize, std::ios::cur);
     }
 
-    file.close();
-    return image;
-}
+private:
+    struct Cell {
+        std::atomic<std::size_t> sequence;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
 
-RGBImage& RGBImage::toFile(const std::string& filename) {
-    int paddingSize = (4 - (width * 3 % 4)) % 4;
+    std::unique_ptr<Cell[]> cells;
+    std::size_t mask;
+    // Producers and consumers write different cache lines
+    char pad0[BUFFER_ALIGNMENT];
+    std::atomic<std::size_t> enqueuePosition;
+    char pad1[BUFFER_ALIGNMENT];
+    std::atomic<std::size_t> dequeuePosition;
+    char pad2[BUFFER_ALIGNMENT];
+};
 
-    std::ofstream file(filename, std::ios::binary);
+// Wait between polls: yield at first, then sleep for up to a millisecond,
+// which is short next to decoding or encoding an image
+struct Backoff {
+    int rounds = 0;
 
-    if (!file) throw std::runtime_error("Failed to open the file: " + filename);
+    void wait() {
+        if (rounds < 8) std::this_thread::yield();
+        else std::this_thread::sleep_for(std::chrono::microseconds(std::min(1000, 50 << std::min(rounds - 8, 5))));
+        rounds++;
+    }
+};
 
-    file.write(reinterpret_cast<char*>(&fileHeader), sizeof(BITMAPFILEHEADER));
-    file.write(reinterpret_cast<char*>(&infoHeader), sizeof(BITMAPINFOHEADER));
+// Pushes unless the batch was cancelled; the caller's slot guarantees room
+template <typename T>
+void pushWaiting(BoundedQueue<T>& queue, T& item, const std::atomic<bool>& cancelled) {
+    Backoff backoff;
+    while (!queue.tryPush(item) && !cancelled.load(std::memory_order_relaxed)) backoff.wait();
+}
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            
-            // BMP files are stored bottom-up
-            RGBTRIPLE pixel = (*this)[height - y - 1][x];
-            file.write(reinterpret_cast<char*>(&pixel), sizeof(RGBTRIPLE));
-        }
-        file.seekp(paddingSize, std::ios::cur);
+// False once the producers are done and the queue is drained
+template <typename T>
+bool popWaiting(BoundedQueue<T>& queue, const std::atomic<int>& producers, const std::atomic<bool>& cancelled, T& item) {
+    Backoff backoff;
+    while (!cancelled.load(std::memory_order_relaxed)) {
+        if (queue.tryPop(item)) return true;
+        if (producers.load(std::memory_order_acquire) == 0) return queue.tryPop(item);
+        backoff.wait();
     }
+    return false;
+}
 
-    file.close();
-    return *this;
+// Runs fn and records any exception as the error of `result`
+template <typename F>
+bool recordFailure(BatchResult& result, F fn) {
+    try {
+        fn();
+        return true;
+    } catch (const std::exception& e) {
+        result.error = e.what();
+    } catch (...) {
+        result.error = "Unknown error";
+    }
+    return false;
 }
 
-GrayImage RGBImage::toGray(const ColorSpace& method = ColorSpace::HSI) {
-    GrayImage grayImage(height, width);
+} // namespace detail
 
-    switch (method) {
-        case ColorSpace::HSI:
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width; x++) {
-                    RGBTRIPLE pixel = (*this)[y][x];
-                    uint8_t gray = (pixel.rgbtRed + pixel.rgbtGreen + pixel.rgbtBlue) / 3;
-                    grayImage[y][x] = gray;
-                }
-            }
-            break;
-        case ColorSpace::YCC:
-            for (int y = 0; y < height; y++) {
-                for (int x = 0; x < width; x++) {
-                    RGBTRIPLE pixel = (*this)[y][x];
-                    uint8_t gray = static_cast<uint8_t>(0.299 * pixel.rgbtRed + 0.587 * pixel.rgbtGreen + 0.114 * pixel.rgbtBlue);
-                    grayImage[y][x] = gray;
-                }
-            }
-            break;
-        default:
-            throw std::runtime_error("Unknown method! Supported methods are HSI and YCC.");
-    }
+template <typename Process>
+std::vector<BatchResult> BatchProcessor::run(const std::vector<std::string>& inputs, const std::function<std::string(const std::string& input)>& output, Process process) const {
+    typedef typename std::decay<decltype(process(std::declval<RGBImage>(), std::declval<const std::string&>()))>::type Output;
+    struct Decoded {
+        std::size_t index;
+        RGBImage image;
+    };
+    struct Processed {
+        std::size_t index;
+        Output image;
+    };
 
-    return grayImage;
-}
+    std::vector<BatchResult> results;
+    for (const std::string& input : inputs) results.push_back({ input, std::string(), false, std::string() });
+    if (inputs.empty()) return results;
+
+    int readers = std::max(options.readers, 1), writers = std::max(options.writers, 1);
+    int workers = options.workers > 0 ? options.workers : std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    int limit = options.maxInFlight > 0 ? options.maxInFlight : 2 * (readers + workers + writers);
+
+    // Slots bound the images in flight, so the queues can never fill up
+    detail::BoundedQueue<Decoded> decoded(limit);
+    detail::BoundedQueue<Processed> processed(limit);
+    std::atomic<std::size_t> next(0);
+    std::atomic<int> slots(limit), readersLeft(readers), workersLeft(workers);
+    std::atomic<bool> cancelled(false);
 
-RGBImage RGBImage::fromGrays(const GrayImage& bChannel, const GrayImage& gChannel, const GrayImage& rChannel) noexcept {
-    RGBImage image(bChannel.height, bChannel.width);
+    auto acquireSlot = [&] {
+        detail::Backoff backoff;
+        int available = slots.load();
+        while (!cancelled.load(std::memory_order_relaxed)) {
+            if (available > 0 && slots.compare_exchange_weak(available, available - 1)) return true;
+            if (available <= 0) {
+                backoff.wait();
+                available = slots.load();
+            }
+        }
+        return false;
+    };
+
+    auto reader = [&] {
+        for (;;) {
+            std::size_t i = next++;
+            if (i >= inputs.size() || !acquireSlot()) break;
+            Decoded item = { i, RGBImage() };
+            if (detail::recordFailure(results[i], [&] { item.image = RGBImage::fromFile(inputs[i]); })) detail::pushWaiting(decoded, item, cancelled);
+            else slots++;
+        }
+        readersLeft--;
+    };
+    auto worker = [&] {
+        Decoded item = { 0, RGBImage() };
+        while (detail::popWaiting(decoded, readersLeft, cancelled, item)) {
+            Processed result = { item.index, Output() };
+            if (detail::recordFailure(results[item.index], [&] { result.image = process(std::move(item.image), inputs[item.index]); })) detail::pushWaiting(processed, result, cancelled);
+            else slots++;
+        }
+        workersLeft--;
+    };
+    auto writer = [&] {
+        Processed item = { 0, Output() };
+        while (detail::popWaiting(processed, workersLeft, cancelled, item)) {
+            BatchResult& result = results[item.index];
+            result.ok = detail::recordFailure(result, [&] {
+                result.output = output(result.input);
+                item.image.toFile(result.output);
+            });
+            item.image = Output();
+            slots++;
+        }
+    };
 
-    for (int y = 0; y < bChannel.height; y++) {
-        for (int x = 0; x < bChannel.width; x++) {
-            image[y][x] = { bChannel[y][x], gChannel[y][x], rChannel[y][x] };
+    // Stages start interleaved; if threads run out, cancel and wait for the
+    // started ones, which reference this frame, before reporting the error
+    std::vector<std::thread> threads;
+    try {
+        for (int i = 0; i < std::max(std::max(readers, workers), writers); i++) {
+            if (i < readers) threads.emplace_back(reader);
+            if (i < workers) threads.emplace_back(worker);
+            if (i < writers) threads.emplace_back(writer);
         }
+    } catch (...) {
+        cancelled = true;
+        for (std::thread& thread : threads) thread.join();
+        throw;
     }
+    for (std::thread& thread : threads) thread.join();
 
-    return image;
+    return results;
+}
+
+inline std::function<std::string(const std::string& input)> BatchProcessor::inDirectory(const std::string& directory) {
+    return [directory](const std::string& input) {
+        std::size_t slash = input.find_last_of("/\\");
+        return directory + "/" + (slash == std::string::npos ? input : input.substr(slash + 1));
+    };
 }
 
 ////////////////////////////////////////
@@ -568,6 +6585,23 @@ enum class ShapeType {
     RECTANGLE,
 };
 
+// One outline for OutlineRenderer::draw. Rectangles are given by their
+// top-left corner and size, circles by their center and radius, and the
+// outline grows inwards with the thickness. Shapes may lie partly or
+// entirely outside the image; only the visible pixels are drawn.
+struct Shape
+{
+    ShapeType type;
+    int y, x;
+    int height, width;      // Rectangles
+    int radius;             // Circles
+    RGBTRIPLE color;
+    int thickness;
+
+    static Shape rectangle(int y, int x, int height, int width, const RGBTRIPLE& color, int thickness = 1) noexcept;
+    static Shape circle(int y, int x, int radius, const RGBTRIPLE& color, int thickness = 1) noexcept;
+};
+
 class OutlineRenderer {
 private:
     int y, x;
@@ -583,40 +6617,37 @@ private:
     RGBImage renderRectangle() {
         if (height <= 0 || width <= 0) throw std::runtime_error("Rectangle dimensions must greater than 0!");
         if (thickness <= 0) throw std::runtime_error("Thickness must be greater than 0!");
-        if (thickness >= height || thickness >= width) throw std::runtime_error("Thickness must be less than the height and width!");
-        if (this->y + height > image.height || this->x + width > image.width) throw std::runtime_error("Rectangle out of bounds!");
 
-        for (int y = this->y; y < this->y + height; y++) {
-            for (int x = this->x; x < this->x + width; x++) {
-                if (y - this->y < thickness || x - this->x < thickness || (this->y + height - 1 - y) < thickness || (this->x + width - 1 - x) < thickness) {
-                    image[y][x] = color;
-                }
-            }
-        }
+        draw(image, Shape::rectangle(this->y, this->x, height, width, color, thickness));
         return image;
     }
 
     // Render the hollow circle
     // x, y is the center
     RGBImage renderCircle() {
-        for (int y = this->y - radius; y <= this->y + radius; y++) {
-            for (int x = this->x - radius; x <= this->x + radius; x++) {
-                if (y < 0 || y >= image.height || x < 0 || x >= image.width) continue;
-                if ((y - this->y) * (y - this->y) + (x - this->x) * (x - this->x) <= radius * radius) {
-                    image[y][x] = color;
-                }
-            }
-        }
+        if (radius < 0) throw std::runtime_error("Radius must not be negative!");
+        if (thickness <= 0) throw std::runtime_error("Thickness must be greater than 0!");
+
+        draw(image, Shape::circle(this->y, this->x, radius, color, thickness));
         return image;
     }
 
 public:
-    OutlineRenderer() noexcept : y(0), x(0), color({ 0, 0, 0 }), thickness(1), shape(ShapeType::NONE) {}
-    OutlineRenderer(const RGBImage& image) noexcept : y(0), x(0), color({ 0, 0, 0 }), thickness(1), image(image) {}
-    OutlineRenderer(const GrayImage& image) noexcept : y(0), x(0), color({ 0, 0, 0 }), thickness(1) {
+    OutlineRenderer() noexcept : y(0), x(0), radius(0), height(0), width(0), color({ 0, 0, 0 }), thickness(1), shape(ShapeType::NONE) {}
+    OutlineRenderer(const RGBImage& image) : y(0), x(0), radius(0), height(0), width(0), color({ 0, 0, 0 }), thickness(1), image(image), shape(ShapeType::NONE) {}
+    OutlineRenderer(const GrayImage& image) : y(0), x(0), radius(0), height(0), width(0), color({ 0, 0, 0 }), thickness(1), shape(ShapeType::NONE) {
         this->setImage(image);
     }
 
+    // Draws onto the caller's pixels without copying them. Shapes are clipped
+    // to the target and never throw; shapes with a size, radius or thickness
+    // below their minimum draw nothing. Later shapes cover earlier ones, and
+    // big batches are split into row bands across the thread pool.
+    static void draw(ImageView<RGBTRIPLE> target, const Shape& shape);
+    static void draw(ImageView<RGBTRIPLE> target, const std::vector<Shape>& shapes);
+    static void draw(RGBImage& target, const Shape& shape) { draw(ImageView<RGBTRIPLE>(target.view()), shape); }
+    static void draw(RGBImage& target, const std::vector<Shape>& shapes) { draw(ImageView<RGBTRIPLE>(target.view()), shapes); }
+
     OutlineRenderer& setPos(int y, int x) noexcept {
         this->y = y;
         this->x = x;
@@ -633,12 +6664,12 @@ public:
         return *this;
     }
 
-    OutlineRenderer& setImage(const RGBImage& image) noexcept {
+    OutlineRenderer& setImage(const RGBImage& image) {
         this->image = image;
         return *this;
     }
 
-    OutlineRenderer& setImage(const GrayImage& image) noexcept {
+    OutlineRenderer& setImage(const GrayImage& image) {
         // for(int i = 0; i < image.height; i++) {
         //     for (int j = 0; j < image.width; j++) {
         //         this->image[i][j] = { image[i][j], image[i][j], image[i][j] };
@@ -665,6 +6696,7 @@ public:
     }
 
     RGBImage render() {
+        IMGPROC_PROFILE_SCOPE("OutlineRenderer::render", 6 * static_cast<uint64_t>(image.height) * image.width);
         switch (shape) {
             case ShapeType::RECTANGLE:
                 return renderRectangle();
@@ -676,4 +6708,125 @@ public:
     }
 };
 
+namespace detail {
+
+// Pixels [x0, x1] of row y, clipped to the target
+inline void fillSpan(const ImageView<RGBTRIPLE>& target, int y, int x0, int x1, const RGBTRIPLE& color) noexcept {
+    x0 = std::max(x0, 0);
+    x1 = std::min(x1, target.width - 1);
+    if (x0 <= x1) std::fill(target[y].data() + x0, target[y].data() + x1 + 1, color);
+}
+
+// Rows [begin, end) of a rectangle outline: the top and bottom `thickness`
+// rows are full spans, the rows in between a span at each side
+inline void drawRectangle(const ImageView<RGBTRIPLE>& target, const Shape& shape, int begin, int end) noexcept {
+    if (shape.height <= 0 || shape.width <= 0 || shape.thickness <= 0) return;
+
+    int top = shape.y, bottom = shape.y + shape.height - 1;
+    int left = shape.x, right = shape.x + shape.width - 1;
+    int side = std::min(shape.thickness, shape.width);
+
+    for (int y = std::max(begin, top); y < std::min(end, bottom + 1); y++) {
+        if (y - top < shape.thickness || bottom - y < shape.thickness) {
+            fillSpan(target, y, left, right, shape.color);
+        } else {
+            fillSpan(target, y, left, left + side - 1, shape.color);
+            fillSpan(target, y, right - side + 1, right, shape.color);
+        }
+    }
+}
+
+// Largest x >= 0 with x * x + dy * dy <= r2, or -1. Like the midpoint
+// algorithm it starts from the previous row's answer, so walking a circle's
+// rows in order takes O(radius) integer steps in total.
+inline int circleReach(long long r2, long long dy, int x) noexcept {
+    while (x >= 0 && static_cast<long long>(x) * x + dy * dy > r2) x--;
+    while (static_cast<long long>(x + 1) * (x + 1) + dy * dy <= r2) x++;
+    return x;
+}
+
+// Rows [begin, end) of a circle outline: the pixels within `radius` of the
+// center that are not within radius - thickness, as one or two spans per row
+inline void drawCircle(const ImageView<RGBTRIPLE>& target, const Shape& shape, int begin, int end) noexcept {
+    if (shape.radius < 0 || shape.thickness <= 0) return;
+
+    long long outer = static_cast<long long>(shape.radius) * shape.radius;
+    int innerRadius = shape.radius - shape.thickness;
+    long long inner = static_cast<long long>(innerRadius) * innerRadius;
+    int outerReach = shape.radius, innerReach = std::max(innerRadius, 0);
+
+    for (int y = std::max(begin, shape.y - shape.radius); y < std::min(end, shape.y + shape.radius + 1); y++) {
+        long long dy = y - shape.y;
+        outerReach = circleReach(outer, dy, outerReach);
+        if (innerRadius < 0 || std::abs(dy) > innerRadius) {
+            fillSpan(target, y, shape.x - outerReach, shape.x + outerReach, shape.color);
+        } else {
+            innerReach = circleReach(inner, dy, innerReach);
+            fillSpan(target, y, shape.x - outerReach, shape.x - innerReach - 1, shape.color);
+            fillSpan(target, y, shape.x + innerReach + 1, shape.x + outerReach, shape.color);
+        }
+    }
+}
+
+inline void drawShape(const ImageView<RGBTRIPLE>& target, const Shape& shape, int begin, int end) noexcept {
+    switch (shape.type) {
+        case ShapeType::RECTANGLE:
+            drawRectangle(target, shape, begin, end);
+            break;
+        case ShapeType::CIRCLE:
+            drawCircle(target, shape, begin, end);
+            break;
+        default:
+            break;
+    }
+}
+
+// Upper bound on the pixels a shape paints, to decide whether a batch is worth splitting
+inline std::size_t outlinePixels(const Shape& shape) noexcept {
+    long long t = std::max(shape.thickness, 0);
+    switch (shape.type) {
+        case ShapeType::RECTANGLE: {
+            long long h = std::max(shape.height, 0), w = std::max(shape.width, 0);
+            return static_cast<std::size_t>(std::min(h * w, 2 * (h + w) * t));
+        }
+        case ShapeType::CIRCLE: {
+            long long d = 2 * static_cast<long long>(std::max(shape.radius, 0)) + 1;
+            return static_cast<std::size_t>(std::min(d * d, 4 * d * t));
+        }
+        default:
+            return 0;
+    }
+}
+
+} // namespace detail
+
+inline Shape Shape::rectangle(int y, int x, int height, int width, const RGBTRIPLE& color, int thickness) noexcept {
+    return { ShapeType::RECTANGLE, y, x, height, width, 0, color, thickness };
+}
+
+inline Shape Shape::circle(int y, int x, int radius, const RGBTRIPLE& color, int thickness) noexcept {
+    return { ShapeType::CIRCLE, y, x, 0, 0, radius, color, thickness };
+}
+
+inline void OutlineRenderer::draw(ImageView<RGBTRIPLE> target, const Shape& shape) {
+    IMGPROC_PROFILE_SCOPE("OutlineRenderer::draw", 3 * detail::outlinePixels(shape));
+    detail::drawShape(target, shape, 0, target.height);
+}
+
+// Every band draws every shape, in order, clipped to its own rows, so the
+// result is the same as drawing the shapes one after another
+inline void OutlineRenderer::draw(ImageView<RGBTRIPLE> target, const std::vector<Shape>& shapes) {
+    std::size_t work = 0;
+    for (const Shape& shape : shapes) work += detail::outlinePixels(shape);
+    IMGPROC_PROFILE_SCOPE("OutlineRenderer::draw", 3 * work);
+
+    auto band = [&](int begin, int end) {
+        for (const Shape& shape : shapes) detail::drawShape(target, shape, begin, end);
+    };
+
+    if (target.height <= 0 || target.width <= 0) return;
+    if (work < detail::PARALLEL_MIN_ELEMENTS) band(0, target.height);
+    else parallelFor(target.height, std::max(1, static_cast<int>(detail::PARALLEL_GRAIN_ELEMENTS / target.width)), band);
+}
+
 #endif
@@ -0,0 +1,68 @@
+// Runs a frame of typical temporaries (toGray, toMatrix, a fused expression,
+// transpose, fromMatrix, getChannel) with buffers from operator new, from
+// BufferPool and from a FrameArena reset after every frame, and reports the
+// pool's hit rate and peak footprint.
+//
+//     g++ -std=c++11 -O2 -pthread -I.. allocator_bench.cpp -o allocator_bench
+//     ./allocator_bench [width height]
+
+#include "ImgProc.hpp"
+#include "bench_common.hpp"
+#include <cstdio>
+
+static volatile int sink;
+
+static void frame(RGBImage& rgb) {
+    GrayImage gray = rgb.toGray(ColorSpace::YCC);
+    Matrix a = gray.toMatrix();
+    Matrix b = 2.0 * a - a * 0.5 + 1.0;
+    Matrix t = b.transpose();
+    GrayImage back = GrayImage::fromMatrix(t, Narrowing::SATURATE);
+    GrayImage red = rgb.getChannel(Channel::RED);
+    sink = back[0][0] + red[0][0];
+}
+
+int main(int argc, char** argv) {
+    int width = argc > 2 ? std::atoi(argv[1]) : 1920;
+    int height = argc > 2 ? std::atoi(argv[2]) : 1080;
+    const int frames = 10, repeats = 5;
+
+    RGBImage rgb = noiseRGB(height, width, 42);
+
+    std::printf("%dx%d image, %d threads, %d frames per run\n", width, height, ThreadPool::instance().threadCount(), frames);
+    std::printf("%-14s %12s %9s\n", "allocator", "ms/frame", "speedup");
+
+    double heap = bestSeconds([&] {
+        for (int i = 0; i < frames; i++) frame(rgb);
+    }, repeats) / frames;
+    std::printf("%-14s %12.3f %8.2fx\n", "operator new", heap * 1e3, 1.0);
+
+    BufferPool& pool = BufferPool::instance();
+    BufferAllocator::setDefault(&pool);
+    pool.resetStats();
+    double pooled = bestSeconds([&] {
+        for (int i = 0; i < frames; i++) frame(rgb);
+    }, repeats) / frames;
+    BufferAllocator::setDefault(nullptr);
+    std::printf("%-14s %12.3f %8.2fx\n", "BufferPool", pooled * 1e3, heap / pooled);
+
+    FrameArena arena;
+    double arenaSeconds = bestSeconds([&] {
+        for (int i = 0; i < frames; i++) {
+            {
+                AllocatorScope scope(arena);
+                frame(rgb);
+            }
+            arena.reset();
+        }
+    }, repeats) / frames;
+    std::printf("%-14s %12.3f %8.2fx\n", "FrameArena", arenaSeconds * 1e3, heap / arenaSeconds);
+
+    BufferPoolStats stats = pool.stats();
+    std::printf("\npool: %llu hits, %llu misses, %.1f%% hit rate, peak %.1f MiB\n",
+                static_cast<unsigned long long>(stats.hits), static_cast<unsigned long long>(stats.misses),
+                stats.hitRate() * 100, stats.peakBytes / 1048576.0);
+    std::printf("arena: peak %.1f MiB per frame, %.1f MiB held\n", arena.peakBytes() / 1048576.0, arena.capacity() / 1048576.0);
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+// Converts a directory of synthetic BMP files to grayscale with a blur, once
+// as a sequential fromFile / process / toFile loop and then with
+// BatchProcessor at several worker counts and in-flight caps, and reports
+// files and megabytes per second.
+//
+//     g++ -std=c++11 -O2 -pthread -I.. batch_bench.cpp -o batch_bench
+//     ./batch_bench [directory [files [width height]]]
+//
+// The directory defaults to /dev/shm, so the numbers measure the pipeline
+// rather than the disk; pass a directory on a real drive to include it.
+// The pipeline gains by overlapping file I/O with compute and by running
+// several workers. On a single core over tmpfs there is nothing to overlap,
+// and it runs 10-30% behind the sequential loop.
+
+#include "ImgProc.hpp"
+#include "bench_common.hpp"
+#include <cstdio>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static GrayImage process(RGBImage image) {
+    return image.toGray(ColorSpace::YCC).convolve(FixedKernel::gaussian<3>(), BorderMode::REPLICATE, 0, Narrowing::SATURATE);
+}
+
+int main(int argc, char** argv) {
+    std::string base = argc > 1 ? argv[1] : "/dev/shm";
+    int files = argc > 2 ? std::atoi(argv[2]) : 64;
+    int width = argc > 4 ? std::atoi(argv[3]) : 1280;
+    int height = argc > 4 ? std::atoi(argv[4]) : 720;
+    const int repeats = 3;
+
+    std::string in = base + "/imgproc_batch_in", out = base + "/imgproc_batch_out";
+    mkdir(in.c_str(), 0755);
+    mkdir(out.c_str(), 0755);
+
+    RGBImage rgb = noiseRGB(height, width, 42);
+
+    std::vector<std::string> inputs;
+    for (int i = 0; i < files; i++) {
+        inputs.push_back(in + "/frame" + std::to_string(i) + ".bmp");
+        rgb[0][0].rgbtRed = static_cast<uint8_t>(i);
+        rgb.toFile(inputs.back());
+    }
+    auto output = BatchProcessor::inDirectory(out);
+    double megabytes = files * (width * height * 3.0) / 1048576.0;
+
+    std::printf("%dx%d image, %d threads, %d files in %s\n", width, height, ThreadPool::instance().threadCount(), files, base.c_str());
+    std::printf("%-30s %10s %10s %9s\n", "pipeline", "files/s", "MB/s", "speedup");
+
+    double sequential = bestSeconds([&] {
+        for (const std::string& input : inputs) process(RGBImage::fromFile(input)).toFile(output(input));
+    }, repeats);
+    std::printf("%-30s %10.1f %10.1f %8.2fx\n", "sequential", files / sequential, megabytes / sequential, 1.0);
+
+    int hardware = std::max(static_cast<int>(std::thread::hardware_concurrency()), 1);
+    struct Setting {
+        int workers, maxInFlight;
+    };
+    std::vector<Setting> settings = { { hardware, 2 }, { hardware, 4 }, { hardware, 0 }, { 2 * hardware, 0 } };
+    for (const Setting& setting : settings) {
+        BatchOptions options;
+        options.workers = setting.workers;
+        options.maxInFlight = setting.maxInFlight;
+        BatchProcessor batch(options);
+        int failed = 0;
+        double seconds = bestSeconds([&] {
+            std::vector<BatchResult> results = batch.run(inputs, output, [](RGBImage image, const std::string&) {
+                return process(std::move(image));
+            });
+            failed = 0;
+            for (const BatchResult& result : results) failed += !result.ok;
+        }, repeats);
+
+        char name[64];
+        if (setting.maxInFlight) std::snprintf(name, sizeof(name), "batch %d workers, %d in flight", setting.workers, setting.maxInFlight);
+        else std::snprintf(name, sizeof(name), "batch %d workers", setting.workers);
+        std::printf("%-30s %10.1f %10.1f %8.2fx", name, files / seconds, megabytes / seconds, sequential / seconds);
+        if (failed) std::printf("   %d failed", failed);
+        std::printf("\n");
+    }
+
+    for (const std::string& input : inputs) {
+        std::remove(input.c_str());
+        std::remove(output(input).c_str());
+    }
+    rmdir(in.c_str());
+    rmdir(out.c_str());
+
+    return 0;
+}
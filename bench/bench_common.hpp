@@ -0,0 +1,92 @@
+// Timing, test image and JSON helpers shared by the programs in bench/
+
+#ifndef IMGPROC_BENCH_COMMON_HPP
+#define IMGPROC_BENCH_COMMON_HPP
+
+#include "ImgProc.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Seconds taken by one call of f
+template <typename F>
+inline double timeSeconds(F f) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+
+// The fastest of `repeats` calls of f, in seconds
+template <typename F>
+inline double bestSeconds(F f, int repeats) {
+    double best = 1e30;
+    for (int r = 0; r < repeats; r++) best = std::min(best, timeSeconds(f));
+    return best;
+}
+
+// Calls f until minTime seconds have passed, between minRuns and maxRuns
+// times, and returns the timings sorted from fastest to slowest
+template <typename F>
+inline std::vector<double> sampleSeconds(F f, double minTime, int minRuns, int maxRuns) {
+    std::vector<double> seconds;
+    double total = 0;
+    while (static_cast<int>(seconds.size()) < minRuns || (total < minTime && static_cast<int>(seconds.size()) < maxRuns)) {
+        seconds.push_back(timeSeconds(f));
+        total += seconds.back();
+    }
+    std::sort(seconds.begin(), seconds.end());
+    return seconds;
+}
+
+// Uniform random pixels, the same for a given seed in every program
+inline RGBImage noiseRGB(int height, int width, unsigned seed) {
+    std::mt19937 rng(seed);
+    RGBImage image(height, width, UNINITIALIZED);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            image[y][x] = { static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng()) };
+    return image;
+}
+
+inline GrayImage noiseGray(int height, int width, unsigned seed) {
+    std::mt19937 rng(seed);
+    GrayImage image(height, width, UNINITIALIZED);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            image[y][x] = static_cast<uint8_t>(rng());
+    return image;
+}
+
+// One timed operation, as written by writeBenchJson and read by compare.py
+struct BenchResult {
+    std::string name, size;
+    int width, height;
+    double pixels, bytes;   // Per run: elements processed and bytes read plus written
+    int runs;
+    double best, median;    // Seconds
+};
+
+// Schema 1: threads, whether IMGPROC_PROFILE was on, and one object per result
+inline void writeBenchJson(const std::string& path, const std::vector<BenchResult>& results, int threads, bool profiled) {
+    FILE* file = std::fopen(path.c_str(), "w");
+    if (!file) throw std::runtime_error("Cannot write " + path);
+
+    std::fprintf(file, "{\n  \"schema\": 1,\n  \"threads\": %d,\n  \"profiled\": %s,\n  \"results\": [\n", threads, profiled ? "true" : "false");
+    for (std::size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        std::fprintf(file,
+            "    {\"name\": \"%s\", \"size\": \"%s\", \"width\": %d, \"height\": %d, \"runs\": %d, "
+            "\"best_s\": %.9g, \"median_s\": %.9g, \"ns_per_pixel\": %.6g, \"gb_per_s\": %.6g}%s\n",
+            r.name.c_str(), r.size.c_str(), r.width, r.height, r.runs, r.best, r.median,
+            r.best * 1e9 / r.pixels, r.bytes / r.best / 1e9, i + 1 < results.size() ? "," : "");
+    }
+    std::fprintf(file, "  ]\n}\n");
+    std::fclose(file);
+}
+
+#endif
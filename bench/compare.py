@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+"""Compares two imgproc_bench JSON files operation by operation.
+
+    python3 compare.py before.json after.json [--threshold 5] [--metric best|median]
+
+Prints the ns/pixel of both runs and the change for every operation and
+size present in both. Exits with status 1 when any operation got slower by
+more than the threshold (in percent), so it can gate a pull request.
+"""
+
+import argparse
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        data = json.load(f)
+    if data.get("schema") != 1:
+        sys.exit(f"{path}: unsupported schema {data.get('schema')}")
+    return data
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("before")
+    parser.add_argument("after")
+    parser.add_argument("--threshold", type=float, default=5.0, help="percent slowdown reported as a regression (default 5)")
+    parser.add_argument("--metric", choices=("best", "median"), default="best", help="which timing to compare (default best)")
+    args = parser.parse_args()
+
+    before, after = load(args.before), load(args.after)
+    if before["threads"] != after["threads"]:
+        print(f"warning: {before['threads']} threads before, {after['threads']} after", file=sys.stderr)
+
+    key = args.metric + "_s"
+    old = {(r["name"], r["size"]): r for r in before["results"]}
+    regressions = 0
+
+    print(f"{'operation':<28} {'size':<4} {'before':>10} {'after':>10} {'change':>8}   (ns/pixel, {args.metric})")
+    for r in after["results"]:
+        o = old.pop((r["name"], r["size"]), None)
+        if o is None:
+            print(f"{r['name']:<28} {r['size']:<4} {'':>10} {r['ns_per_pixel'] * r[key] / r['best_s']:>10.3f}      not in before")
+            continue
+
+        # ns/pixel scales with the chosen timing; the pixel count is the same in both runs
+        before_ns = o["ns_per_pixel"] * o[key] / o["best_s"]
+        after_ns = r["ns_per_pixel"] * r[key] / r["best_s"]
+        change = (after_ns / before_ns - 1) * 100
+        mark = ""
+        if change > args.threshold:
+            mark = "  SLOWER"
+            regressions += 1
+        elif change < -args.threshold:
+            mark = "  faster"
+        print(f"{r['name']:<28} {r['size']:<4} {before_ns:>10.3f} {after_ns:>10.3f} {change:>+7.1f}%{mark}")
+
+    for name, size in old:
+        print(f"{name:<28} {size:<4} {'':>10} {'':>10}  not in after")
+
+    if regressions:
+        print(f"\n{regressions} operation(s) slower by more than {args.threshold:g}%")
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,69 @@
+// Compares Matrix::convolve and GrayImage::convolve against filtering with
+// submatrix(...).dot(kernel) at every interior pixel.
+//
+//     g++ -std=c++11 -O2 -pthread -I.. convolution_bench.cpp -o convolution_bench
+//     ./convolution_bench [image size]
+
+#include "ImgProc.hpp"
+#include "bench_common.hpp"
+#include <cmath>
+#include <cstdio>
+
+// How filters were written before the convolution engine; borders are skipped
+static Matrix dotFilter(const Matrix& image, const Matrix& kernel) {
+    Matrix result(image.height, image.width);
+    int ay = kernel.height / 2, ax = kernel.width / 2;
+
+    for (int y = ay; y + kernel.height - ay <= image.height; y++) {
+        for (int x = ax; x + kernel.width - ax <= image.width; x++) {
+            result[y][x] = image.submatrix(y - ay, x - ax, kernel.height, kernel.width).dot(kernel);
+        }
+    }
+
+    return result;
+}
+
+static Matrix gaussian(int size, double sigma) {
+    Matrix kernel(size, size);
+    double sum = 0;
+    for (int y = 0; y < size; y++) {
+        for (int x = 0; x < size; x++) {
+            double dy = y - size / 2, dx = x - size / 2;
+            kernel[y][x] = std::exp(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+            sum += kernel[y][x];
+        }
+    }
+    kernel *= 1.0 / sum;
+    return kernel;
+}
+
+int main(int argc, char** argv) {
+    int size = argc > 1 ? std::atoi(argv[1]) : 2048;
+
+    GrayImage image = noiseGray(size, size, 42);
+    Matrix matrix = image.toMatrix();
+
+    struct Case {
+        const char* name;
+        Matrix kernel;
+    };
+    Case cases[] = {
+        { "box 3x3 /16", Matrix{ { 1, 2, 1 }, { 2, 4, 2 }, { 1, 2, 1 } } * (1.0 / 16) },
+        { "sobel 3x3", Matrix{ { -1, 0, 1 }, { -2, 0, 2 }, { -1, 0, 1 } } },
+        { "laplace 3x3", Matrix{ { 0, 1, 0 }, { 1, -4, 1 }, { 0, 1, 0 } } },
+        { "gauss 7x7", gaussian(7, 1.5) },
+        { "gauss 15x15", gaussian(15, 3.0) },
+    };
+
+    std::printf("%dx%d image, %d threads\n", size, size, ThreadPool::instance().threadCount());
+    std::printf("%-12s %12s %12s %9s %12s %9s\n", "kernel", "dot ms", "Matrix ms", "speedup", "GrayImage ms", "speedup");
+    for (const Case& c : cases) {
+        int repeats = c.kernel.width > 7 ? 1 : 3;
+        double baseline = bestSeconds([&] { dotFilter(matrix, c.kernel); }, repeats);
+        double floating = bestSeconds([&] { matrix.convolve(c.kernel); }, 5);
+        double bytes = bestSeconds([&] { image.convolve(c.kernel); }, 5);
+        std::printf("%-12s %12.2f %12.2f %8.1fx %12.2f %8.1fx\n", c.name, baseline * 1e3, floating * 1e3, baseline / floating, bytes * 1e3, baseline / bytes);
+    }
+
+    return 0;
+}
@@ -0,0 +1,44 @@
+// Finds where FFT convolution overtakes direct convolution: times
+// Matrix::convolve and the forced FFT path for square kernels of growing
+// size, dense and separable. detail::FFT_CROSSOVER_TAPS comes from here.
+//
+//     g++ -std=c++11 -O2 -pthread -I.. fft_bench.cpp -o fft_bench
+//     ./fft_bench [image size]
+
+#include "ImgProc.hpp"
+#include "bench_common.hpp"
+#include <cstdio>
+#include <random>
+
+int main(int argc, char** argv) {
+    int size = argc > 1 ? std::atoi(argv[1]) : 1024;
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    Matrix image(size, size);
+    for (int y = 0; y < size; y++)
+        for (int x = 0; x < size; x++)
+            image[y][x] = uniform(rng) * 255;
+
+    std::printf("%dx%d image, %d threads\n", size, size, ThreadPool::instance().threadCount());
+    std::printf("%-7s %6s %12s %12s %9s %6s %12s %12s %9s\n", "kernel", "taps", "dense ms", "fft ms", "speedup", "taps", "separable ms", "fft ms", "speedup");
+    for (int k : { 3, 5, 7, 9, 11, 15, 21, 31, 45, 63 }) {
+        Matrix dense(k, k), column(k, 1), row(1, k);
+        for (int i = 0; i < k; i++) {
+            column[i][0] = uniform(rng);
+            row[0][i] = uniform(rng);
+            for (int j = 0; j < k; j++) dense[i][j] = uniform(rng);
+        }
+        Matrix separable = column * row;
+
+        int repeats = k > 15 ? 1 : 3;
+        double direct = bestSeconds([&] { image.convolve(dense); }, repeats);
+        double fft = bestSeconds([&] { detail::convolveFFT(image, dense, BorderMode::REPLICATE, 0); }, 3);
+        double directSeparable = bestSeconds([&] { image.convolve(separable); }, 3);
+        double fftSeparable = bestSeconds([&] { detail::convolveFFT(image, separable, BorderMode::REPLICATE, 0); }, 3);
+        std::printf("%2dx%-4d %6d %12.2f %12.2f %8.2fx %6d %12.2f %12.2f %8.2fx\n", k, k, k * k, direct * 1e3, fft * 1e3, direct / fft,
+                    2 * k, directSeparable * 1e3, fftSeparable * 1e3, directSeparable / fftSeparable);
+    }
+
+    return 0;
+}
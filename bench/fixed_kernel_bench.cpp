@@ -0,0 +1,48 @@
+// Compares convolve with runtime Matrix kernels against the FixedMatrix
+// overloads, for the kernels of FixedKernel.
+//
+//     g++ -std=c++11 -O2 -pthread -I.. fixed_kernel_bench.cpp -o fixed_kernel_bench
+//     ./fixed_kernel_bench [image size]
+
+#include "ImgProc.hpp"
+#include "bench_common.hpp"
+#include <cstdio>
+
+int main(int argc, char** argv) {
+    int size = argc > 1 ? std::atoi(argv[1]) : 2048;
+
+    GrayImage image = noiseGray(size, size, 42);
+    Matrix matrix = image.toMatrix();
+
+    struct Case {
+        const char* name;
+        Matrix kernel;
+        std::function<void()> fixedMatrix, fixedImage;
+    };
+    Case cases[] = {
+        { "sobel 3x3", FixedKernel::sobelX().toMatrix(),
+          [&] { matrix.convolve(FixedKernel::sobelX()); }, [&] { image.convolve(FixedKernel::sobelX()); } },
+        { "scharr 3x3", FixedKernel::scharrY().toMatrix(),
+          [&] { matrix.convolve(FixedKernel::scharrY()); }, [&] { image.convolve(FixedKernel::scharrY()); } },
+        { "laplace 3x3", FixedKernel::laplacian().toMatrix(),
+          [&] { matrix.convolve(FixedKernel::laplacian()); }, [&] { image.convolve(FixedKernel::laplacian()); } },
+        { "gauss 5x5", FixedKernel::gaussian<5>().toMatrix(),
+          [&] { matrix.convolve(FixedKernel::gaussian<5>()); }, [&] { image.convolve(FixedKernel::gaussian<5>()); } },
+        { "gauss 7x7", FixedKernel::gaussian<7>().toMatrix(),
+          [&] { matrix.convolve(FixedKernel::gaussian<7>()); }, [&] { image.convolve(FixedKernel::gaussian<7>()); } },
+    };
+
+    std::printf("%dx%d image, %d threads\n", size, size, ThreadPool::instance().threadCount());
+    std::printf("%-12s %11s %11s %9s %11s %11s %9s\n", "kernel", "Matrix ms", "fixed ms", "speedup", "Gray ms", "fixed ms", "speedup");
+    for (const Case& c : cases) {
+        double matrixRuntime = bestSeconds([&] { matrix.convolve(c.kernel); }, 5);
+        double matrixFixed = bestSeconds(c.fixedMatrix, 5);
+        double imageRuntime = bestSeconds([&] { image.convolve(c.kernel); }, 5);
+        double imageFixed = bestSeconds(c.fixedImage, 5);
+        std::printf("%-12s %11.2f %11.2f %8.1fx %11.2f %11.2f %8.1fx\n", c.name,
+                    matrixRuntime * 1e3, matrixFixed * 1e3, matrixRuntime / matrixFixed,
+                    imageRuntime * 1e3, imageFixed * 1e3, imageRuntime / imageFixed);
+    }
+
+    return 0;
+}
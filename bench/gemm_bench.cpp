@@ -0,0 +1,67 @@
+// Compares the blocked Matrix::operator* against the original triple loop.
+//
+//     g++ -std=c++11 -O2 -pthread -I.. gemm_bench.cpp -o gemm_bench
+//     ./gemm_bench [max size]
+
+#include "ImgProc.hpp"
+#include "bench_common.hpp"
+#include <cmath>
+#include <cstdio>
+#include <random>
+
+// The implementation Matrix::operator* shipped with before the GEMM engine
+static Matrix naiveMultiply(const Matrix& a, const Matrix& b) {
+    Matrix result(a.height, b.width);
+
+    for (int y = 0; y < a.height; y++) {
+        for (int x = 0; x < b.width; x++) {
+            double sum = 0;
+            for (int i = 0; i < a.width; i++) {
+                sum += a[y][i] * b[i][x];
+            }
+            result[y][x] = sum;
+        }
+    }
+
+    return result;
+}
+
+static Matrix randomMatrix(int height, int width, std::mt19937& rng) {
+    std::uniform_real_distribution<double> dist(-1.0, 1.0);
+    Matrix matrix(height, width);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            matrix[y][x] = dist(rng);
+    return matrix;
+}
+
+int main(int argc, char** argv) {
+    int maxSize = argc > 1 ? std::atoi(argv[1]) : 1024;
+    std::mt19937 rng(42);
+
+    std::printf("%6s %12s %12s %9s %12s\n", "size", "naive GF/s", "gemm GF/s", "speedup", "max rel err");
+    for (int n = 16; n <= maxSize; n *= 2) {
+        Matrix a = randomMatrix(n, n, rng);
+        Matrix b = randomMatrix(n, n, rng);
+        Matrix expected(0, 0), actual(0, 0);
+
+        int repeats = n <= 256 ? 5 : 1;
+        double naive = bestSeconds([&] { expected = naiveMultiply(a, b); }, repeats);
+        double gemm = bestSeconds([&] { actual = a * b; }, repeats);
+
+        // Error relative to sum_k |a_ik * b_kj|, the quantity the documented bound scales with
+        double maxError = 0;
+        for (int y = 0; y < n; y++) {
+            for (int x = 0; x < n; x++) {
+                double magnitude = 0;
+                for (int i = 0; i < n; i++) magnitude += std::fabs(a[y][i] * b[i][x]);
+                if (magnitude > 0) maxError = std::max(maxError, std::fabs(actual[y][x] - expected[y][x]) / magnitude);
+            }
+        }
+
+        double flops = 2.0 * n * n * n;
+        std::printf("%6d %12.2f %12.2f %8.1fx %12.3g\n", n, flops / naive * 1e-9, flops / gemm * 1e-9, naive / gemm, maxError);
+    }
+
+    return 0;
+}
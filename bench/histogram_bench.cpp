@@ -0,0 +1,54 @@
+// Histogram throughput in GB/s against a single-bin loop over GrayImage rows,
+// on random frames and on constant ones, where every increment hits one bin.
+//
+//     g++ -std=c++11 -O2 -pthread -I.. histogram_bench.cpp -o histogram_bench
+//     ./histogram_bench [image size]
+
+#include "ImgProc.hpp"
+#include "bench_common.hpp"
+#include <cstdio>
+
+static volatile uint64_t sink;     // Keeps the naive loop from being optimized away
+
+// How histograms were written before Histogram
+static std::array<uint64_t, 256> naiveHistogram(const GrayImage& image) {
+    std::array<uint64_t, 256> bins = {};
+    for (int y = 0; y < image.height; y++)
+        for (int x = 0; x < image.width; x++)
+            bins[image[y][x]]++;
+    return bins;
+}
+
+int main(int argc, char** argv) {
+    int size = argc > 1 ? std::atoi(argv[1]) : 4096;
+    double bytes = static_cast<double>(size) * size;
+
+    GrayImage noise = noiseGray(size, size, 42), flat(size, size);
+    RGBImage color = noiseRGB(size, size, 43);
+    for (int y = 0; y < size; y++)
+        std::fill(flat[y].begin(), flat[y].end(), 128);
+
+    std::printf("%dx%d image, %d threads\n", size, size, ThreadPool::instance().threadCount());
+    std::printf("%-18s %10s %10s %10s %10s %9s\n", "case", "naive ms", "GB/s", "ms", "GB/s", "speedup");
+
+    struct Case {
+        const char* name;
+        const GrayImage& image;
+    };
+    for (const Case& c : { Case{ "gray random", noise }, Case{ "gray constant", flat } }) {
+        double naive = bestSeconds([&] { sink = naiveHistogram(c.image)[c.image[0][0]]; }, 5);
+        double fast = bestSeconds([&] { Histogram histogram(c.image); }, 5);
+        std::printf("%-18s %10.2f %10.2f %10.2f %10.2f %8.1fx\n", c.name, naive * 1e3, bytes / naive * 1e-9, fast * 1e3, bytes / fast * 1e-9, naive / fast);
+    }
+
+    double channel = bestSeconds([&] { Histogram histogram(color, Channel::GREEN); }, 5);
+    std::printf("%-18s %10s %10s %10.2f %10.2f\n", "rgb green channel", "", "", channel * 1e3, bytes / channel * 1e-9);
+
+    GrayImage work = noise;
+    double equalize = bestSeconds([&] { work.equalize(); }, 5);
+    std::printf("%-18s %10s %10s %10.2f %10.2f\n", "equalize", "", "", equalize * 1e3, bytes / equalize * 1e-9);
+    double otsu = bestSeconds([&] { work.threshold(Histogram(work).otsuThreshold()); }, 5);
+    std::printf("%-18s %10s %10s %10.2f %10.2f\n", "otsu threshold", "", "", otsu * 1e3, bytes / otsu * 1e-9);
+
+    return 0;
+}
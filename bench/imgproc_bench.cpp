@@ -0,0 +1,251 @@
+// Times the ImgProc.hpp operations on synthetic images from VGA to 8K and
+// reports ns/pixel and GB/s, as a table and optionally as JSON. Two JSON
+// runs are compared with compare.py:
+//
+//     g++ -std=c++11 -O2 -pthread -I.. imgproc_bench.cpp -o imgproc_bench
+//     ./imgproc_bench --sizes vga,fhd --json before.json
+//     ./imgproc_bench --sizes vga,fhd --json after.json
+//     python3 compare.py before.json after.json
+//
+// Options:
+//     --sizes list    vga, hd, fhd, 4k and 8k, comma separated (default vga,hd,fhd,4k)
+//     --filter text   only operations whose name contains text
+//     --min-time s    repeat each operation for at least s seconds (default 0.25)
+//     --repeats n     but at most n times, and at least 3 (default 20)
+//     --dir path      where fromFile/toFile write, ideally tmpfs (default /dev/shm, else .)
+//     --json path     also write the results as JSON
+//     --trace path    with IMGPROC_PROFILE, write a Chrome trace of every call
+//
+// The same suite built with -DIMGPROC_PROFILE (imgproc_bench_profiled in the
+// CMake build) measures what the instrumentation costs: compare its JSON with
+// that of the plain build, and read the ns/pixel of "Profiler scope" as ns per
+// instrumented call. On a single-core VM one call cost about 100 ns, 160 ns
+// while tracing. The cheapest operation here, getChannel at VGA, takes 37 us,
+// so the overhead stays under 0.3% and compare.py sees only noise; it matters
+// only for calls on tiny matrices, such as dot on a 3x3 submatrix.
+
+#include "ImgProc.hpp"
+#include "bench_common.hpp"
+#include <cstdio>
+
+struct SizeSpec {
+    const char* name;
+    int width, height;
+};
+
+static const SizeSpec SIZES[] = {
+    { "vga", 640, 480 },
+    { "hd", 1280, 720 },
+    { "fhd", 1920, 1080 },
+    { "4k", 3840, 2160 },
+    { "8k", 7680, 4320 },
+};
+
+struct Options {
+    std::vector<SizeSpec> sizes;
+    std::string filter;
+    double minTime = 0.25;
+    int repeats = 20;
+    std::string dir = "/dev/shm";
+    std::string json;
+    std::string trace;
+};
+
+// Cheap deterministic noise, so that generating 8K test images takes no time
+struct Noise {
+    uint32_t state = 2463534242u;
+    uint8_t operator()() noexcept {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return static_cast<uint8_t>(state >> 24);
+    }
+};
+
+class Suite {
+public:
+    explicit Suite(const Options& options) : options(options) {}
+
+    // Runs fn once to warm up and then until minTime has passed, between 3 and
+    // options.repeats times
+    template <typename F>
+    void run(const SizeSpec& size, const std::string& name, double pixels, double bytes, F fn) {
+        if (name.find(options.filter) == std::string::npos) return;
+
+        fn();
+        std::vector<double> seconds = sampleSeconds(fn, options.minTime, 3, options.repeats);
+
+        BenchResult r = { name, size.name, size.width, size.height, pixels, bytes, static_cast<int>(seconds.size()), seconds.front(), seconds[seconds.size() / 2] };
+        std::printf("%-28s %-4s %6d %10.3f %10.3f %9.2f\n", r.name.c_str(), r.size.c_str(), r.runs, r.best * 1e3, r.best * 1e9 / r.pixels, r.bytes / r.best / 1e9);
+        std::fflush(stdout);
+        results.push_back(r);
+    }
+
+    void writeJson(const std::string& path) const {
+        writeBenchJson(path, results, ThreadPool::instance().threadCount(), Profiler::enabled);
+    }
+
+private:
+    const Options& options;
+    std::vector<BenchResult> results;
+};
+
+// Keeps the compiler from dropping results that are never used
+static volatile double sink;
+
+static void benchSize(Suite& suite, const SizeSpec& size, const Options& options) {
+    int h = size.height, w = size.width;
+    double p = static_cast<double>(h) * w;
+
+    Noise noise;
+    RGBImage rgb(h, w);
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+            rgb[y][x] = { noise(), noise(), noise() };
+    GrayImage gray = rgb.getChannel(Channel::GREEN);
+    GrayImage blue = rgb.getChannel(Channel::BLUE), red = rgb.getChannel(Channel::RED);
+
+    // File I/O
+    std::string rgbPath = options.dir + "/imgproc_bench_rgb.bmp", grayPath = options.dir + "/imgproc_bench_gray.bmp";
+    RGBImage rgbFile = rgb;
+    GrayImage grayFile = gray;
+    suite.run(size, "RGBImage::toFile", p, 3 * p, [&] { rgbFile.toFile(rgbPath); });
+    suite.run(size, "RGBImage::fromFile", p, 3 * p, [&] { RGBImage::fromFile(rgbPath); });
+    suite.run(size, "GrayImage::toFile", p, p, [&] { grayFile.toFile(grayPath); });
+    suite.run(size, "GrayImage::fromFile", p, p, [&] { GrayImage::fromFile(grayPath); });
+    std::remove(rgbPath.c_str());
+    std::remove(grayPath.c_str());
+
+    // Color and channels
+    suite.run(size, "toGray HSI", p, 4 * p, [&] { rgb.toGray(ColorSpace::HSI); });
+    suite.run(size, "toGray YCC", p, 4 * p, [&] { rgb.toGray(ColorSpace::YCC); });
+    suite.run(size, "getChannel", p, 4 * p, [&] { rgb.getChannel(Channel::GREEN); });
+    suite.run(size, "fromGrays", p, 6 * p, [&] { RGBImage::fromGrays(blue, gray, red); });
+    suite.run(size, "GrayImage::toMatrix", p, 9 * p, [&] { gray.toMatrix(); });
+
+    // Matrix operators; b equals a, so == compares every element
+    Matrix a = gray.toMatrix();
+    Matrix b = a;
+    suite.run(size, "GrayImage::fromMatrix", p, 9 * p, [&] { GrayImage::fromMatrix(a); });
+    suite.run(size, "Matrix a + b", p, 24 * p, [&] { Matrix c = a + b; });
+    suite.run(size, "Matrix a - b", p, 24 * p, [&] { Matrix c = a - b; });
+    suite.run(size, "Matrix -a", p, 16 * p, [&] { Matrix c = -a; });
+    suite.run(size, "Matrix a + s", p, 16 * p, [&] { Matrix c = a + 1.0; });
+    suite.run(size, "Matrix a - s", p, 16 * p, [&] { Matrix c = a - 1.0; });
+    suite.run(size, "Matrix a * s", p, 16 * p, [&] { Matrix c = a * 0.5; });
+    suite.run(size, "Matrix 2 * a - b + 1", p, 24 * p, [&] { Matrix c = 2.0 * a - b + 1.0; });
+    suite.run(size, "Matrix a == b", p, 16 * p, [&] { sink = a == b; });
+    suite.run(size, "Matrix dot", p, 16 * p, [&] { sink = a.dot(b); });
+    suite.run(size, "Matrix a += b", p, 24 * p, [&] { a += b; });
+    suite.run(size, "Matrix a -= b", p, 24 * p, [&] { a -= b; });
+    suite.run(size, "Matrix a += s", p, 16 * p, [&] { a += 1.0; });
+    suite.run(size, "Matrix a -= s", p, 16 * p, [&] { a -= 1.0; });
+    suite.run(size, "Matrix a *= s", p, 16 * p, [&] { a *= 1.0; });
+    suite.run(size, "Matrix transpose", p, 16 * p, [&] { a.transpose(); });
+    double quarter = static_cast<double>(h / 2) * (w / 2);
+    suite.run(size, "Matrix submatrix eval", quarter, 16 * quarter, [&] { a.submatrix(h / 4, w / 4, h / 2, w / 2).eval(); });
+
+    // The product is cubic, so it runs on at most 1024 x 1024 of the image;
+    // pixels are output elements and bytes the operands and the result
+    int n = std::min(std::min(h, w), 1024);
+    Matrix left = a.submatrix(0, 0, n, n).eval(), right = b.submatrix(0, 0, n, n).T();
+    double squared = static_cast<double>(n) * n;
+    suite.run(size, "Matrix a * b (n<=1024)", squared, 24 * squared, [&] { Matrix c = left * right; });
+    suite.run(size, "Matrix a *= b (n<=1024)", squared, 24 * squared, [&] { Matrix c = left; c *= right; });
+
+    // Outlines: render copies the image, draw paints a batch in place
+    OutlineRenderer renderer(rgb);
+    renderer.setShape(ShapeType::RECTANGLE).setPos(h / 8, w / 8).setDimensions(h * 3 / 4, w * 3 / 4).setThickness(4).setColor({ 0, 255, 0 });
+    suite.run(size, "OutlineRenderer::render", p, 6 * p, [&] { renderer.render(); });
+
+    std::vector<Shape> shapes;
+    double painted = 0;
+    for (int i = 0; i < 500; i++) {
+        int y = static_cast<int>(noise()) * h / 256, x = static_cast<int>(noise()) * w / 256;
+        Shape shape = i % 5 == 4 ? Shape::circle(y, x, 10 + noise() / 4, { 255, 0, 0 }, 2)
+                                 : Shape::rectangle(y, x, 20 + noise(), 20 + noise(), { 0, 0, 255 }, 2);
+        painted += detail::outlinePixels(shape);
+        shapes.push_back(shape);
+    }
+    suite.run(size, "OutlineRenderer::draw 500", p, 3 * painted, [&] { OutlineRenderer::draw(rgb, shapes); });
+
+#ifdef IMGPROC_PROFILE
+    // An empty instrumented scope, 1000 times; ns/pixel is ns per call
+    suite.run(size, "Profiler scope", 1000, 0, [] {
+        for (int i = 0; i < 1000; i++) {
+            IMGPROC_PROFILE_SCOPE("Profiler scope", 0);
+        }
+    });
+#endif
+}
+
+static bool parseOptions(int argc, char** argv, Options& options) {
+    std::string sizes = "vga,hd,fhd,4k";
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        if (arg == "--sizes") sizes = value;
+        else if (arg == "--filter") options.filter = value;
+        else if (arg == "--min-time") options.minTime = std::atof(value.c_str());
+        else if (arg == "--repeats") options.repeats = std::atoi(value.c_str());
+        else if (arg == "--dir") options.dir = value;
+        else if (arg == "--json") options.json = value;
+        else if (arg == "--trace") options.trace = value;
+        else return false;
+    }
+
+    std::size_t start = 0;
+    while (start <= sizes.size()) {
+        std::size_t comma = std::min(sizes.find(',', start), sizes.size());
+        std::string name = sizes.substr(start, comma - start);
+        bool found = false;
+        for (const SizeSpec& size : SIZES)
+            if (name == size.name) options.sizes.push_back(size), found = true;
+        if (!found) return false;
+        start = comma + 1;
+    }
+
+    return true;
+}
+
+static bool writable(const std::string& dir) {
+    std::string probe = dir + "/imgproc_bench_probe";
+    FILE* file = std::fopen(probe.c_str(), "w");
+    if (!file) return false;
+    std::fclose(file);
+    std::remove(probe.c_str());
+    return true;
+}
+
+int main(int argc, char** argv) {
+    Options options;
+    if (!parseOptions(argc, argv, options)) {
+        std::fprintf(stderr, "usage: %s [--sizes vga,hd,fhd,4k,8k] [--filter text] [--min-time s] [--repeats n] [--dir path] [--json path] [--trace path]\n", argv[0]);
+        return 2;
+    }
+    if (!writable(options.dir)) options.dir = ".";
+
+    std::printf("%d threads, files in %s%s\n", ThreadPool::instance().threadCount(), options.dir.c_str(), Profiler::enabled ? ", profiled" : "");
+    std::printf("%-28s %-4s %6s %10s %10s %9s\n", "operation", "size", "runs", "best ms", "ns/pixel", "GB/s");
+
+    Suite suite(options);
+    if (!options.trace.empty()) Profiler::instance().startTrace();
+    for (const SizeSpec& size : options.sizes) benchSize(suite, size, options);
+    if (!options.json.empty()) suite.writeJson(options.json);
+    if (!options.trace.empty()) {
+        Profiler::instance().stopTrace();
+        Profiler::instance().writeTrace(options.trace);
+    }
+
+    // What the instrumentation itself saw, over all sizes and repeats
+    if (Profiler::enabled) {
+        std::printf("\n%-28s %8s %10s %8s %10s %10s\n", "profiled operation", "calls", "MB", "allocs", "total ms", "max ms");
+        for (const OperationStats& s : Profiler::instance().stats()) {
+            std::printf("%-28s %8llu %10.1f %8llu %10.2f %10.3f\n", s.name.c_str(), static_cast<unsigned long long>(s.calls), s.bytes / 1e6,
+                static_cast<unsigned long long>(s.allocations), s.totalSeconds * 1e3, s.maxSeconds * 1e3);
+        }
+    }
+
+    return 0;
+}
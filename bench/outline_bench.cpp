@@ -0,0 +1,69 @@
+// Annotates a frame with detection boxes and circles: the OutlineRenderer
+// builder, which copies the frame for every shape, the old per-pixel
+// loops drawing in place, and one batched OutlineRenderer::draw call.
+//
+//     g++ -std=c++11 -O2 -pthread -I.. outline_bench.cpp -o outline_bench
+//     ./outline_bench [shapes] [thickness]
+
+#include "ImgProc.hpp"
+#include "bench_common.hpp"
+#include <cstdio>
+#include <random>
+
+// How shapes were rasterized before the span renderer: every pixel of the
+// box, or of the circle's bounding square, is tested
+static void pixelLoops(RGBImage& image, const Shape& s) {
+    if (s.type == ShapeType::RECTANGLE) {
+        for (int y = std::max(s.y, 0); y < std::min(s.y + s.height, image.height); y++)
+            for (int x = std::max(s.x, 0); x < std::min(s.x + s.width, image.width); x++)
+                if (y - s.y < s.thickness || x - s.x < s.thickness || s.y + s.height - 1 - y < s.thickness || s.x + s.width - 1 - x < s.thickness)
+                    image[y][x] = s.color;
+    } else {
+        int inner = s.radius - s.thickness;
+        for (int y = s.y - s.radius; y <= s.y + s.radius; y++)
+            for (int x = s.x - s.radius; x <= s.x + s.radius; x++) {
+                if (y < 0 || y >= image.height || x < 0 || x >= image.width) continue;
+                int d = (y - s.y) * (y - s.y) + (x - s.x) * (x - s.x);
+                if (d <= s.radius * s.radius && !(inner >= 0 && d <= inner * inner)) image[y][x] = s.color;
+            }
+    }
+}
+
+int main(int argc, char** argv) {
+    int count = argc > 1 ? std::atoi(argv[1]) : 500;
+    int thickness = argc > 2 ? std::atoi(argv[2]) : 2;
+    int height = 1080, width = 1920;
+
+    RGBImage frame = noiseRGB(height, width, 42);
+
+    std::mt19937 rng(43);
+    std::vector<Shape> shapes;
+    for (int i = 0; i < count; i++) {
+        RGBTRIPLE color = { static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng()), static_cast<uint8_t>(rng()) };
+        int y = static_cast<int>(rng() % height), x = static_cast<int>(rng() % width);
+        if (i % 5 == 4) shapes.push_back(Shape::circle(y, x, 10 + static_cast<int>(rng() % 60), color, thickness));
+        else shapes.push_back(Shape::rectangle(y, x, 20 + static_cast<int>(rng() % 200), 20 + static_cast<int>(rng() % 200), color, thickness));
+    }
+
+    RGBImage target = frame;
+    double builder = bestSeconds([&] {
+        OutlineRenderer renderer(frame);
+        RGBImage annotated;
+        for (const Shape& s : shapes) {
+            renderer.setShape(s.type).setPos(s.y, s.x).setColor(s.color).setThickness(s.thickness);
+            if (s.type == ShapeType::RECTANGLE) renderer.setDimensions(s.height, s.width);
+            else renderer.setRadius(s.radius);
+            annotated = renderer.render();
+        }
+    }, 1);
+    double loops = bestSeconds([&] { for (const Shape& s : shapes) pixelLoops(target, s); }, 5);
+    double batch = bestSeconds([&] { OutlineRenderer::draw(target, shapes); }, 5);
+
+    std::printf("%dx%d image, %d threads, %d shapes, thickness %d\n", width, height, ThreadPool::instance().threadCount(), count, thickness);
+    std::printf("%-24s %10s %9s\n", "method", "ms", "speedup");
+    std::printf("%-24s %10.2f %8.1fx\n", "builder, copy per shape", builder * 1e3, 1.0);
+    std::printf("%-24s %10.2f %8.1fx\n", "pixel loops, in place", loops * 1e3, builder / loops);
+    std::printf("%-24s %10.2f %8.1fx\n", "draw batch, in place", batch * 1e3, builder / batch);
+
+    return 0;
+}
@@ -0,0 +1,57 @@
+// Times the row-parallel operations with 1, 2, 4, ... threads of the pool.
+//
+//     g++ -std=c++11 -O2 -pthread -I.. parallel_bench.cpp -o parallel_bench
+//     ./parallel_bench [max threads] [image size]
+
+#include "ImgProc.hpp"
+#include "bench_common.hpp"
+#include <cstdio>
+
+int main(int argc, char** argv) {
+    int maxThreads = argc > 1 ? std::atoi(argv[1]) : static_cast<int>(std::thread::hardware_concurrency());
+    int size = argc > 2 ? std::atoi(argv[2]) : 4096;
+    maxThreads = std::max(maxThreads, 1);
+
+    RGBImage image = noiseRGB(size, size, 42);
+    GrayImage gray = image.toGray(ColorSpace::YCC);
+    Matrix matrix = gray.toMatrix();
+
+    int n = std::min(size, 1024);
+    Matrix a = matrix.submatrix(0, 0, n, n).eval();
+    Matrix b = a.T();
+
+    struct Case {
+        const char* name;
+        std::function<void()> run;
+    };
+    Case cases[] = {
+        { "toGray YCC", [&] { image.toGray(ColorSpace::YCC); } },
+        { "getChannel", [&] { image.getChannel(Channel::GREEN); } },
+        { "fromGrays", [&] { RGBImage::fromGrays(gray, gray, gray); } },
+        { "toMatrix", [&] { gray.toMatrix(); } },
+        { "fromMatrix", [&] { GrayImage::fromMatrix(matrix); } },
+        { "2*m - m + 1", [&] { Matrix m = 2.0 * matrix - matrix + 1.0; } },
+        { "m *= 0.5", [&] { matrix *= 0.5; } },
+        { "gemm", [&] { Matrix c = a * b; } },
+    };
+
+    std::printf("%dx%d image, %dx%d gemm\n%-12s", size, size, n, n, "threads");
+    for (int t = 1; t <= maxThreads; t *= 2) std::printf(" %9d", t);
+    std::printf("   (ms, speedup vs 1 thread)\n");
+
+    for (const Case& c : cases) {
+        std::printf("%-12s", c.name);
+        double serial = 0;
+        for (int t = 1; t <= maxThreads; t *= 2) {
+            ThreadPool::instance().setThreadCount(t);
+            c.run();    // Warm up the pool and the caches
+            double seconds = bestSeconds(c.run, 5);
+            if (t == 1) serial = seconds;
+            std::printf(" %9.2f", seconds * 1e3);
+            if (t > 1) std::printf("/%.1fx", serial / seconds);
+        }
+        std::printf("\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,39 @@
+// Compares the double Matrix path with MatrixT<float> for the conversions and
+// element-wise arithmetic of a typical floating-point pipeline stage.
+//
+//     g++ -std=c++11 -O2 -pthread -I.. types_bench.cpp -o types_bench
+//     ./types_bench [image size]
+
+#include "ImgProc.hpp"
+#include "bench_common.hpp"
+#include <cstdio>
+
+int main(int argc, char** argv) {
+    int size = argc > 1 ? std::atoi(argv[1]) : 4096;
+
+    GrayImage image = noiseGray(size, size, 42);
+    Matrix wide = image.toMatrix();
+    MatrixT<float> narrow = image.toMatrix<float>();
+
+    struct Case {
+        const char* name;
+        std::function<void()> wide, narrow;
+    };
+    Case cases[] = {
+        { "toMatrix", [&] { image.toMatrix(); }, [&] { image.toMatrix<float>(); } },
+        { "fromMatrix", [&] { GrayImage::fromMatrix(wide, Narrowing::SATURATE); }, [&] { GrayImage::fromMatrix(narrow, Narrowing::SATURATE); } },
+        { "2*m - m + 1", [&] { Matrix m = 2.0 * wide - wide + 1.0; }, [&] { MatrixT<float> m = 2.0f * narrow - narrow + 1.0f; } },
+        { "m *= 0.5", [&] { wide *= 0.5; }, [&] { narrow *= 0.5f; } },
+        { "dot", [&] { volatile double d = wide.dot(wide); (void)d; }, [&] { volatile double d = narrow.dot(narrow); (void)d; } },
+    };
+
+    std::printf("%dx%d image, %d threads\n", size, size, ThreadPool::instance().threadCount());
+    std::printf("%-12s %12s %12s %9s\n", "operation", "double ms", "float ms", "speedup");
+    for (const Case& c : cases) {
+        double slow = bestSeconds(c.wide, 5);
+        double fast = bestSeconds(c.narrow, 5);
+        std::printf("%-12s %12.2f %12.2f %8.1fx\n", c.name, slow * 1e3, fast * 1e3, slow / fast);
+    }
+
+    return 0;
+}
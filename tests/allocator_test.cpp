@@ -0,0 +1,69 @@
+// Checks that buffers go back to the allocator that issued them, also when
+// a copy assignment fails to allocate: the target must keep its old
+// contents and release them exactly once, to the right allocator.
+
+#include "ImgProc.hpp"
+#include "test_common.hpp"
+#include <set>
+
+// Counts its blocks and refuses every allocation while `failing` is set
+struct CountingAllocator : BufferAllocator {
+    std::set<void*> live;
+    int foreign = 0;        // Blocks given back that it never issued
+    bool failing = false;
+
+    void* allocate(std::size_t bytes) override {
+        if (failing) throw std::bad_alloc();
+        void* block = detail::alignedAllocate(bytes);
+        live.insert(block);
+        return block;
+    }
+    void deallocate(void* p, std::size_t) noexcept override {
+        if (live.erase(p)) detail::alignedFree(p);
+        else foreign++;
+    }
+};
+
+int main() {
+    CountingAllocator counting;
+    {
+        AllocatorScope scope(counting);
+        GrayImage small(2, 3), big(20, 30);
+        small[1][2] = 7;
+        CHECK(counting.live.size() == 2);
+
+        // Fails to grow: small is unchanged and still owns its block
+        counting.failing = true;
+        bool threw = false;
+        try {
+            small = big;
+        } catch (const std::bad_alloc&) {
+            threw = true;
+        }
+        counting.failing = false;
+        CHECK_MESSAGE(threw, "copy assignment did not report the failed allocation");
+        CHECK(small.height == 2 && small.width == 3 && small[1][2] == 7);
+        CHECK(counting.live.size() == 2);
+
+        // Same size: copied into the existing block
+        GrayImage other(2, 3);
+        other = small;
+        CHECK(other[1][2] == 7 && counting.live.size() == 3);
+
+        small = big;
+        CHECK(small.height == 20 && counting.live.size() == 3);
+    }
+    CHECK_MESSAGE(counting.live.empty() && counting.foreign == 0, "%zu blocks leaked, %d freed to the wrong allocator", counting.live.size(), counting.foreign);
+
+    // A buffer outlives the scope it was allocated in and still goes home
+    CountingAllocator outer;
+    Matrix kept(1, 1);
+    {
+        AllocatorScope scope(outer);
+        kept = Matrix(5, 5, 1.0);
+    }
+    kept = Matrix(6, 6);
+    CHECK(outer.live.empty() && outer.foreign == 0);
+
+    return testResult();
+}
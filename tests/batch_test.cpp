@@ -0,0 +1,115 @@
+// Runs BatchProcessor over small BMP files in the working directory, with
+// missing and corrupt inputs, a process and an output callable that throw
+// for one file each, and in-flight caps from 1 up. Every result must come
+// back in input order with the right error, and every written file must
+// hold the processed image.
+
+#include "ImgProc.hpp"
+#include "test_common.hpp"
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char* const IN = "batch_test_in";
+static const char* const OUT = "batch_test_out";
+static const int FILES = 24;
+
+static RGBImage pattern(int i) {
+    RGBImage image(20 + i, 30 + i);
+    for (int y = 0; y < image.height; y++)
+        for (int x = 0; x < image.width; x++)
+            image[y][x] = { static_cast<uint8_t>(x + i), static_cast<uint8_t>(y * 3), static_cast<uint8_t>(x * y + i) };
+    return image;
+}
+
+static std::string inputPath(int i) {
+    return std::string(IN) + "/image" + std::to_string(i) + ".bmp";
+}
+
+static bool contains(const std::string& text, const std::string& part) {
+    return text.find(part) != std::string::npos;
+}
+
+static void checkRun(const BatchOptions& options, const std::vector<std::string>& inputs) {
+    BatchProcessor batch(options);
+    // image5 fails in process and image9 in output; the rest become gray
+    std::vector<BatchResult> results = batch.run(inputs, [](const std::string& input) {
+        if (contains(input, "image9.")) throw std::runtime_error("no output for image9");
+        return std::string(OUT) + input.substr(input.find_last_of('/'));
+    }, [](RGBImage image, const std::string& input) {
+        if (contains(input, "image5.")) throw std::runtime_error("cannot process image5");
+        return image.toGray(ColorSpace::YCC);
+    });
+
+    char label[96];
+    std::snprintf(label, sizeof(label), "readers %d, workers %d, writers %d, maxInFlight %d", options.readers, options.workers, options.writers, options.maxInFlight);
+    CHECK_MESSAGE(results.size() == inputs.size(), "%s: %zu results for %zu inputs", label, results.size(), inputs.size());
+    if (results.size() != inputs.size()) return;
+
+    for (std::size_t i = 0; i < inputs.size(); i++) {
+        const BatchResult& result = results[i];
+        const std::string& input = inputs[i];
+        CHECK_MESSAGE(result.input == input, "%s: result %zu is for %s, not %s", label, i, result.input.c_str(), input.c_str());
+
+        if (contains(input, "missing")) {
+            CHECK_MESSAGE(!result.ok && contains(result.error, "Failed to open"), "%s: %s: ok %d, error '%s'", label, input.c_str(), result.ok, result.error.c_str());
+        } else if (contains(input, "corrupt")) {
+            CHECK_MESSAGE(!result.ok && contains(result.error, "Not a BMP"), "%s: %s: ok %d, error '%s'", label, input.c_str(), result.ok, result.error.c_str());
+        } else if (contains(input, "image5.")) {
+            CHECK_MESSAGE(!result.ok && result.error == "cannot process image5", "%s: %s: ok %d, error '%s'", label, input.c_str(), result.ok, result.error.c_str());
+        } else if (contains(input, "image9.")) {
+            CHECK_MESSAGE(!result.ok && result.error == "no output for image9", "%s: %s: ok %d, error '%s'", label, input.c_str(), result.ok, result.error.c_str());
+        } else {
+            CHECK_MESSAGE(result.ok && result.error.empty(), "%s: %s failed: %s", label, input.c_str(), result.error.c_str());
+            if (!result.ok) continue;
+
+            int index = std::atoi(input.c_str() + input.find("image") + 5);
+            GrayImage expected = pattern(index).toGray(ColorSpace::YCC);
+            GrayImage written = GrayImage::fromFile(result.output);
+            bool same = written.height == expected.height && written.width == expected.width;
+            for (int y = 0; same && y < expected.height; y++)
+                for (int x = 0; x < expected.width; x++) same = same && written[y][x] == expected[y][x];
+            CHECK_MESSAGE(same, "%s: %s does not hold the processed image", label, result.output.c_str());
+            std::remove(result.output.c_str());
+        }
+    }
+}
+
+int main() {
+    mkdir(IN, 0755);
+    mkdir(OUT, 0755);
+
+    std::vector<std::string> inputs;
+    for (int i = 0; i < FILES; i++) {
+        pattern(i).toFile(inputPath(i));
+        inputs.push_back(inputPath(i));
+    }
+    std::string missing = std::string(IN) + "/missing.bmp", corrupt = std::string(IN) + "/corrupt.bmp";
+    FILE* file = std::fopen(corrupt.c_str(), "wb");
+    std::fputs("not an image", file);
+    std::fclose(file);
+    inputs.insert(inputs.begin() + 3, missing);
+    inputs.insert(inputs.begin() + 11, corrupt);
+
+    for (int cap : { 1, 2, 3, 8, 0 }) {
+        for (int workers : { 1, 4 }) {
+            BatchOptions options;
+            options.workers = workers;
+            options.maxInFlight = cap;
+            checkRun(options, inputs);
+        }
+    }
+    BatchOptions single;
+    single.readers = single.workers = single.writers = single.maxInFlight = 1;
+    checkRun(single, inputs);
+
+    // An empty batch starts no threads and returns nothing
+    CHECK(BatchProcessor().run({}, BatchProcessor::inDirectory(OUT), [](RGBImage image, const std::string&) { return image; }).empty());
+    CHECK(BatchProcessor::inDirectory("out")("a/b/c.bmp") == "out/c.bmp");
+    CHECK(BatchProcessor::inDirectory("out")("c.bmp") == "out/c.bmp");
+
+    for (int i = 0; i < FILES; i++) std::remove(inputPath(i).c_str());
+    std::remove(corrupt.c_str());
+    rmdir(IN);
+    rmdir(OUT);
+    return testResult();
+}
@@ -0,0 +1,249 @@
+// Feeds the BMP readers hand-built files with malformed headers: RLE
+// compression on the wrong bit depth, bit counts past any color table,
+// oversized and truncated palettes, INT_MIN heights, truncated and zero
+// bit field masks, and random RLE streams. Every file must either decode
+// to an image of the declared size or throw std::runtime_error. Build
+// with -fsanitize=address,undefined to check that nothing reads out of
+// bounds on the way.
+
+#include "ImgProc.hpp"
+#include "test_common.hpp"
+#include <random>
+
+static const char* const PATH = "bmp_decoder_test.bmp";
+
+// A 40-byte info header, then an optional color table or masks, then data
+struct BmpFile {
+    int32_t width = 4, height = 4;
+    uint16_t bits = 8;
+    uint32_t compression = BI_RGB;
+    uint32_t imageSize = 0;
+    uint32_t colorsUsed = 0;
+    std::vector<uint8_t> table;     // Palette entries or bit field masks
+    std::vector<uint8_t> data;
+
+    void write() const {
+        std::vector<uint8_t> bytes;
+        auto put16 = [&](uint32_t v) { bytes.push_back(static_cast<uint8_t>(v)); bytes.push_back(static_cast<uint8_t>(v >> 8)); };
+        auto put32 = [&](uint32_t v) { put16(v & 0xFFFF); put16(v >> 16); };
+        uint32_t offset = 14 + 40 + static_cast<uint32_t>(table.size());
+
+        put16(0x4D42); put32(offset + static_cast<uint32_t>(data.size())); put16(0); put16(0); put32(offset);
+        put32(40); put32(static_cast<uint32_t>(width)); put32(static_cast<uint32_t>(height)); put16(1); put16(bits);
+        put32(compression); put32(imageSize); put32(0); put32(0); put32(colorsUsed); put32(0);
+        bytes.insert(bytes.end(), table.begin(), table.end());
+        bytes.insert(bytes.end(), data.begin(), data.end());
+
+        FILE* file = std::fopen(PATH, "wb");
+        std::fwrite(bytes.data(), 1, bytes.size(), file);
+        std::fclose(file);
+    }
+};
+
+static std::vector<uint8_t> junk(std::size_t size, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::vector<uint8_t> bytes(size);
+    for (uint8_t& byte : bytes) byte = static_cast<uint8_t>(rng());
+    return bytes;
+}
+
+// Gray palette of `colors` entries
+static std::vector<uint8_t> grayTable(int colors) {
+    std::vector<uint8_t> table;
+    for (int i = 0; i < colors; i++) {
+        uint8_t v = static_cast<uint8_t>(i * 255 / std::max(colors - 1, 1));
+        table.insert(table.end(), { v, v, v, 0 });
+    }
+    return table;
+}
+
+// Runs f on the file and reports whether it threw std::runtime_error
+template <typename F>
+static bool throws(F f) {
+    try {
+        f();
+    } catch (const std::runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+static bool rgbThrows() { return throws([] { RGBImage::fromFile(PATH); }); }
+static bool grayThrows() { return throws([] { GrayImage::fromFile(PATH); }); }
+
+static void checkRLEHeaders() {
+    // RLE8 declared on 24-bit pixels: no color table may be read for it
+    BmpFile file;
+    file.bits = 24;
+    file.compression = BI_RLE8;
+    file.data = junk(5000, 1);
+    file.write();
+    CHECK_MESSAGE(rgbThrows(), "RLE8 with 24-bit pixels was accepted");
+    CHECK_MESSAGE(grayThrows(), "RLE8 with 24-bit pixels was accepted as gray");
+
+    // Bit counts that would shift 1 past its width
+    for (uint16_t bits : { 32, 64, 200, 32024 }) {
+        file.bits = bits;
+        file.write();
+        CHECK_MESSAGE(rgbThrows(), "RLE8 with %d-bit pixels was accepted", bits);
+    }
+
+    file.bits = 8;
+    file.compression = BI_RLE4;
+    file.write();
+    CHECK_MESSAGE(rgbThrows() && grayThrows(), "RLE4 with 8-bit pixels was accepted");
+    file.bits = 4;
+    file.compression = BI_RLE8;
+    file.write();
+    CHECK_MESSAGE(rgbThrows() && grayThrows(), "RLE8 with 4-bit pixels was accepted");
+
+    // Compressed files cannot be top-down
+    file.bits = 8;
+    file.height = -4;
+    file.table = grayTable(256);
+    file.data = { 4, 1, 0, 0, 4, 2, 0, 1 };
+    file.write();
+    CHECK_MESSAGE(rgbThrows() && grayThrows(), "top-down RLE8 was accepted");
+}
+
+static void checkHeights() {
+    BmpFile file;
+    file.height = std::numeric_limits<int32_t>::min();
+    file.table = grayTable(256);
+    file.data = junk(64, 2);
+    file.write();
+    CHECK_MESSAGE(rgbThrows() && grayThrows(), "an INT_MIN height was accepted for 8-bit pixels");
+
+    file.bits = 24;
+    file.table.clear();
+    file.write();
+    CHECK_MESSAGE(rgbThrows(), "an INT_MIN height was accepted for 24-bit pixels");
+    CHECK_MESSAGE(throws([] { MappedBMP mapped(PATH); }), "MappedBMP accepted an INT_MIN height");
+    CHECK_MESSAGE(throws([] { BMPStripReader reader(PATH, 4); }), "BMPStripReader accepted an INT_MIN height");
+
+    file.bits = 8;
+    file.compression = BI_RLE8;
+    file.table = grayTable(256);
+    file.write();
+    CHECK_MESSAGE(rgbThrows() && grayThrows(), "an INT_MIN height was accepted for RLE8");
+}
+
+static void checkPalettes() {
+    // A color count past 256 is clamped; the table holds all 256 entries
+    BmpFile file;
+    file.colorsUsed = 100000;
+    file.table = grayTable(256);
+    file.data = { 0, 85, 170, 255, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12 };
+    file.write();
+    bool threw = false;
+    try {
+        RGBImage rgb = RGBImage::fromFile(PATH);
+        GrayImage gray = GrayImage::fromFile(PATH);
+        CHECK(rgb.height == 4 && rgb.width == 4 && gray.height == 4 && gray.width == 4);
+        // Bottom-up: the first stored row is the last image row
+        CHECK(rgb[3][1].rgbtRed == 85 && gray[3][2] == 170 && gray[0][3] == 12);
+    } catch (const std::runtime_error& e) {
+        threw = true;
+        std::printf("%s\n", e.what());
+    }
+    CHECK_MESSAGE(!threw, "a clamped color count failed to decode");
+
+    // A table cut short by the end of the file
+    file.colorsUsed = 0;
+    file.table = grayTable(3);
+    file.data.clear();
+    file.write();
+    CHECK_MESSAGE(rgbThrows() && grayThrows(), "a truncated color table was accepted");
+
+    // 1-bit pixels with a two-entry table
+    file.bits = 1;
+    file.table = grayTable(2);
+    file.data = { 0x90, 0, 0, 0, 0x60, 0, 0, 0, 0xF0, 0, 0, 0, 0x00, 0, 0, 0 };
+    file.write();
+    GrayImage bits = GrayImage::fromFile(PATH);
+    CHECK(bits[3][0] == 255 && bits[3][1] == 0 && bits[3][3] == 255 && bits[2][1] == 255 && bits[1][2] == 255 && bits[0][0] == 0);
+
+    // 24-bit pixels have no color table, whatever biClrUsed says
+    file.bits = 24;
+    file.colorsUsed = 16;
+    file.compression = BI_RLE8;
+    file.write();
+    CHECK_MESSAGE(rgbThrows(), "24-bit pixels with a color count were read through a palette");
+}
+
+static void checkBitfields() {
+    // 16-bit 5-6-5
+    BmpFile file;
+    file.bits = 16;
+    file.width = 2;
+    file.height = 1;
+    file.compression = BI_BITFIELDS;
+    file.table = { 0x00, 0xF8, 0, 0, 0xE0, 0x07, 0, 0, 0x1F, 0x00, 0, 0 };
+    file.data = { 0x00, 0xF8, 0x1F, 0x00 };    // Pure red, pure blue
+    file.write();
+    RGBImage image = RGBImage::fromFile(PATH);
+    CHECK(image[0][0].rgbtRed == 255 && image[0][0].rgbtGreen == 0 && image[0][0].rgbtBlue == 0);
+    CHECK(image[0][1].rgbtRed == 0 && image[0][1].rgbtGreen == 0 && image[0][1].rgbtBlue == 255);
+
+    // Zero masks read as zero instead of dividing by zero
+    file.table.assign(12, 0);
+    file.write();
+    image = RGBImage::fromFile(PATH);
+    CHECK(image[0][0].rgbtRed == 0 && image[0][1].rgbtBlue == 0);
+
+    // Full-width masks on 32-bit pixels
+    file.bits = 32;
+    file.table = { 0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0, 0, 0, 0, 0 };
+    file.data = { 0xFF, 0xFF, 0xFF, 0xFF, 0, 0, 0, 0 };
+    file.write();
+    image = RGBImage::fromFile(PATH);
+    CHECK(image[0][0].rgbtRed == 255 && image[0][1].rgbtRed == 0);
+
+    // Masks cut short by the end of the file
+    file.table = { 0xFF, 0 };
+    file.data.clear();
+    file.write();
+    CHECK_MESSAGE(rgbThrows(), "truncated bit field masks were accepted");
+
+    // Pixel data cut short
+    file.table.assign(12, 0xFF);
+    file.data = { 1, 2, 3 };
+    file.write();
+    CHECK_MESSAGE(rgbThrows(), "truncated 32-bit pixel data was accepted");
+}
+
+// Random RLE streams, some with a size field far past the end of the file
+static void checkRandomRLE() {
+    std::mt19937 rng(3);
+    int bad = 0;
+    for (int i = 0; i < 400; i++) {
+        BmpFile file;
+        bool rle4 = i % 2;
+        file.bits = rle4 ? 4 : 8;
+        file.compression = rle4 ? BI_RLE4 : BI_RLE8;
+        file.width = 1 + static_cast<int>(rng() % 40);
+        file.height = 1 + static_cast<int>(rng() % 40);
+        file.table = grayTable(rle4 ? 16 : 256);
+        file.data = junk(rng() % 600, static_cast<unsigned>(i) + 100);
+        file.imageSize = i % 3 == 0 ? 0xFFFFFFFF : static_cast<uint32_t>(file.data.size());
+        file.write();
+        try {
+            RGBImage rgb = RGBImage::fromFile(PATH);
+            GrayImage gray = GrayImage::fromFile(PATH);
+            bad += rgb.height != file.height || rgb.width != file.width || gray.height != file.height || gray.width != file.width;
+        } catch (const std::runtime_error&) {
+            bad++;
+        }
+    }
+    CHECK_MESSAGE(bad == 0, "%d random RLE streams did not decode to the declared size", bad);
+}
+
+int main() {
+    checkRLEHeaders();
+    checkHeights();
+    checkPalettes();
+    checkBitfields();
+    checkRandomRLE();
+    std::remove(PATH);
+    return testResult();
+}
@@ -0,0 +1,88 @@
+// Checks that convolution with an exactly representable kernel is exact:
+// Matrix::convolve must match submatrix(...).dot(kernel) on the interior,
+// separable or not, and GrayImage::convolve must match
+// fromMatrix(toMatrix().convolve(...)) everywhere, for the runtime and
+// the FixedMatrix kernels alike.
+
+#include "ImgProc.hpp"
+#include "test_common.hpp"
+#include <random>
+
+static GrayImage noise(int height, int width, unsigned seed) {
+    std::mt19937 rng(seed);
+    GrayImage image(height, width);
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++) image[y][x] = static_cast<uint8_t>(rng());
+    return image;
+}
+
+static int differences(const Matrix& a, const Matrix& b) {
+    int count = 0;
+    for (int y = 0; y < a.height; y++)
+        for (int x = 0; x < a.width; x++) count += a[y][x] != b[y][x];
+    return count;
+}
+
+static int differences(const GrayImage& a, const GrayImage& b) {
+    int count = 0;
+    for (int y = 0; y < a.height; y++)
+        for (int x = 0; x < a.width; x++) count += a[y][x] != b[y][x];
+    return count;
+}
+
+// Interior pixels against the dot product of the window
+static void checkAgainstDot(const char* name, const Matrix& image, const Matrix& kernel, const Matrix& result) {
+    int wrong = 0;
+    for (int y = kernel.height / 2; y + kernel.height - kernel.height / 2 <= image.height; y++)
+        for (int x = kernel.width / 2; x + kernel.width - kernel.width / 2 <= image.width; x++)
+            wrong += result[y][x] != image.submatrix(y - kernel.height / 2, x - kernel.width / 2, kernel.height, kernel.width).dot(kernel);
+    CHECK_MESSAGE(wrong == 0, "%s: %d interior pixels differ from dot()", name, wrong);
+}
+
+template <int H, int W, typename K>
+static void checkKernel(const char* name, const FixedMatrix<H, W, K>& fixed, const GrayImage& image) {
+    Matrix kernel = fixed.toMatrix(), source = image.toMatrix();
+
+    Matrix runtime = source.convolve(kernel), unrolled = source.convolve(fixed);
+    checkAgainstDot(name, source, kernel, runtime);
+    CHECK_MESSAGE(differences(runtime, unrolled) == 0, "%s: FixedMatrix overload differs from the runtime one", name);
+
+    for (Narrowing narrowing : { Narrowing::TRUNCATE, Narrowing::SATURATE }) {
+        for (BorderMode border : { BorderMode::REPLICATE, BorderMode::REFLECT, BorderMode::CONSTANT, BorderMode::WRAP }) {
+            GrayImage expected = GrayImage::fromMatrix(source.convolve(kernel, border, 7), narrowing);
+            int direct = differences(image.convolve(kernel, border, 7, narrowing), expected);
+            int fixedDiff = differences(image.convolve(fixed, border, 7, narrowing), expected);
+            CHECK_MESSAGE(direct == 0 && fixedDiff == 0, "%s, border %d, narrowing %d: GrayImage::convolve differs in %d (runtime) and %d (fixed) pixels",
+                          name, static_cast<int>(border), static_cast<int>(narrowing), direct, fixedDiff);
+        }
+    }
+}
+
+int main() {
+    GrayImage image = noise(300, 1100, 1);
+
+    // The regression: 6/36 is not a double, so a row scaled by the pivot
+    // gave 126.99999999999999 where the exact sum is 127
+    checkKernel("binomial<5> / 256", FixedKernel::binomial<5>().convertTo<double>() * (1.0 / 256), image);
+    checkKernel("gaussian<5>", FixedKernel::gaussian<5>(), image);
+    checkKernel("gaussian<3>", FixedKernel::gaussian<3>(), image);
+    checkKernel("gaussian<7>", FixedKernel::gaussian<7>(), image);
+    checkKernel("binomial<5>", FixedKernel::binomial<5>(), image);
+    checkKernel("sobelX", FixedKernel::sobelX(), image);
+    checkKernel("laplacian", FixedKernel::laplacian(), image);
+    checkKernel("3 x 1 / 3", FixedMatrix<3, 1, double>{{ 1.0 / 3, 2.0 / 3, 1.0 / 3 }}, image);
+    checkKernel("outer 3 6 3 / 72", FixedMatrix<3, 3, double>{{ 9.0 / 72, 18.0 / 72, 9.0 / 72, 18.0 / 72, 36.0 / 72, 18.0 / 72, 9.0 / 72, 18.0 / 72, 9.0 / 72 }}, image);
+
+    // Separable but not dyadic: within rounding of dot()
+    Matrix box(3, 3);
+    for (int y = 0; y < 3; y++)
+        for (int x = 0; x < 3; x++) box[y][x] = 1.0 / 9;
+    Matrix source = image.toMatrix(), blurred = source.convolve(box);
+    int wrong = 0;
+    for (int y = 1; y < source.height - 1; y++)
+        for (int x = 1; x < source.width - 1; x++)
+            wrong += std::abs(blurred[y][x] - source.submatrix(y - 1, x - 1, 3, 3).dot(box)) > 1e-12 * 255;
+    CHECK_MESSAGE(wrong == 0, "box 1/9: %d interior pixels further than rounding from dot()", wrong);
+
+    return testResult();
+}
@@ -0,0 +1,17 @@
+// Built together with link_second.cpp: every definition in ImgProc.hpp must
+// be inline or a template, or the two translation units fail to link.
+
+#include "ImgProc.hpp"
+#include "test_common.hpp"
+
+GrayImage grayFromSecond(const RGBImage& image);
+
+int main() {
+    RGBImage image(4, 5);
+    image[1][2] = { 30, 60, 90 };
+    GrayImage first = image.toGray(ColorSpace::HSI);
+    GrayImage second = grayFromSecond(image);
+    CHECK(first[1][2] == 60 && second[1][2] == 60);
+    CHECK(&ThreadPool::instance() == &ThreadPool::instance());
+    return testResult();
+}
@@ -0,0 +1,7 @@
+// The second translation unit of the link test, see link_first.cpp
+
+#include "ImgProc.hpp"
+
+GrayImage grayFromSecond(const RGBImage& image) {
+    return RGBImage(image).toGray(ColorSpace::HSI);
+}
@@ -0,0 +1,53 @@
+// Checks Matrix assignment from expressions whose leaves alias the target:
+// a view of the matrix itself, alone or inside an element-wise expression,
+// with the same shape or a new one. Build with -fsanitize=address to check
+// that no leaf is read after the target's buffer is replaced.
+
+#include "ImgProc.hpp"
+#include "test_common.hpp"
+
+// 4x4 with element (y, x) = 10 y + x
+static Matrix numbered() {
+    Matrix m(4, 4);
+    for (int y = 0; y < 4; y++)
+        for (int x = 0; x < 4; x++) m[y][x] = 10 * y + x;
+    return m;
+}
+
+// Whether m holds scale * (10 (y + y0) + x + x0) + offset
+static bool holds(const Matrix& m, int height, int width, int y0, int x0, double scale, double offset) {
+    if (m.height != height || m.width != width) return false;
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+            if (m[y][x] != scale * (10 * (y + y0) + x + x0) + offset) return false;
+    return true;
+}
+
+int main() {
+    Matrix m = numbered();
+    m = m.submatrix(1, 1, 2, 2);
+    CHECK_MESSAGE(holds(m, 2, 2, 1, 1, 1, 0), "m = m.submatrix(1, 1, 2, 2)");
+
+    m = numbered();
+    m = 2.0 * m.submatrix(1, 1, 2, 2);
+    CHECK_MESSAGE(holds(m, 2, 2, 1, 1, 2, 0), "m = 2 * m.submatrix(1, 1, 2, 2)");
+
+    m = numbered();
+    m = m.submatrix(0, 1, 3, 3) + m.submatrix(1, 0, 3, 3) * 0.0 + 1.0;
+    CHECK_MESSAGE(holds(m, 3, 3, 0, 1, 1, 1), "m = m.submatrix(0, 1, 3, 3) + ...");
+
+    m = numbered();
+    m = m.submatrix(2, 0, 2, 4);
+    CHECK_MESSAGE(holds(m, 2, 4, 2, 0, 1, 0), "m = m.submatrix(2, 0, 2, 4)");
+
+    // Same shape: evaluated in place
+    m = numbered();
+    m = -m.submatrix(0, 0, 4, 4) + m;
+    CHECK_MESSAGE(holds(m, 4, 4, 0, 0, 0, 0), "m = -m + m");
+
+    m = numbered();
+    m = m * 3.0;
+    CHECK_MESSAGE(holds(m, 4, 4, 0, 0, 3, 0), "m = m * 3");
+
+    return testResult();
+}
@@ -0,0 +1,168 @@
+// Checks that every ISA variant of the color row kernels (gray HSI and YCC,
+// channel extraction, split and merge) matches the scalar reference bit for
+// bit on all 2^24 RGB colors and on every tail width up to twice the widest
+// vector. The public toGray, getChannel and fromGrays are checked the same
+// way, so the IMGPROC_NO_SIMD build of this file covers the scalar paths.
+
+#include "ImgProc.hpp"
+#include "test_common.hpp"
+#include <random>
+
+using detail::ColorKernels;
+
+struct Variant {
+    const char* name;
+    ColorKernels kernels;
+};
+
+static std::vector<Variant> variants() {
+    std::vector<Variant> list;
+    list.push_back({ "scalar", { detail::grayHSIRowScalar, detail::grayYCCRowScalar, detail::channelRowScalar, detail::mergeRowScalar, detail::splitRowScalar } });
+#ifdef IMGPROC_X86_SIMD
+    const detail::CpuFeatures& cpu = detail::cpuFeatures();
+    if (cpu.ssse3)
+        list.push_back({ "ssse3", { detail::grayHSIRowSsse3, detail::grayYCCRowSsse3, detail::channelRowSsse3, detail::mergeRowSsse3, detail::splitRowSsse3 } });
+    else
+        std::printf("ssse3 not supported, skipped\n");
+    if (cpu.avx2)
+        list.push_back({ "avx2", { detail::grayHSIRowAvx2, detail::grayYCCRowAvx2, detail::channelRowAvx2, detail::mergeRowAvx2, detail::splitRowAvx2 } });
+    else
+        std::printf("avx2 not supported, skipped\n");
+#endif
+    list.push_back({ "dispatched", detail::colorKernels() });
+    return list;
+}
+
+// Row y holds colors 4096 y to 4096 y + 4095, blue in the low byte
+static RGBTRIPLE color(int index) {
+    return { static_cast<uint8_t>(index), static_cast<uint8_t>(index >> 8), static_cast<uint8_t>(index >> 16) };
+}
+
+// Runs every kernel of `k` on n pixels and compares with the per-pixel
+// definitions. Outputs get guard bytes after n that must stay untouched.
+static void checkRow(const Variant& variant, const RGBTRIPLE* src, int n, int row) {
+    const ColorKernels& k = variant.kernels;
+    const uint8_t guard = 0xA5;
+    std::vector<uint8_t> out(n + 64, guard), b(n + 64, guard), g(n + 64, guard), r(n + 64, guard);
+    std::vector<RGBTRIPLE> merged(n + 64, RGBTRIPLE{ guard, guard, guard });
+    int wrong = 0;
+
+    k.grayHSI(src, out.data(), n);
+    for (int x = 0; x < n; x++) wrong += out[x] != detail::grayHSI(src[x]);
+    for (int x = n; x < n + 64; x++) wrong += out[x] != guard;
+    CHECK_MESSAGE(wrong == 0, "%s grayHSI: %d wrong bytes, row %d, n %d", variant.name, wrong, row, n);
+
+    wrong = 0;
+    k.grayYCC(src, out.data(), n);
+    for (int x = 0; x < n; x++) wrong += out[x] != detail::grayYCC(src[x]);
+    for (int x = n; x < n + 64; x++) wrong += out[x] != guard;
+    CHECK_MESSAGE(wrong == 0, "%s grayYCC: %d wrong bytes, row %d, n %d", variant.name, wrong, row, n);
+
+    for (int channel = 0; channel < 3; channel++) {
+        wrong = 0;
+        k.channel(src, out.data(), n, channel);
+        for (int x = 0; x < n; x++) wrong += out[x] != reinterpret_cast<const uint8_t*>(src + x)[channel];
+        for (int x = n; x < n + 64; x++) wrong += out[x] != guard;
+        CHECK_MESSAGE(wrong == 0, "%s channel %d: %d wrong bytes, row %d, n %d", variant.name, channel, wrong, row, n);
+    }
+
+    wrong = 0;
+    k.split(src, b.data(), g.data(), r.data(), n);
+    for (int x = 0; x < n; x++) wrong += b[x] != src[x].rgbtBlue || g[x] != src[x].rgbtGreen || r[x] != src[x].rgbtRed;
+    for (int x = n; x < n + 64; x++) wrong += b[x] != guard || g[x] != guard || r[x] != guard;
+    CHECK_MESSAGE(wrong == 0, "%s split: %d wrong pixels, row %d, n %d", variant.name, wrong, row, n);
+
+    wrong = 0;
+    k.merge(b.data(), g.data(), r.data(), merged.data(), n);
+    for (int x = 0; x < n; x++) wrong += std::memcmp(&merged[x], &src[x], sizeof(RGBTRIPLE)) != 0;
+    for (int x = n; x < n + 64; x++) wrong += merged[x].rgbtBlue != guard || merged[x].rgbtGreen != guard || merged[x].rgbtRed != guard;
+    CHECK_MESSAGE(wrong == 0, "%s merge: %d wrong pixels, row %d, n %d", variant.name, wrong, row, n);
+}
+
+static void checkAllColors(const std::vector<Variant>& list) {
+    std::vector<RGBTRIPLE> row(4096);
+    for (int y = 0; y < 4096; y++) {
+        for (int x = 0; x < 4096; x++) row[x] = color(4096 * y + x);
+        for (const Variant& variant : list) checkRow(variant, row.data(), 4096, y);
+    }
+}
+
+// Widths 0 to 65 from every start offset within a pixel group, so each
+// variant's vector loop and scalar tail meet at every possible split
+static void checkTails(const std::vector<Variant>& list) {
+    std::mt19937 rng(7);
+    std::vector<RGBTRIPLE> pixels(128);
+    for (RGBTRIPLE& pixel : pixels) pixel = color(static_cast<int>(rng() & 0xFFFFFF));
+    // Lanes where YCC sits exactly on a multiple of 1000 take the fix-up path
+    pixels[3] = { 0, 0, 0 };
+    pixels[5] = { 255, 255, 255 };
+    pixels[40] = { 114, 0, 0 };
+
+    for (int offset = 0; offset < 4; offset++)
+        for (int n = 0; n <= 65; n++)
+            for (const Variant& variant : list) checkRow(variant, pixels.data() + offset, n, -1);
+}
+
+// The public operations, whatever kernels they dispatch to
+static void checkImages() {
+    RGBImage all(4096, 4096);
+    for (int y = 0; y < 4096; y++)
+        for (int x = 0; x < 4096; x++) all[y][x] = color(4096 * y + x);
+
+    GrayImage hsi = all.toGray(ColorSpace::HSI), ycc = all.toGray(ColorSpace::YCC);
+    GrayImage b = all.getChannel(Channel::BLUE), g = all.getChannel(Channel::GREEN), r = all.getChannel(Channel::RED);
+    RGBImage merged = RGBImage::fromGrays(b, g, r);
+    int wrong[6] = {};
+    for (int y = 0; y < 4096; y++) {
+        for (int x = 0; x < 4096; x++) {
+            RGBTRIPLE pixel = all[y][x];
+            wrong[0] += hsi[y][x] != detail::grayHSI(pixel);
+            wrong[1] += ycc[y][x] != detail::grayYCC(pixel);
+            wrong[2] += b[y][x] != pixel.rgbtBlue;
+            wrong[3] += g[y][x] != pixel.rgbtGreen;
+            wrong[4] += r[y][x] != pixel.rgbtRed;
+            wrong[5] += std::memcmp(&merged[y][x], &pixel, sizeof(RGBTRIPLE)) != 0;
+        }
+    }
+    const char* names[6] = { "toGray(HSI)", "toGray(YCC)", "getChannel(BLUE)", "getChannel(GREEN)", "getChannel(RED)", "fromGrays" };
+    for (int i = 0; i < 6; i++) CHECK_MESSAGE(wrong[i] == 0, "%s: %d wrong pixels over all colors", names[i], wrong[i]);
+
+    std::mt19937 rng(11);
+    for (int width = 1; width <= 65; width++) {
+        RGBImage small(3, width);
+        for (int y = 0; y < 3; y++)
+            for (int x = 0; x < width; x++) small[y][x] = color(static_cast<int>(rng() & 0xFFFFFF));
+        GrayImage gray = small.toGray(ColorSpace::YCC), red = small.getChannel(Channel::RED);
+        RGBImage back = RGBImage::fromGrays(small.getChannel(Channel::BLUE), small.getChannel(Channel::GREEN), red);
+        int bad = 0;
+        for (int y = 0; y < 3; y++)
+            for (int x = 0; x < width; x++)
+                bad += gray[y][x] != detail::grayYCC(small[y][x]) || red[y][x] != small[y][x].rgbtRed ||
+                       std::memcmp(&back[y][x], &small[y][x], sizeof(RGBTRIPLE)) != 0;
+        CHECK_MESSAGE(bad == 0, "width %d: %d wrong pixels", width, bad);
+    }
+
+    // Planes of different shapes are refused rather than read past their end
+    GrayImage plane(4, 6), wide(4, 7), tall(5, 6);
+    for (int mismatched = 0; mismatched < 3; mismatched++) {
+        bool threw = false;
+        try {
+            RGBImage::fromGrays(mismatched == 0 ? wide : plane, mismatched == 1 ? tall : plane, mismatched == 2 ? wide : plane);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        CHECK_MESSAGE(threw, "fromGrays accepted a mismatched plane %d", mismatched);
+    }
+}
+
+int main() {
+    std::vector<Variant> list = variants();
+    std::printf("variants:");
+    for (const Variant& variant : list) std::printf(" %s", variant.name);
+    std::printf("\n");
+
+    checkAllColors(list);
+    checkTails(list);
+    checkImages();
+    return testResult();
+}
@@ -0,0 +1,26 @@
+// Checks shared by the programs in tests/. Each program returns
+// testResult() from main, so ctest counts a failed check as a failed test.
+
+#ifndef IMGPROC_TEST_COMMON_HPP
+#define IMGPROC_TEST_COMMON_HPP
+
+#include <cstdio>
+
+inline int& testFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+// Reports the failure and carries on, so one run lists every broken case
+#define CHECK(condition) \
+    ((condition) ? (void)0 : (std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition), (void)testFailures()++))
+
+#define CHECK_MESSAGE(condition, ...) \
+    ((condition) ? (void)0 : (std::fprintf(stderr, "%s:%d: ", __FILE__, __LINE__), std::fprintf(stderr, __VA_ARGS__), std::fprintf(stderr, "\n"), (void)testFailures()++))
+
+inline int testResult() {
+    if (testFailures()) std::fprintf(stderr, "%d check(s) failed\n", testFailures());
+    return testFailures() ? 1 : 0;
+}
+
+#endif